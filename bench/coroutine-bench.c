@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xcp-ng/generic/coroutine.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/string.h"
+
+// =============================================================================
+
+// Coroutine microbenchmarks.
+//
+// Each benchmark is executed `sampleCount` times (after one warmup sample) with a fixed
+// count of operations per sample. The ns/op of the samples give the percentiles.
+// The syscalls are counted with the raw_syscalls:sys_enter tracepoint if perf is
+// available for the current user (see perf_event_paranoid), otherwise they are not reported.
+//
+// Usage: coroutine-bench [--json] [--samples N] [--cpu N] [FILTER]
+
+#define DEFAULT_SAMPLE_COUNT 30
+
+typedef struct {
+  const char *name;
+
+  // Count of operations executed by one call of `run`.
+  size_t opCount;
+
+  void (*setup)();
+  void (*run)();
+  void (*teardown)();
+} Bench;
+
+typedef struct {
+  bool json;
+  size_t sampleCount;
+  int cpu;
+  const char *filter;
+} Options;
+
+static inline ulonglong now_ns () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ulonglong)ts.tv_sec * 1000000000ULL + (ulonglong)ts.tv_nsec;
+}
+
+// -----------------------------------------------------------------------------
+// Syscall counter.
+// -----------------------------------------------------------------------------
+
+static int open_syscall_counter () {
+  static const char *paths[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+  };
+
+  for (size_t i = 0; i < XCP_ARRAY_LEN(paths); ++i) {
+    FILE *file = fopen(paths[i], "r");
+    if (!file)
+      continue;
+
+    char buf[32];
+    const bool read = fgets(buf, sizeof buf, file) != NULL;
+    fclose(file);
+
+    bool ok;
+    const longlong id = read ? xcp_str_to_longlong(buf, &ok) : 0;
+    if (!read || !ok)
+      continue;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof attr;
+    attr.config = (__u64)id;
+    attr.disabled = 1;
+    attr.exclude_hv = 1;
+
+    const int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd >= 0)
+      return fd;
+  }
+
+  return -1;
+}
+
+static ulonglong read_syscall_counter (int fd) {
+  uint64_t value = 0;
+  if (fd < 0 || read(fd, &value, sizeof value) != sizeof value)
+    return 0;
+  return value;
+}
+
+// -----------------------------------------------------------------------------
+// Benchmarks.
+// -----------------------------------------------------------------------------
+
+#define CREATE_OP_COUNT 100000
+#define PING_PONG_OP_COUNT 1000000
+#define CASCADE_DEPTH 64
+#define CASCADE_OP_COUNT (CASCADE_DEPTH * 1000)
+#define FAN_OUT_OP_COUNT 10000
+#define MANY_COROUTINE_COUNT 10000
+#define MANY_ROUND_COUNT 20
+
+// Set by the teardowns to end the loops of the live coroutines at their next resume.
+static bool StopLoops;
+
+static XcpCoroutine *create_coroutine (XcpCoroutineCb cb, void *userData) {
+  XcpCoroutine *coroutine = xcp_coroutine_create(cb, userData);
+  if (!coroutine)
+    abort();
+  return coroutine;
+}
+
+static void noop_cb (void *userData) {
+  XCP_UNUSED(userData);
+}
+
+static void yield_loop_cb (void *userData) {
+  XCP_UNUSED(userData);
+  while (!StopLoops)
+    xcp_coroutine_yield();
+}
+
+// Let a live coroutine return: its stack goes back to the pool for the next benchmarks.
+static void stop_loop (XcpCoroutine *coroutine) {
+  StopLoops = true;
+  xcp_coroutine_resume(coroutine);
+  StopLoops = false;
+}
+
+// Create + run to completion: the stack is recycled by the pool.
+static void bench_create_pooled () {
+  for (size_t i = 0; i < CREATE_OP_COUNT; ++i)
+    xcp_coroutine_resume(create_coroutine(noop_cb, NULL));
+}
+
+static void setup_no_pool () {
+  xcp_coroutine_pool_set_watermarks(0, 0);
+}
+
+static void teardown_no_pool () {
+  xcp_coroutine_pool_set_watermarks(XCP_COROUTINE_POOL_LOW_WATERMARK, XCP_COROUTINE_POOL_HIGH_WATERMARK);
+}
+
+// Create + run to completion: mmap/munmap of the stack for each coroutine.
+static void bench_create_unpooled () {
+  for (size_t i = 0; i < CREATE_OP_COUNT / 10; ++i)
+    xcp_coroutine_resume(create_coroutine(noop_cb, NULL));
+}
+
+// Resume + yield round-trip.
+static XcpCoroutine *PingPong;
+
+static void setup_ping_pong () {
+  PingPong = create_coroutine(yield_loop_cb, NULL);
+}
+
+static void teardown_ping_pong () {
+  stop_loop(PingPong);
+  PingPong = NULL;
+}
+
+static void bench_ping_pong () {
+  XcpCoroutine *coroutine = PingPong;
+  for (size_t i = 0; i < PING_PONG_OP_COUNT; ++i)
+    xcp_coroutine_resume(coroutine);
+}
+
+// Each coroutine processes a child: the pending lists are concatenated up to the root.
+static void cascade_cb (void *userData) {
+  const size_t depth = (size_t)userData;
+  if (depth > 1)
+    xcp_coroutine_process(create_coroutine(cascade_cb, (void *)(depth - 1)));
+}
+
+static void bench_cascade () {
+  for (size_t i = 0; i < CASCADE_OP_COUNT / CASCADE_DEPTH; ++i)
+    xcp_coroutine_resume(create_coroutine(cascade_cb, (void *)(size_t)CASCADE_DEPTH));
+}
+
+// One coroutine processes many children.
+static void fan_out_cb (void *userData) {
+  XCP_UNUSED(userData);
+  for (size_t i = 0; i < FAN_OUT_OP_COUNT - 1; ++i)
+    xcp_coroutine_process(create_coroutine(noop_cb, NULL));
+}
+
+static void bench_fan_out () {
+  xcp_coroutine_resume(create_coroutine(fan_out_cb, NULL));
+}
+
+// Round-robin over many live coroutines: their stacks do not fit in the caches.
+static XcpCoroutine **Coroutines;
+
+static void setup_many () {
+  Coroutines = malloc(MANY_COROUTINE_COUNT * sizeof *Coroutines);
+  if (!Coroutines)
+    abort();
+  for (size_t i = 0; i < MANY_COROUTINE_COUNT; ++i)
+    Coroutines[i] = create_coroutine(yield_loop_cb, NULL);
+}
+
+static void teardown_many () {
+  for (size_t i = 0; i < MANY_COROUTINE_COUNT; ++i)
+    stop_loop(Coroutines[i]);
+  free(Coroutines);
+  Coroutines = NULL;
+}
+
+static void bench_many () {
+  for (size_t round = 0; round < MANY_ROUND_COUNT; ++round)
+    for (size_t i = 0; i < MANY_COROUTINE_COUNT; ++i)
+      xcp_coroutine_resume(Coroutines[i]);
+}
+
+static const Bench Benchs[] = {
+  { "create-pooled", CREATE_OP_COUNT, NULL, bench_create_pooled, NULL },
+  { "create-unpooled", CREATE_OP_COUNT / 10, setup_no_pool, bench_create_unpooled, teardown_no_pool },
+  { "ping-pong", PING_PONG_OP_COUNT, setup_ping_pong, bench_ping_pong, teardown_ping_pong },
+  { "pending-cascade", CASCADE_OP_COUNT, NULL, bench_cascade, NULL },
+  { "process-fan-out", FAN_OUT_OP_COUNT, NULL, bench_fan_out, NULL },
+  { "many-coroutines", MANY_COROUTINE_COUNT * MANY_ROUND_COUNT, setup_many, bench_many, teardown_many }
+};
+
+// -----------------------------------------------------------------------------
+
+static int compare_double (const void *a, const void *b) {
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile (const double *sorted, size_t count, double p) {
+  const size_t index = (size_t)(p * (double)(count - 1) + 0.5);
+  return sorted[index];
+}
+
+static void run_bench (const Bench *bench, const Options *options, int syscallFd) {
+  double *samples = malloc(options->sampleCount * sizeof *samples);
+  if (!samples)
+    abort();
+
+  if (bench->setup)
+    (*bench->setup)();
+
+  // Warmup: fill the pools and the caches.
+  (*bench->run)();
+
+  ulonglong syscallCount = 0;
+  for (size_t i = 0; i < options->sampleCount; ++i) {
+    if (syscallFd >= 0) {
+      ioctl(syscallFd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(syscallFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    const ulonglong start = now_ns();
+    (*bench->run)();
+    const ulonglong end = now_ns();
+
+    if (syscallFd >= 0) {
+      ioctl(syscallFd, PERF_EVENT_IOC_DISABLE, 0);
+      syscallCount += read_syscall_counter(syscallFd);
+    }
+
+    samples[i] = (double)(end - start) / (double)bench->opCount;
+  }
+
+  if (bench->teardown)
+    (*bench->teardown)();
+
+  double mean = 0;
+  for (size_t i = 0; i < options->sampleCount; ++i)
+    mean += samples[i];
+  mean /= (double)options->sampleCount;
+
+  qsort(samples, options->sampleCount, sizeof *samples, compare_double);
+  const size_t count = options->sampleCount;
+  const double syscallsPerOp = (double)syscallCount / (double)(bench->opCount * count);
+
+  if (options->json) {
+    printf(
+      "{\"name\":\"%s\",\"opCount\":%zu,\"sampleCount\":%zu,\"mean\":%.2f,\"min\":%.2f,"
+      "\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f,\"max\":%.2f,\"syscallsPerOp\":",
+      bench->name, bench->opCount, count, mean, samples[0],
+      percentile(samples, count, 0.5), percentile(samples, count, 0.9), percentile(samples, count, 0.99),
+      samples[count - 1]
+    );
+    if (syscallFd >= 0)
+      printf("%.4f}\n", syscallsPerOp);
+    else
+      printf("null}\n");
+  } else {
+    printf(
+      "%-18s %10.2f %10.2f %10.2f %10.2f %10.2f",
+      bench->name, mean, samples[0],
+      percentile(samples, count, 0.5), percentile(samples, count, 0.9), percentile(samples, count, 0.99)
+    );
+    if (syscallFd >= 0)
+      printf(" %12.4f\n", syscallsPerOp);
+    else
+      printf(" %12s\n", "n/a");
+  }
+  fflush(stdout);
+
+  free(samples);
+}
+
+static bool parse_options (int argc, char **argv, Options *options) {
+  options->json = false;
+  options->sampleCount = DEFAULT_SAMPLE_COUNT;
+  options->cpu = -1;
+  options->filter = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    bool ok = true;
+    if (!strcmp(argv[i], "--json"))
+      options->json = true;
+    else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+      const int value = xcp_str_to_int(argv[++i], &ok);
+      ok = ok && value > 0;
+      options->sampleCount = (size_t)value;
+    } else if (!strcmp(argv[i], "--cpu") && i + 1 < argc)
+      options->cpu = xcp_str_to_int(argv[++i], &ok);
+    else if (argv[i][0] != '-')
+      options->filter = argv[i];
+    else
+      ok = false;
+
+    if (!ok) {
+      fprintf(stderr, "Usage: %s [--json] [--samples N] [--cpu N] [FILTER]\n", argv[0]);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main (int argc, char **argv) {
+  Options options;
+  if (!parse_options(argc, argv, &options))
+    return EXIT_FAILURE;
+
+  // Pin the thread to reduce the noise.
+  if (options.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)options.cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+      fprintf(stderr, "Failed to pin thread on CPU %d: `%s`.\n", options.cpu, strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  const int syscallFd = open_syscall_counter();
+  if (!options.json)
+    printf(
+      "%-18s %10s %10s %10s %10s %10s %12s\n", "benchmark (ns/op)", "mean", "min", "p50", "p90", "p99", "syscalls/op"
+    );
+
+  for (size_t i = 0; i < XCP_ARRAY_LEN(Benchs); ++i)
+    if (!options.filter || strstr(Benchs[i].name, options.filter))
+      run_bench(&Benchs[i], &options, syscallFd);
+
+  if (syscallFd >= 0)
+    xcp_fd_close(syscallFd);
+  return EXIT_SUCCESS;
+}
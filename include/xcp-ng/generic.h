@@ -18,15 +18,27 @@
 #define _XCP_NG_GENERIC_H_
 
 #include "generic/algorithm.h"
+#include "generic/aligned-pool.h"
+#include "generic/buffered-io.h"
+#include "generic/cancel.h"
+#include "generic/coroutine-channel.h"
+#include "generic/coroutine-future.h"
+#include "generic/coroutine-sync.h"
 #include "generic/coroutine.h"
 #include "generic/endian.h"
+#include "generic/event-loop.h"
 #include "generic/file.h"
+#include "generic/generator.h"
 #include "generic/io.h"
 #include "generic/math.h"
 #include "generic/network.h"
 #include "generic/path.h"
+#include "generic/reactor.h"
+#include "generic/scheduler.h"
 #include "generic/stacktrace.h"
+#include "generic/stream-reader.h"
 #include "generic/string.h"
+#include "generic/timer.h"
 
 // =============================================================================
 
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_ALIGNED_POOL_H_
+#define _XCP_NG_GENERIC_ALIGNED_POOL_H_
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Pool of fixed-size aligned buffers, typically used with O_DIRECT.
+//
+// The pool reserves one contiguous region of `capacity` buffers. It is carved into slabs
+// on demand, so a buffer has a stable index (usable with io_uring fixed buffers, see
+// xcp_aligned_pool_get_region). Free buffers are kept in a lock-free stack, and each
+// thread caches a few buffers of the last used pools.
+//
+// Buffers can be released by any thread.
+
+// Back the region with huge pages (MAP_HUGETLB). If no huge page is available,
+// transparent huge pages are requested instead.
+#define XCP_ALIGNED_POOL_HUGE_PAGES (1 << 0)
+
+// Size of the region part carved at once when the pool is empty. A slab contains at least
+// one buffer.
+#define XCP_ALIGNED_POOL_SLAB_SIZE (2UL * 1024UL * 1024UL)
+
+// Count of buffers kept by a thread for one pool, and count of pools cached by a thread.
+#define XCP_ALIGNED_POOL_CACHE_SIZE 32
+#define XCP_ALIGNED_POOL_CACHE_COUNT 4
+
+// The cache of a pool is limited to capacity / (2 * XCP_ALIGNED_POOL_CACHE_THREADS) buffers:
+// this count of threads can only hold the half of the pool in their caches. Small pools
+// are not cached.
+#define XCP_ALIGNED_POOL_CACHE_THREADS 8
+
+struct iovec;
+
+typedef struct XcpAlignedPool XcpAlignedPool;
+
+typedef struct {
+  size_t bufferSize; // Rounded up to the alignment.
+  size_t alignment;
+  size_t capacity;
+  bool hugePages; // True if the region uses MAP_HUGETLB.
+
+  size_t slabCount;
+  size_t bufferCount; // Carved buffers.
+
+  // Counters of the thread caches are published when they exchange buffers with the pool.
+  ulonglong getCount;
+  ulonglong putCount;
+  ulonglong refillCount; // Thread caches refilled by the shared stack.
+  ulonglong flushCount; // Thread caches flushed to the shared stack.
+} XcpAlignedPoolStats;
+
+// Create a pool of at most `capacity` buffers of `bufferSize` bytes aligned on `alignment`
+// (a power of two, 0 => page size). The region is reserved without being committed.
+XCP_NO_DISCARD XcpAlignedPool *xcp_aligned_pool_create (
+  size_t bufferSize,
+  size_t alignment,
+  size_t capacity,
+  int flags
+);
+
+// All buffers must be released.
+void xcp_aligned_pool_destroy (XcpAlignedPool *pool);
+
+// Get a buffer. Return NULL and set errno to ENOMEM if the pool is exhausted.
+XCP_NO_DISCARD void *xcp_aligned_pool_get (XcpAlignedPool *pool);
+
+void xcp_aligned_pool_put (XcpAlignedPool *pool, void *buffer);
+
+// Carve and prefault the slabs containing the first `count` buffers of the region.
+XcpError xcp_aligned_pool_reserve (XcpAlignedPool *pool, size_t count);
+
+// Return the index of a buffer in the region.
+XCP_NO_DISCARD size_t xcp_aligned_pool_get_index (const XcpAlignedPool *pool, const void *buffer);
+
+// Get the whole region of the buffers, for example to register it in io_uring.
+void xcp_aligned_pool_get_region (const XcpAlignedPool *pool, struct iovec *region);
+
+void xcp_aligned_pool_get_stats (const XcpAlignedPool *pool, XcpAlignedPoolStats *stats);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_ALIGNED_POOL_H_ included
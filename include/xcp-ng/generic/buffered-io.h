@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_BUFFERED_IO_H_
+#define _XCP_NG_GENERIC_BUFFERED_IO_H_
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Buffered reader/writer over a fd, the I/O are executed with the functions of io.h.
+// A reader or a writer is not thread-safe.
+
+#define XCP_BUF_IO_DEFAULT_SIZE (16UL * 1024UL)
+
+// -----------------------------------------------------------------------------
+// Reader.
+// -----------------------------------------------------------------------------
+
+// Example: parse a /proc file.
+//
+// XcpBufReader reader;
+// xcp_buf_reader_init(&reader, fd, 0);
+// const char *line;
+// XcpError ret;
+// while ((ret = xcp_buf_reader_read_line(&reader, &line)) > 0)
+//   parse(line, (size_t)ret);
+// xcp_buf_reader_destroy(&reader);
+
+typedef struct {
+  int fd;
+
+  // Given to xcp_fd_wait_read. 0 (default) => no wait before the reads: the caller is
+  // suspended by the reactor or blocked by read(2).
+  int timeout;
+
+  // Private.
+  char *buf;
+  size_t capacity;
+  size_t begin;
+  size_t end;
+  size_t scanned; // Bytes after `begin` without delimiter.
+} XcpBufReader;
+
+// Allocate a buffer of `capacity` bytes (0 => XCP_BUF_IO_DEFAULT_SIZE).
+XcpError xcp_buf_reader_init (XcpBufReader *reader, int fd, size_t capacity);
+
+// The fd is not closed.
+void xcp_buf_reader_destroy (XcpBufReader *reader);
+
+// Return the count of buffered bytes.
+XCP_NO_DISCARD size_t xcp_buf_reader_get_size (const XcpBufReader *reader);
+
+// Read like xcp_fd_read: return the count of read bytes, 0 at EOF. The buffer is bypassed
+// for large reads if it is empty.
+XcpError xcp_buf_reader_read (XcpBufReader *reader, void *buf, size_t count);
+
+// Make at least `count` bytes available in the buffer (less at EOF) without consuming them.
+// `data` points to the buffered bytes, the count of available bytes is returned.
+// Fail with EINVAL if `count` is greater than the capacity.
+XcpError xcp_buf_reader_peek (XcpBufReader *reader, size_t count, const char **data);
+
+// Discard `count` bytes of the buffer, `count` must be lower or equal to the buffered size.
+void xcp_buf_reader_consume (XcpBufReader *reader, size_t count);
+
+// Consume the bytes until `delimiter` and return their count (delimiter included).
+// `data` points to the bytes in the buffer: the view is valid until the next call on the
+// reader. At EOF, the remaining bytes are returned without delimiter, then 0.
+// Fail with ENOBUFS if the buffer is full without delimiter, nothing is consumed.
+XcpError xcp_buf_reader_read_until (XcpBufReader *reader, char delimiter, const char **data);
+
+// Same as xcp_buf_reader_read_until with '\n'.
+XcpError xcp_buf_reader_read_line (XcpBufReader *reader, const char **data);
+
+// -----------------------------------------------------------------------------
+// Writer.
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  int fd;
+
+  // Private.
+  char *buf;
+  size_t capacity;
+  size_t size;
+} XcpBufWriter;
+
+// Allocate a buffer of `capacity` bytes (0 => XCP_BUF_IO_DEFAULT_SIZE).
+XcpError xcp_buf_writer_init (XcpBufWriter *writer, int fd, size_t capacity);
+
+// The buffered bytes are discarded: the writer must be flushed before. The fd is not closed.
+void xcp_buf_writer_destroy (XcpBufWriter *writer);
+
+// Return the count of buffered bytes.
+XCP_NO_DISCARD size_t xcp_buf_writer_get_size (const XcpBufWriter *writer);
+
+// Buffer `count` bytes. If the buffer is full, the buffered bytes and `buf` are written
+// with one xcp_fd_writev_all call.
+// On error, the buffered bytes which are not written are kept, `buf` is not buffered.
+// Return XCP_ERR_OK, XCP_ERR_TIMEOUT (deadline of the cancellation token) or XCP_ERR_ERRNO.
+XcpError xcp_buf_writer_write (XcpBufWriter *writer, const void *buf, size_t count);
+
+XcpError xcp_buf_writer_write_str (XcpBufWriter *writer, const char *str);
+
+// Write the buffered bytes. On error, the bytes which are not written are kept.
+// Return XCP_ERR_OK, XCP_ERR_TIMEOUT (deadline of the cancellation token) or XCP_ERR_ERRNO.
+XcpError xcp_buf_writer_flush (XcpBufWriter *writer);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_BUFFERED_IO_H_ included
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_CANCEL_H_
+#define _XCP_NG_GENERIC_CANCEL_H_
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Cancellation token with an optional absolute deadline.
+//
+// A token is attached to the current coroutine (or to the thread outside of coroutines)
+// with xcp_cancel_set_current. Then the blocking helpers of io.h and network.h
+// (xcp_fd_read_all, xcp_fd_write_all, xcp_sock_connect, xcp_poll...) fail with:
+// - XCP_ERR_ERRNO and ECANCELED once the token is cancelled.
+// - XCP_ERR_TIMEOUT (errno is ETIMEDOUT) once the deadline is reached.
+// The per-call timeouts are still used, the earliest expiration wins.
+//
+// A token can be shared by several coroutines and cancelled by any thread: the waiting
+// coroutines are woken up by their reactor, the threads blocked in poll(2) are interrupted.
+// A waiting coroutine is only interrupted when it is suspended by the reactor or blocked in
+// poll(2): a blocking read/write on a fd without O_NONBLOCK is never interrupted.
+//
+// Example: bound a request.
+//
+// XcpCancel cancel;
+// xcp_cancel_init(&cancel, xcp_timer_now() + 5000);
+// XcpCancel *prev = xcp_cancel_set_current(&cancel);
+// const XcpError ret = xcp_fd_read_all(fd, buf, size, -1, NULL);
+// xcp_cancel_set_current(prev);
+// xcp_cancel_destroy(&cancel);
+
+#define XCP_CANCEL_NO_DEADLINE -1LL
+
+typedef struct XcpCancel {
+  // Absolute deadline (see xcp_timer_now) or XCP_CANCEL_NO_DEADLINE.
+  longlong deadline;
+
+  // Private.
+  int eventFd; // Readable once cancelled.
+  int cancelled;
+} XcpCancel;
+
+XcpError xcp_cancel_init (XcpCancel *cancel, longlong deadline);
+
+// The token must not be used by a waiting coroutine or thread.
+void xcp_cancel_destroy (XcpCancel *cancel);
+
+// Cancel the token and wake up the waiters. Thread-safe, a token cannot be reset.
+void xcp_cancel_request (XcpCancel *cancel);
+
+XCP_NO_DISCARD bool xcp_cancel_is_cancelled (const XcpCancel *cancel);
+
+// Return XCP_ERR_OK if the token can be used, otherwise the error of the blocking helpers.
+// `cancel` can be NULL.
+XcpError xcp_cancel_check (const XcpCancel *cancel);
+
+// Return the timeout to use in milliseconds (-1 = infinite): the minimum of `timeout`
+// and the time before the deadline. `cancel` can be NULL.
+XCP_NO_DISCARD int xcp_cancel_get_timeout (const XcpCancel *cancel, int timeout);
+
+// Attach a token to the current coroutine (or thread) and return the previous one.
+// `cancel` can be NULL. The token is not inherited by the created coroutines.
+XcpCancel *xcp_cancel_set_current (XcpCancel *cancel);
+
+XCP_NO_DISCARD XcpCancel *xcp_cancel_get_current ();
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_CANCEL_H_ included
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_COROUTINE_CHANNEL_H_
+#define _XCP_NG_GENERIC_COROUTINE_CHANNEL_H_
+
+#include "xcp-ng/generic/coroutine.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Bounded FIFO channel of fixed-size elements between coroutines.
+//
+// Elements are copied. When a coroutine is blocked, the elements are directly copied
+// from/to its buffer by the other side, which wakes it once (see xcp_coroutine_park).
+// Channels can be shared by coroutines of different threads (see scheduler.h).
+//
+// Errors: XCP_ERR_ERRNO with errno set to EPIPE if the channel is closed, EAGAIN if
+// a try function would block.
+//
+// /!\ Blocking functions must be called in a coroutine.
+
+// Maximum number of operations given to xcp_co_chan_select.
+#define XCP_CO_CHAN_SELECT_MAX 64
+
+typedef struct XcpCoChan XcpCoChan;
+
+// Create a channel of `capacity` elements of `elemSize` bytes.
+// If `capacity` is 0, a sender waits for a receiver (rendezvous).
+XCP_NO_DISCARD XcpCoChan *xcp_co_chan_create (size_t elemSize, size_t capacity);
+
+// Destroy a channel. No coroutine must wait on it.
+void xcp_co_chan_destroy (XcpCoChan *chan);
+
+// Close a channel: waiting and future senders fail. Buffered elements can still be received,
+// then receivers fail.
+void xcp_co_chan_close (XcpCoChan *chan);
+
+XcpError xcp_co_chan_send (XcpCoChan *chan, const void *elem);
+XcpError xcp_co_chan_recv (XcpCoChan *chan, void *elem);
+
+XcpError xcp_co_chan_try_send (XcpCoChan *chan, const void *elem);
+XcpError xcp_co_chan_try_recv (XcpCoChan *chan, void *elem);
+
+// Send `count` elements. The caller is woken once all elements are transferred.
+// Return the count of sent elements, it is smaller than `count` only if the channel
+// was closed during the call.
+XcpError xcp_co_chan_send_batch (XcpCoChan *chan, const void *elems, size_t count);
+
+// Wait for at least one element and receive up to `count` elements.
+// Return the count of received elements.
+XcpError xcp_co_chan_recv_batch (XcpCoChan *chan, void *elems, size_t count);
+
+// -----------------------------------------------------------------------------
+// Select.
+// -----------------------------------------------------------------------------
+
+typedef enum {
+  XcpCoChanOpSend,
+  XcpCoChanOpRecv
+} XcpCoChanOpType;
+
+typedef struct {
+  XcpCoChan *chan;
+  XcpCoChanOpType type;
+
+  // Element to send or buffer of the received element.
+  void *elem;
+
+  // Output: true if the operation was not executed because the channel is closed.
+  bool closed;
+} XcpCoChanOp;
+
+// Wait until one of the operations can be executed and execute it. Return its index.
+// If several operations are ready, the first one in `ops` is chosen.
+XcpError xcp_co_chan_select (XcpCoChanOp *ops, size_t count);
+
+// Same as xcp_co_chan_select without waiting.
+XcpError xcp_co_chan_try_select (XcpCoChanOp *ops, size_t count);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_COROUTINE_CHANNEL_H_ included
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_COROUTINE_FUTURE_H_
+#define _XCP_NG_GENERIC_COROUTINE_FUTURE_H_
+
+#include "xcp-ng/generic/coroutine.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Future: result of a coroutine or value set once by a producer.
+//
+// Waiting coroutines are parked until the value is set (see xcp_coroutine_park), futures
+// can be shared by coroutines of different threads (see scheduler.h).
+//
+// /!\ Waiting functions must be called in a coroutine if the futures are not ready.
+//
+// Example: gather the results of several queries.
+//
+// static void *query (void *userData) { ... return result; }
+//
+// static void gather (void *userData) {
+//   XcpFuture *futures[VM_COUNT];
+//   for (size_t i = 0; i < VM_COUNT; ++i)
+//     futures[i] = xcp_coroutine_spawn(query, vms[i]);
+//   xcp_future_when_all(futures, VM_COUNT);
+//   for (size_t i = 0; i < VM_COUNT; ++i)
+//     handle(xcp_coroutine_join(futures[i]));
+// }
+
+typedef struct XcpFuture XcpFuture;
+
+typedef void *(*XcpFutureCb)(void *userData);
+
+// Create a future without producer: the value is given by xcp_future_set.
+XCP_NO_DISCARD XcpFuture *xcp_future_create ();
+
+// Release a future. If a coroutine is still running for it, the result is dropped
+// at its termination.
+void xcp_future_destroy (XcpFuture *future);
+
+// Set the value and wake the waiters. Must be called only once.
+void xcp_future_set (XcpFuture *future, void *value);
+
+XCP_NO_DISCARD bool xcp_future_is_ready (const XcpFuture *future);
+
+// Wait for the value.
+void *xcp_future_get (XcpFuture *future);
+
+// Wait until all futures are ready.
+void xcp_future_when_all (XcpFuture *const *futures, size_t count);
+
+// Wait until one of the futures is ready and return its index.
+// Return XCP_ERR_ERRNO if `count` is 0 (EINVAL) or in case of allocation failure.
+XcpError xcp_future_when_any (XcpFuture *const *futures, size_t count);
+
+// -----------------------------------------------------------------------------
+// Join handles.
+// -----------------------------------------------------------------------------
+
+// Create a coroutine executing `cb(userData)` and return the future of its result.
+// The coroutine is started with xcp_coroutine_process.
+XCP_NO_DISCARD XcpFuture *xcp_coroutine_spawn (XcpFutureCb cb, void *userData);
+
+// Same as xcp_coroutine_spawn with specific stack attributes.
+XCP_NO_DISCARD XcpFuture *xcp_coroutine_spawn_ex (XcpFutureCb cb, void *userData, const XcpCoroutineAttr *attr);
+
+// Wait for the termination of a spawned coroutine, release the future and return the result.
+void *xcp_coroutine_join (XcpFuture *future);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_COROUTINE_FUTURE_H_ included
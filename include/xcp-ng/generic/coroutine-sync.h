@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_COROUTINE_SYNC_H_
+#define _XCP_NG_GENERIC_COROUTINE_SYNC_H_
+
+#include <sys/queue.h>
+
+#include "xcp-ng/generic/coroutine.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Synchronization primitives of coroutines.
+//
+// A blocked coroutine is parked in an intrusive wait list (no allocation) and woken with
+// xcp_coroutine_wake. Each primitive is protected by a spinlock: the uncontended paths
+// never execute a syscall, and the primitives can be shared by coroutines of different
+// threads (see scheduler.h).
+//
+// /!\ Blocking functions must be called in a coroutine.
+//
+// The structures must be initialized with the init functions before use and are not
+// movable while coroutines are waiting.
+
+typedef STAILQ_HEAD(XcpCoWaitList, XcpCoroutine) XcpCoWaitList;
+
+// -----------------------------------------------------------------------------
+// Mutex.
+// -----------------------------------------------------------------------------
+
+// Non-recursive mutex. The ownership is given to the first waiter on unlock (FIFO).
+typedef struct {
+  int spinlock;
+  bool locked;
+  XcpCoWaitList waiters;
+} XcpCoMutex;
+
+void xcp_co_mutex_init (XcpCoMutex *mutex);
+
+void xcp_co_mutex_lock (XcpCoMutex *mutex);
+
+// Return true if the mutex has been locked.
+XCP_NO_DISCARD bool xcp_co_mutex_try_lock (XcpCoMutex *mutex);
+
+void xcp_co_mutex_unlock (XcpCoMutex *mutex);
+
+// -----------------------------------------------------------------------------
+// Condition variable.
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  int spinlock;
+  XcpCoWaitList waiters;
+} XcpCoCond;
+
+void xcp_co_cond_init (XcpCoCond *cond);
+
+// Atomically unlock `mutex` and wait for a signal. The mutex is locked again before returning.
+void xcp_co_cond_wait (XcpCoCond *cond, XcpCoMutex *mutex);
+
+// Wake one waiter.
+void xcp_co_cond_signal (XcpCoCond *cond);
+
+// Wake all waiters.
+void xcp_co_cond_broadcast (XcpCoCond *cond);
+
+// -----------------------------------------------------------------------------
+// Semaphore.
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  int spinlock;
+  size_t value;
+  XcpCoWaitList waiters;
+} XcpCoSemaphore;
+
+void xcp_co_semaphore_init (XcpCoSemaphore *semaphore, size_t value);
+
+// Decrement the semaphore value, wait if it is 0.
+void xcp_co_semaphore_acquire (XcpCoSemaphore *semaphore);
+
+// Return true if the value has been decremented.
+XCP_NO_DISCARD bool xcp_co_semaphore_try_acquire (XcpCoSemaphore *semaphore);
+
+// Increment the semaphore value or wake the first waiter.
+void xcp_co_semaphore_release (XcpCoSemaphore *semaphore);
+
+// -----------------------------------------------------------------------------
+// Wait group.
+// -----------------------------------------------------------------------------
+
+// Wait for a set of tasks: the counter is incremented before starting a task and
+// decremented at its end.
+typedef struct {
+  int spinlock;
+  size_t counter;
+  XcpCoWaitList waiters;
+} XcpCoWaitGroup;
+
+void xcp_co_wait_group_init (XcpCoWaitGroup *waitGroup);
+
+void xcp_co_wait_group_add (XcpCoWaitGroup *waitGroup, size_t count);
+
+// Decrement the counter. All waiters are woken when it reaches 0.
+void xcp_co_wait_group_done (XcpCoWaitGroup *waitGroup);
+
+// Wait until the counter is 0.
+void xcp_co_wait_group_wait (XcpCoWaitGroup *waitGroup);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_COROUTINE_SYNC_H_ included
@@ -26,17 +26,51 @@ extern "C" {
 #endif // ifdef __cplusplus
 
 #define XCP_COROUTINE_STACK_SIZE (1024UL * 1024UL)
+#define XCP_COROUTINE_STACK_MIN_SIZE (16UL * 1024UL)
+
+// Default bounds of the per-thread pool of terminated coroutines.
+#define XCP_COROUTINE_POOL_LOW_WATERMARK 16UL
+#define XCP_COROUTINE_POOL_HIGH_WATERMARK 64UL
 
 typedef struct XcpCoroutine XcpCoroutine;
 
 typedef void (*XcpCoroutineCb)(void *userData);
 
+typedef enum {
+  // Protect the stack bottom with a PROT_NONE page to catch overflows.
+  XcpCoroutineGuardPage = 0,
+  XcpCoroutineGuardNone = 1
+} XcpCoroutineGuard;
+
+// Stack attributes of a coroutine. A zero-initialized structure gives the default attributes.
+typedef struct {
+  // Stack size in bytes, rounded up to the page size. 0 => XCP_COROUTINE_STACK_SIZE.
+  size_t stackSize;
+
+  XcpCoroutineGuard guard;
+
+  // Optional stack of `stackSize` bytes owned by the caller. It is never freed nor pooled
+  // and the guard policy is ignored.
+  void *stack;
+} XcpCoroutineAttr;
+
 // Make a new coroutine.
+// Stacks are reserved with MAP_NORESERVE: only the touched pages are committed.
 XCP_NO_DISCARD XcpCoroutine *xcp_coroutine_create (XcpCoroutineCb cb, void *userData);
 
+// Make a new coroutine with specific stack attributes. `attr` can be NULL.
+XCP_NO_DISCARD XcpCoroutine *xcp_coroutine_create_ex (
+  XcpCoroutineCb cb,
+  void *userData,
+  const XcpCoroutineAttr *attr
+);
+
 // Return the current coroutine of the execution thread.
 XCP_NO_DISCARD XcpCoroutine *xcp_coroutine_get_self ();
 
+// Return true if the caller is executed by a coroutine.
+XCP_NO_DISCARD bool xcp_coroutine_in_coroutine ();
+
 // Resume a coroutine.
 void xcp_coroutine_resume (XcpCoroutine *coroutine);
 
@@ -47,6 +81,132 @@ void xcp_coroutine_yield ();
 // the coroutine is added to the coroutine pending list.
 void xcp_coroutine_process (XcpCoroutine *coroutine);
 
+// -----------------------------------------------------------------------------
+// Park/wake.
+// -----------------------------------------------------------------------------
+
+typedef void (*XcpCoroutineParkCb)(void *userData);
+
+// Suspend the current coroutine until xcp_coroutine_wake is called.
+// If not NULL, `cb(userData)` is executed by the resumer when the coroutine is completely
+// suspended. It is typically used to release the lock of a wait list: the coroutine
+// cannot be woken up by another thread before its context is saved.
+void xcp_coroutine_park (XcpCoroutineParkCb cb, void *userData);
+
+// Make a parked coroutine runnable: it is added to the run queue of its scheduler if any
+// (see scheduler.h). Otherwise the coroutine is always resumed by its own thread: it is
+// processed directly if the caller is executed by this thread (see xcp_coroutine_process),
+// else it is queued and resumed by the reactor of this thread (see reactor.h).
+void xcp_coroutine_wake (XcpCoroutine *coroutine);
+
+// -----------------------------------------------------------------------------
+// Local storage.
+// -----------------------------------------------------------------------------
+
+// Values are stored in a fixed slot array of each coroutine: a key is an index.
+// Outside of a coroutine, the values of the thread are used (never destroyed).
+#define XCP_COROUTINE_KEYS_MAX 16
+#define XCP_COROUTINE_KEY_DESTRUCTOR_ITERATIONS 4
+
+typedef uint XcpCoroutineKey;
+
+typedef void (*XcpCoroutineKeyDestructor)(void *value);
+
+// Allocate a key shared by all coroutines. If not NULL, `destructor` is called with the
+// non-NULL values at coroutine termination, like pthread_key_create.
+// Fail with EAGAIN if there are already XCP_COROUTINE_KEYS_MAX keys.
+XcpError xcp_coroutine_key_create (XcpCoroutineKey *key, XcpCoroutineKeyDestructor destructor);
+
+// Release a key. The destructor is not called: the values of the alive coroutines must be
+// reset by the caller before the key can be reused.
+void xcp_coroutine_key_delete (XcpCoroutineKey key);
+
+XCP_NO_DISCARD void *xcp_coroutine_getspecific (XcpCoroutineKey key);
+
+void xcp_coroutine_setspecific (XcpCoroutineKey key, void *value);
+
+// -----------------------------------------------------------------------------
+// Pool.
+// -----------------------------------------------------------------------------
+
+// Terminated coroutines are not destroyed: they are kept with their stack in a free list
+// of the execution thread and reused by the next xcp_coroutine_create call.
+// There is one free list per stack size/guard policy, coroutines with a caller-supplied
+// stack are never pooled.
+// When a terminated coroutine should be added to a pool which contains `highWatermark`
+// elements, the pool is trimmed to `lowWatermark` elements.
+// The pool is automatically released at thread exit.
+XcpError xcp_coroutine_pool_set_watermarks (size_t lowWatermark, size_t highWatermark);
+
+// If enabled, the stack pages of terminated coroutines are given back to the kernel
+// with madvise(MADV_DONTNEED) when they are added to the pool. Disabled by default,
+// always enabled if the library is built with ENABLE_COROUTINE_STATS.
+void xcp_coroutine_pool_set_discard_stacks (bool status);
+
+// Allocate coroutines until the pool contains `count` elements (capped by the high watermark).
+XcpError xcp_coroutine_pool_prewarm (size_t count);
+
+// Same as xcp_coroutine_pool_prewarm for coroutines created with the `attr` stack attributes.
+XcpError xcp_coroutine_pool_prewarm_ex (size_t count, const XcpCoroutineAttr *attr);
+
+// Destroy all coroutines of the pool.
+void xcp_coroutine_pool_clear ();
+
+// -----------------------------------------------------------------------------
+// Stats.
+// -----------------------------------------------------------------------------
+
+// Only available if the library is built with ENABLE_COROUTINE_STATS, otherwise the
+// functions fail with ENOTSUP. Times are in nanoseconds.
+
+// Count of buckets of the stack peak histogram: [0, 4 KiB[, [4 KiB, 8 KiB[, ..., [256 KiB, inf[.
+#define XCP_COROUTINE_STATS_STACK_BUCKET_COUNT 8
+
+typedef struct {
+  ulonglong resumeCount;
+  ulonglong yieldCount;
+
+  // Time spent running, including the nested coroutines resumed directly.
+  ulonglong runTime;
+  ulonglong runTimeMax; // Longest run without yielding.
+
+  // Time spent in pending lists/run queues before being resumed.
+  ulonglong pendingTime;
+
+  // Peak stack usage in bytes, 0 if unknown (caller-supplied stack).
+  size_t stackPeak;
+} XcpCoroutineStats;
+
+typedef struct {
+  ulonglong createCount;
+  ulonglong terminateCount;
+
+  ulonglong resumeCount;
+  ulonglong yieldCount;
+
+  // Time spent in coroutines resumed by the thread itself (not nested).
+  ulonglong runTime;
+  ulonglong runTimeMax;
+
+  ulonglong pendingTime;
+  ulonglong pendingTimeMax;
+
+  // Peak stack usage of the terminated coroutines.
+  size_t stackPeakMax;
+  ulonglong stackPeakHistogram[XCP_COROUTINE_STATS_STACK_BUCKET_COUNT];
+} XcpCoroutineThreadStats;
+
+// Get the stats of a coroutine which is not terminated.
+XcpError xcp_coroutine_get_stats (const XcpCoroutine *coroutine, XcpCoroutineStats *stats);
+
+// Get the stats of the coroutines executed by the current thread.
+XcpError xcp_coroutine_get_thread_stats (XcpCoroutineThreadStats *stats);
+
+void xcp_coroutine_reset_thread_stats ();
+
+// Return the stats of the current thread as a JSON object. The string must be freed.
+XCP_NO_DISCARD char *xcp_coroutine_dump_thread_stats ();
+
 #ifdef __cplusplus
 }
 #endif // ifdef __cplusplus
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_EVENT_LOOP_H_
+#define _XCP_NG_GENERIC_EVENT_LOOP_H_
+
+#include <signal.h>
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Event loop over epoll for large fd sets, a replacement of xcp_poll.
+//
+// Fds are registered once with a user data. Each xcp_event_loop_wait call returns a batch of
+// ready fds: the cost does not depend on the count of registered fds.
+// The loop can also create timer, notifier and signal sources (timerfd, eventfd and
+// signalfd): their counters are read by xcp_event_loop_wait.
+//
+// The loop does not need the coroutine runtime. In a coroutine, xcp_event_loop_wait suspends
+// the caller with the reactor if it is active (see reactor.h).
+// A loop is not thread-safe, except xcp_event_loop_notify, and only one coroutine can wait
+// on it at the same time.
+//
+// Example:
+//
+// XcpEventLoop *loop = xcp_event_loop_create();
+// xcp_event_loop_add(loop, fd, XCP_EVENT_LOOP_READ, client);
+// const int timer = xcp_event_loop_add_timer(loop, 1000, 1000, NULL);
+//
+// XcpEvent events[64];
+// for (;;) {
+//   const XcpError ret = xcp_event_loop_wait(loop, events, XCP_ARRAY_LEN(events), -1);
+//   for (XcpError i = 0; i < ret; ++i)
+//     events[i].fd == timer ? tick(events[i].value) : handle(events[i].userData, events[i].events);
+// }
+
+// Registration flags.
+#define XCP_EVENT_LOOP_READ (1 << 0)
+#define XCP_EVENT_LOOP_WRITE (1 << 1)
+// Report the fd only when its state changes (EPOLLET): the fd must be drained.
+#define XCP_EVENT_LOOP_EDGE (1 << 2)
+// Disable the fd after one event (EPOLLONESHOT), re-arm it with xcp_event_loop_modify.
+#define XCP_EVENT_LOOP_ONESHOT (1 << 3)
+
+// Returned events only.
+#define XCP_EVENT_LOOP_ERROR (1 << 4)
+#define XCP_EVENT_LOOP_HANGUP (1 << 5)
+
+typedef struct XcpEventLoop XcpEventLoop;
+
+typedef struct {
+  int fd;
+  int events;
+  void *userData;
+
+  // Timer source: count of expirations since the last event.
+  // Notifier source: sum of the notified values.
+  // Signal source: signal number.
+  ulonglong value;
+} XcpEvent;
+
+XCP_NO_DISCARD XcpEventLoop *xcp_event_loop_create ();
+
+// The sources created by the loop are closed, not the other fds.
+void xcp_event_loop_destroy (XcpEventLoop *loop);
+
+XcpError xcp_event_loop_add (XcpEventLoop *loop, int fd, int events, void *userData);
+
+// Change the events and the user data of a fd. Re-arm a one-shot fd.
+XcpError xcp_event_loop_modify (XcpEventLoop *loop, int fd, int events, void *userData);
+
+// Unregister a fd. A source created by the loop is closed.
+XcpError xcp_event_loop_remove (XcpEventLoop *loop, int fd);
+
+// Wait at most `timeout` milliseconds (-1 = infinite) and fill at most `count` events.
+// Return the count of events, XCP_ERR_TIMEOUT or XCP_ERR_ERRNO. The timeout is recomputed
+// after an interruption, the cancellation token of the caller is used (see cancel.h).
+XcpError xcp_event_loop_wait (XcpEventLoop *loop, XcpEvent *events, uint count, int timeout);
+
+// -----------------------------------------------------------------------------
+// Sources.
+// -----------------------------------------------------------------------------
+
+// The source functions return the fd of the new source, used to identify its events.
+
+// Timer (CLOCK_MONOTONIC) expiring after `delay` milliseconds, then every `interval`
+// milliseconds if `interval` is not 0.
+XcpError xcp_event_loop_add_timer (XcpEventLoop *loop, int delay, int interval, void *userData);
+
+// Re-arm or disarm (`delay` = 0) a timer source.
+XcpError xcp_event_loop_set_timer (XcpEventLoop *loop, int fd, int delay, int interval);
+
+// Notifier used to wake up the loop from another thread or from a signal handler.
+XcpError xcp_event_loop_add_notifier (XcpEventLoop *loop, void *userData);
+
+// Add `value` (> 0) to the counter of a notifier source. Thread-safe.
+XcpError xcp_event_loop_notify (XcpEventLoop *loop, int fd, ulonglong value);
+
+// Receive the signals of `mask`. They must be blocked by all threads (pthread_sigmask).
+// One event is returned per received signal.
+XcpError xcp_event_loop_add_signals (XcpEventLoop *loop, const sigset_t *mask, void *userData);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_EVENT_LOOP_H_ included
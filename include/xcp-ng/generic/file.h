@@ -33,6 +33,61 @@ XCP_NO_DISCARD char *xcp_readlink (const char *pathname);
 
 XCP_NO_DISCARD XcpError xcp_file_size (const char *filename);
 
+// -----------------------------------------------------------------------------
+// Memory-mapped files.
+// -----------------------------------------------------------------------------
+
+// Map flags.
+#define XCP_FILE_MAP_READ 0
+// Shared writable mapping, the file is opened with O_RDWR and the changes are written in it.
+#define XCP_FILE_MAP_WRITE (1 << 0)
+// Read the whole file at map time (MAP_POPULATE).
+#define XCP_FILE_MAP_POPULATE (1 << 1)
+// Request transparent huge pages (MADV_HUGEPAGE), ignored if not supported by the file system.
+#define XCP_FILE_MAP_HUGE_PAGES (1 << 2)
+
+typedef enum {
+  XcpFileMapAdviceNormal,
+  XcpFileMapAdviceSequential,
+  XcpFileMapAdviceRandom,
+  XcpFileMapAdviceWillNeed,
+  XcpFileMapAdviceDontNeed,
+  XcpFileMapAdviceHugePage
+} XcpFileMapAdvice;
+
+typedef struct {
+  // `data` is NULL if `size` is 0.
+  void *data;
+  size_t size;
+
+  // Private.
+  int fd;
+  int flags;
+} XcpMappedFile;
+
+// Map a whole file. An empty file can be mapped and extended later.
+XcpError xcp_file_map (XcpMappedFile *map, const char *filename, int flags);
+
+// Unmap the file and close it. A shared writable mapping is not synced: see xcp_file_map_sync.
+void xcp_file_unmap (XcpMappedFile *map);
+
+// Apply an advice to [offset, offset + length[. `length` = 0 => until the end of the mapping.
+XcpError xcp_file_map_advise (const XcpMappedFile *map, size_t offset, size_t length, XcpFileMapAdvice advice);
+
+// Fault [offset, offset + length[ in the page tables to prevent page faults during the
+// accesses. `length` = 0 => until the end of the mapping.
+XcpError xcp_file_map_prefault (const XcpMappedFile *map, size_t offset, size_t length);
+
+// Follow the current size of the file after a growth or a truncation by another writer.
+// `data` may change. Note: an access beyond the end of a truncated file raises SIGBUS.
+XcpError xcp_file_map_refresh (XcpMappedFile *map);
+
+// Resize the file and the mapping of a writable map. `data` may change.
+XcpError xcp_file_map_resize (XcpMappedFile *map, size_t size);
+
+// Write the changes of a writable map in the file.
+XcpError xcp_file_map_sync (const XcpMappedFile *map);
+
 #ifdef __cplusplus
 }
 #endif // ifdef __cplusplus
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_GENERATOR_H_
+#define _XCP_NG_GENERIC_GENERATOR_H_
+
+#include <limits.h>
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Stackless generators: a step function is a state machine resumed at its last yield
+// point (switch on __LINE__). A generator has no stack, only its resume point is stored.
+//
+// /!\ Local variables are not preserved across yields, they must be stored in the user
+// structure. A switch statement cannot contain a yield point and there must be at most
+// one yield point per line.
+//
+// Example: iterate over the blocks of a disk.
+//
+// typedef struct {
+//   XcpGenerator gen;
+//   ulonglong block;
+//   ulonglong blockCount;
+// } BlockIterator;
+//
+// static XcpGeneratorStatus block_iterator_next (BlockIterator *it) {
+//   XCP_GENERATOR_BEGIN(&it->gen);
+//   for (it->block = 0; it->block < it->blockCount; ++it->block)
+//     XCP_GENERATOR_YIELD(&it->gen);
+//   XCP_GENERATOR_END(&it->gen);
+// }
+//
+// BlockIterator it = { XCP_GENERATOR_INIT, 0, blockCount };
+// while (block_iterator_next(&it) == XcpGeneratorSuspended)
+//   handle_block(it.block);
+
+typedef enum {
+  XcpGeneratorSuspended = 0,
+  XcpGeneratorDone = 1
+} XcpGeneratorStatus;
+
+typedef struct {
+  uint state;
+} XcpGenerator;
+
+#define XCP_GENERATOR_INIT { 0 }
+#define XCP_GENERATOR_DONE_STATE UINT_MAX
+
+#define xcp_generator_init(GEN) ((void)((GEN)->state = 0))
+#define xcp_generator_is_done(GEN) ((GEN)->state == XCP_GENERATOR_DONE_STATE)
+
+// Must be the first statement of a step function.
+// The resume points are case labels: the fallthrough warnings are disabled in the body.
+#define XCP_GENERATOR_BEGIN(GEN) \
+  XCP_C_WARN_PUSH \
+  XCP_C_WARN_DISABLE_IMPLICIT_FALLTHROUGH \
+  switch ((GEN)->state) { case 0:
+
+// Must be the last statement of a step function.
+#define XCP_GENERATOR_END(GEN) \
+  } \
+  XCP_C_WARN_POP \
+  (GEN)->state = XCP_GENERATOR_DONE_STATE; \
+  return XcpGeneratorDone
+
+// Suspend the generator, the next step continues after this point.
+#define XCP_GENERATOR_YIELD(GEN) do { \
+  (GEN)->state = __LINE__; \
+  return XcpGeneratorSuspended; \
+  case __LINE__:; \
+} while (0)
+
+// Suspend the generator until `COND` is true. The condition is evaluated at each step.
+#define XCP_GENERATOR_AWAIT(GEN, COND) do { \
+  (GEN)->state = __LINE__; \
+  case __LINE__: \
+  if (!(COND)) \
+    return XcpGeneratorSuspended; \
+} while (0)
+
+// Execute a nested generator: `STEP` is called at each step until it returns XcpGeneratorDone.
+#define XCP_GENERATOR_AWAIT_STEP(GEN, STEP) XCP_GENERATOR_AWAIT(GEN, (STEP) == XcpGeneratorDone)
+
+// Terminate the generator.
+#define XCP_GENERATOR_RETURN(GEN) do { \
+  (GEN)->state = XCP_GENERATOR_DONE_STATE; \
+  return XcpGeneratorDone; \
+} while (0)
+
+// -----------------------------------------------------------------------------
+// Interoperability with stackful coroutines.
+// -----------------------------------------------------------------------------
+
+typedef XcpGeneratorStatus (*XcpGeneratorStepCb)(void *userData);
+
+// Execute `step(userData)` until the generator is done. After each suspended step, the
+// current coroutine lets the other coroutines run: a generator can await a condition set
+// by them, for example a future (see xcp_future_is_ready).
+// - In a coroutine of a scheduler, the coroutine is rescheduled (see xcp_scheduler_yield).
+// - In a coroutine of a thread with a reactor, it is resumed by the next loop iteration.
+// - Outside of a coroutine, the steps are executed in a busy loop: the condition can only
+//   be set by other threads.
+// In a coroutine which cannot be suspended, fail with EDEADLK after the first suspended step.
+XcpError xcp_generator_run (XcpGeneratorStepCb step, void *userData);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_GENERATOR_H_ included
@@ -78,6 +78,10 @@
 
 #define XCP_C_WARN_DISABLE_LOGICAL_OP XCP_C_WARN_DISABLE_GCC("-Wlogical-op")
 
+#define XCP_C_WARN_DISABLE_IMPLICIT_FALLTHROUGH \
+  XCP_C_WARN_DISABLE_CLANG("-Wimplicit-fallthrough") \
+  XCP_C_WARN_DISABLE_GCC("-Wimplicit-fallthrough")
+
 #if defined(XCP_C_CLANG)
   #define XCP_C_WARN_DISABLE_ADDRESS_OF_PACKED_MEMBER XCP_C_WARN_DISABLE_CLANG("-Waddress-of-packed-member")
 #elif defined(XCP_C_GNU)
@@ -111,6 +115,7 @@ typedef ssize_t XcpError;
 #define XCP_ERR_OK 0
 #define XCP_ERR_ERRNO -1
 #define XCP_ERR_TIMEOUT -2
+#define XCP_ERR_AGAIN -3 // Non-blocking fd not ready, see xcp_fd_try_read/xcp_fd_try_write.
 
 // -----------------------------------------------------------------------------
 
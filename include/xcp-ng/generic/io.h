@@ -28,7 +28,8 @@ extern "C" {
 struct iovec;
 struct pollfd;
 
-// TODO: For xcp_fd_wait_read and xcp_poll functions, timeout must be recomputed if an interruption is triggered.
+// The timeouts of the wait functions and xcp_poll are recomputed after an interruption.
+// The blocking helpers also use the cancellation token of the current coroutine. See: cancel.h
 
 XcpError xcp_fd_close (int fd);
 
@@ -38,12 +39,19 @@ XcpError xcp_fd_set_close_on_exec (int fd, bool status);
 
 // -----------------------------------------------------------------------------
 
+// The wait/read/write functions suspend the current coroutine instead of blocking the
+// thread when the reactor is active. See: reactor.h
+
 // Wait `timeout` milliseconds for available readable data in fd.
 XcpError xcp_fd_wait_for_rdata (int fd, int timeout);
 
 // Block until read. (/!\ Same behavior with O_NONBLOCK flag! => Blocking /!\)
+// With O_NONBLOCK, the caller waits for readable data in the reactor or in poll(2).
 XcpError xcp_fd_read (int fd, void *buf, size_t count);
 
+// Read without waiting. Return XCP_ERR_AGAIN if the O_NONBLOCK fd has no data.
+XcpError xcp_fd_try_read (int fd, void *buf, size_t count);
+
 // Wait and read.
 XcpError xcp_fd_wait_read (int fd, void *buf, size_t count, int timeout);
 
@@ -57,19 +65,116 @@ XcpError xcp_fd_read_all (int fd, void *buf, size_t count, int timeout, size_t *
 // -----------------------------------------------------------------------------
 
 // Write. (/!\ Do not use (bypass) the O_NONBLOCK flag. /!\)
+// With O_NONBLOCK, the caller waits for the fd in the reactor or in poll(2).
 XcpError xcp_fd_write (int fd, const void *buf, size_t count);
 
+// Write without waiting. Return XCP_ERR_AGAIN if the O_NONBLOCK fd is full.
+XcpError xcp_fd_try_write (int fd, const void *buf, size_t count);
+
 // Wait and write `count` bytes.
 XcpError xcp_fd_write_all (int fd, const void *buf, size_t count, size_t *offset);
 
 // -----------------------------------------------------------------------------
 
+// Vectored I/O. At most IOV_MAX iovecs are used by one call.
+XcpError xcp_fd_readv (int fd, const struct iovec *iovs, size_t iovCount);
+
+XcpError xcp_fd_writev (int fd, const struct iovec *iovs, size_t iovCount);
+
+// Same as xcp_fd_read_all/xcp_fd_write_all with a scatter/gather array. `iovs` is not
+// modified and can contain more than IOV_MAX iovecs. On error, `offset` is the count of
+// transferred bytes.
+XcpError xcp_fd_readv_all (int fd, const struct iovec *iovs, size_t iovCount, int timeout, size_t *offset);
+
+XcpError xcp_fd_writev_all (int fd, const struct iovec *iovs, size_t iovCount, size_t *offset);
+
+// -----------------------------------------------------------------------------
+
+// In a coroutine, positional I/O and sync calls are executed asynchronously by the reactor if active.
+
 XcpError xcp_fd_pread (int fd, void *buf, size_t count, off_t offset);
 
+XcpError xcp_fd_pwrite (int fd, const void *buf, size_t count, off_t offset);
+
 XcpError xcp_fd_preadv (int fd, const struct iovec *iovs, size_t iovCount, off_t offset);
 
+XcpError xcp_fd_pwritev (int fd, const struct iovec *iovs, size_t iovCount, off_t offset);
+
+// Same with the RWF_* flags of preadv2/pwritev2 (RWF_NOWAIT, RWF_HIPRI, RWF_DSYNC...).
+// With RWF_NOWAIT, XCP_ERR_AGAIN is returned if the data is not in the page cache.
+// Without preadv2/pwritev2 support, the functions fail with ENOSYS or EOPNOTSUPP.
+XcpError xcp_fd_preadv2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags);
+
+XcpError xcp_fd_pwritev2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags);
+
+// Transfer all bytes from/to `offset`, `transferred` is the count of transferred bytes
+// (also set on error). A read stops at EOF.
+XcpError xcp_fd_pread_all (int fd, void *buf, size_t count, off_t offset, size_t *transferred);
+
+XcpError xcp_fd_pwrite_all (int fd, const void *buf, size_t count, off_t offset, size_t *transferred);
+
+XcpError xcp_fd_preadv_all (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, size_t *transferred);
+
+XcpError xcp_fd_pwritev_all (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, size_t *transferred);
+
+// -----------------------------------------------------------------------------
+
+// Request of xcp_fd_pread_batch.
+typedef struct {
+  off_t offset;
+  size_t length;
+  void *buf;
+
+  // Count of read bytes (less than `length` at EOF) or -errno.
+  ssize_t result;
+} XcpReadRequest;
+
+#define XCP_FD_PREAD_BATCH_DEPTH 64U
+
+// Read many scattered ranges. The requests are sorted by offset and the adjacent ranges are
+// merged in one preadv call, then at most `queueDepth` calls (0 => XCP_FD_PREAD_BATCH_DEPTH)
+// are executed concurrently by io_uring or by a thread pool. Without io_uring, the pool has
+// 4 threads: no more than 4 calls are executed concurrently, whatever `queueDepth` is.
+// If the current coroutine can be suspended, the I/O engine of the reactor is used,
+// otherwise an engine is created once per thread.
+// The cancellation token of the caller stops the submission of the remaining requests,
+// the calls already submitted are always completed before the return.
+// Return XCP_ERR_OK if all requests succeed, otherwise XCP_ERR_ERRNO with the errno of the
+// first failed request (by offset). `requests` is not reordered.
+XcpError xcp_fd_pread_batch (int fd, XcpReadRequest *requests, size_t count, uint queueDepth);
+
+// -----------------------------------------------------------------------------
+
+// Kernel-side copies. The cheapest available method is used, then the next ones if the
+// kernel or the fds do not support it: copy_file_range(2) (reflink on supported file systems),
+// sendfile(2), splice(2) through a pipe and finally a buffered copy.
+//
+// `count` bytes are transferred or less at EOF (`count` can be SIZE_MAX to copy until EOF).
+// Like copy_file_range(2), a non-NULL offset is used and advanced instead of the file
+// position. `transferred` is the count of transferred bytes (also set on error).
+// Return XCP_ERR_OK, XCP_ERR_TIMEOUT (errno is ETIMEDOUT) once the deadline of the
+// cancellation token of the caller is reached (see cancel.h) or XCP_ERR_ERRNO.
+//
+// Note: copies between regular files block the thread, even in a coroutine.
+
+// Methods: copy_file_range, sendfile (if `offOut` is NULL), splice, buffered copy.
+XcpError xcp_fd_copy_range (int fdIn, off_t *offIn, int fdOut, off_t *offOut, size_t count, size_t *transferred);
+
+// Methods: sendfile, splice, buffered copy. `offset` is the offset of `fdIn`.
+XcpError xcp_fd_sendfile (int fdOut, int fdIn, off_t *offset, size_t count, size_t *transferred);
+
+// Methods: splice (directly if one of the fds is a pipe), buffered copy.
+XcpError xcp_fd_splice_all (int fdIn, off_t *offIn, int fdOut, off_t *offOut, size_t count, size_t *transferred);
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_fd_fsync (int fd);
+
+XcpError xcp_fd_fdatasync (int fd);
+
 // -----------------------------------------------------------------------------
 
+// Return the count of ready fds, XCP_ERR_TIMEOUT or XCP_ERR_ERRNO.
 XcpError xcp_poll (struct pollfd *fds, uint nfds, int timeout);
 
 #ifdef __cplusplus
@@ -32,6 +32,8 @@ extern "C" {
   XCP_MEMBER_SIZE(struct sockaddr_un, sun_path) / \
   XCP_MEMBER_SIZE(struct sockaddr_un, sun_path[0])
 
+// Connect a socket. If it is non-blocking, the connection is awaited when the caller can be
+// suspended by the reactor or has a cancellation token (see cancel.h).
 XcpError xcp_sock_connect (int sock, const struct sockaddr *addr, socklen_t addrlen);
 
 XcpError xcp_sock_send_shared_fd (int sock, const void *buf, size_t count, int sharedFd);
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_REACTOR_H_
+#define _XCP_NG_GENERIC_REACTOR_H_
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Per-thread epoll reactor used by the coroutines.
+//
+// When the reactor of the current thread is active, the io.h helpers called from a coroutine
+// (xcp_fd_wait_for_rdata, xcp_fd_read, xcp_fd_write...) register the fd in the reactor and
+// yield instead of blocking the thread. The coroutine is resumed by xcp_reactor_run when
+// the fd is ready. Outside of a coroutine, the blocking behavior is unchanged.
+//
+// Use O_NONBLOCK fds to never block the thread: a read on a blocking fd without
+// available data still blocks.
+//
+// Basic example:
+//
+// static void client (void *userData) {
+//   char buf[512];
+//   const XcpError ret = xcp_fd_wait_read((int)(intptr_t)userData, buf, sizeof buf, 5000);
+//   ...
+// }
+//
+// int main () {
+//   xcp_reactor_init();
+//   for (...)
+//     xcp_coroutine_resume(xcp_coroutine_create(client, (void *)(intptr_t)fd));
+//   xcp_reactor_run();
+//   xcp_reactor_destroy();
+// }
+
+// Create the reactor of the current thread.
+XcpError xcp_reactor_init ();
+
+// Destroy the reactor of the current thread. Waiting coroutines are never resumed
+// and in-flight asynchronous I/O is not completed.
+void xcp_reactor_destroy ();
+
+// Return true if the current thread has a reactor.
+XCP_NO_DISCARD bool xcp_reactor_is_active ();
+
+// Return true if the caller can be suspended by the reactor: it is executed
+// by a coroutine and the thread has a reactor.
+XCP_NO_DISCARD bool xcp_reactor_can_suspend ();
+
+// Wait `timeout` milliseconds (-1 = infinite) for `events` (POLLIN and/or POLLOUT) in fd.
+// The current coroutine is suspended if possible, otherwise poll(2) is used.
+// Only one coroutine can wait for readable (resp. writable) data on a fd at the same time.
+// Return XCP_ERR_OK, XCP_ERR_TIMEOUT or XCP_ERR_ERRNO.
+XcpError xcp_reactor_wait_fd (int fd, int events, int timeout);
+
+// -----------------------------------------------------------------------------
+// Asynchronous positional I/O.
+// -----------------------------------------------------------------------------
+
+// Regular files are always "ready" for epoll, so these operations are executed by an io_uring
+// instance of the reactor (if built with io_uring support and if the kernel supports it) or by
+// a small thread pool otherwise. The current coroutine is suspended until the completion.
+// The operations queued by the coroutines are submitted in one batch per loop iteration.
+// Without reactor or outside of a coroutine, the operation is executed synchronously.
+
+struct iovec;
+
+XcpError xcp_reactor_preadv (int fd, const struct iovec *iovs, size_t iovCount, off_t offset);
+
+XcpError xcp_reactor_pwritev (int fd, const struct iovec *iovs, size_t iovCount, off_t offset);
+
+// Same with the RWF_* flags of preadv2/pwritev2. Operations with RWF_NOWAIT or RWF_HIPRI are
+// always executed synchronously.
+XcpError xcp_reactor_preadv2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags);
+
+XcpError xcp_reactor_pwritev2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags);
+
+// fdatasync if `dataOnly` is true, fsync otherwise.
+XcpError xcp_reactor_fsync (int fd, bool dataOnly);
+
+// -----------------------------------------------------------------------------
+// Loop.
+// -----------------------------------------------------------------------------
+
+// Wait at most `timeout` milliseconds for events, resume the ready coroutines, the coroutines
+// woken by other threads and execute the expired timers (see timer.h).
+// Must be called outside of a coroutine.
+// Return the number of resumed coroutines and executed timers.
+XcpError xcp_reactor_run_once (int timeout);
+
+// Process events until there is no more waiting or parked coroutine nor active timer or until
+// xcp_reactor_stop is called.
+// Must be called outside of a coroutine.
+XcpError xcp_reactor_run ();
+
+// Stop the current xcp_reactor_run call after the current iteration.
+void xcp_reactor_stop ();
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_REACTOR_H_ included
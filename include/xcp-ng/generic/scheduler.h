@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_SCHEDULER_H_
+#define _XCP_NG_GENERIC_SCHEDULER_H_
+
+#include "xcp-ng/generic/coroutine.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// M:N scheduler: coroutines are executed by a set of worker threads.
+//
+// Each worker has a local run queue (Chase-Lev deque). An idle worker takes the coroutines
+// woken by other threads in a global queue, then steals the oldest coroutines of the
+// other workers. A pinned coroutine is only executed by its worker.
+//
+// A coroutine of the scheduler is resumed again when it is woken with xcp_coroutine_wake
+// (see xcp_coroutine_park). New coroutines given to xcp_coroutine_process by a scheduled
+// coroutine are added to the same scheduler.
+//
+// /!\ Scheduled coroutines can be executed by any worker: thread-local data must not be
+// cached across a park/yield. Workers have no reactor, fd I/O blocks the worker thread.
+
+typedef struct XcpScheduler XcpScheduler;
+
+// Create a scheduler with `workerCount` threads. If 0, one worker per online CPU is used.
+XCP_NO_DISCARD XcpScheduler *xcp_scheduler_create (uint workerCount);
+
+// Stop and join the workers. The coroutines which are not terminated are never resumed.
+void xcp_scheduler_destroy (XcpScheduler *scheduler);
+
+XCP_NO_DISCARD uint xcp_scheduler_get_worker_count (const XcpScheduler *scheduler);
+
+// Create a coroutine and add it to the scheduler.
+XcpError xcp_scheduler_spawn (XcpScheduler *scheduler, XcpCoroutineCb cb, void *userData);
+
+// Create a coroutine pinned to the `worker` thread.
+XcpError xcp_scheduler_spawn_on (XcpScheduler *scheduler, uint worker, XcpCoroutineCb cb, void *userData);
+
+// Block the calling thread until all coroutines of the scheduler are terminated.
+// Must not be called by a worker.
+void xcp_scheduler_wait (XcpScheduler *scheduler);
+
+// Return the worker index of the calling thread, -1 if it is not a worker.
+XCP_NO_DISCARD int xcp_scheduler_get_current_worker ();
+
+// Reschedule the current coroutine after the other runnable coroutines.
+void xcp_scheduler_yield ();
+
+// Pin the current coroutine to a worker (-1 to unpin it). If necessary, the coroutine
+// is migrated to its worker before returning.
+XcpError xcp_scheduler_pin (int worker);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_SCHEDULER_H_ included
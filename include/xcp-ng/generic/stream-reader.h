@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_STREAM_READER_H_
+#define _XCP_NG_GENERIC_STREAM_READER_H_
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Sequential reader of a file range which reads ahead of the consumer.
+//
+// The range is read in chunks by an asynchronous I/O engine owned by the reader (io_uring or
+// a pool of 4 threads), a chunk is returned to the caller while the next ones are read:
+// - With O_DIRECT, `window` chunks are kept in flight.
+// - Otherwise, the page cache is filled by readahead(2) `window` chunks ahead and the next
+//   chunk is read in a second buffer.
+// The window is doubled (up to `maxWindow`) each time the consumer waits for a chunk and
+// halved (down to `minWindow`) after 4 * `window` chunks without waiting.
+//
+// The engine does not depend on a reactor: the reader can be used and destroyed outside of
+// the reactor loop. The current coroutine is suspended by the reactor while waiting for a
+// chunk if possible.
+// With O_DIRECT, the offset and the length must be aligned on the logical block size.
+//
+// Example:
+//
+// XcpStreamReader *reader = xcp_stream_reader_create(fd, 0, XCP_STREAM_READER_TO_EOF, NULL);
+// const void *chunk;
+// XcpError ret;
+// while ((ret = xcp_stream_reader_next(reader, &chunk)) > 0)
+//   consume(chunk, (size_t)ret);
+// xcp_stream_reader_destroy(reader);
+
+#define XCP_STREAM_READER_TO_EOF -1
+
+#define XCP_STREAM_READER_CHUNK_SIZE (1024UL * 1024UL)
+#define XCP_STREAM_READER_MIN_WINDOW 2U
+#define XCP_STREAM_READER_MAX_WINDOW 16U
+
+typedef struct XcpStreamReader XcpStreamReader;
+
+// A zero-initialized structure gives the default attributes.
+typedef struct {
+  // Rounded up to the page size. 0 => XCP_STREAM_READER_CHUNK_SIZE.
+  size_t chunkSize;
+
+  // Bounds of the count of chunks read ahead.
+  // 0 => XCP_STREAM_READER_MIN_WINDOW/XCP_STREAM_READER_MAX_WINDOW.
+  uint minWindow;
+  uint maxWindow;
+} XcpStreamReaderAttr;
+
+typedef struct {
+  ulonglong byteCount;
+  ulonglong chunkCount;
+  ulonglong stallCount; // Chunks which were not ready when requested.
+  uint window;
+} XcpStreamReaderStats;
+
+// Read `length` bytes from `offset` or until EOF if `length` is XCP_STREAM_READER_TO_EOF.
+// `attr` can be NULL. The fd is not closed by the reader.
+XCP_NO_DISCARD XcpStreamReader *xcp_stream_reader_create (
+  int fd,
+  off_t offset,
+  off_t length,
+  const XcpStreamReaderAttr *attr
+);
+
+// Wait for the in-flight reads and release the reader.
+void xcp_stream_reader_destroy (XcpStreamReader *reader);
+
+// Return the size of the next chunk and set `data`, 0 at the end of the range, or an error.
+// The chunk is valid until the next call. After a read error, the reader cannot be used
+// anymore, but a timeout or a cancellation (see cancel.h) can be retried.
+XcpError xcp_stream_reader_next (XcpStreamReader *reader, const void **data);
+
+void xcp_stream_reader_get_stats (const XcpStreamReader *reader, XcpStreamReaderStats *stats);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_STREAM_READER_H_ included
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_GENERIC_TIMER_H_
+#define _XCP_NG_GENERIC_TIMER_H_
+
+#include <sys/queue.h>
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+#ifdef __cplusplus
+extern "C" {
+#endif // ifdef __cplusplus
+
+// Millisecond timers of the reactor (see reactor.h).
+//
+// Timers are stored in a hierarchical timing wheel owned by the reactor of the current
+// thread: start and cancel are O(1), and the reactor loop does not wait after the next
+// expiration. Expired timers are executed by xcp_reactor_run_once, outside of coroutines.
+//
+// Timers are not allocated by the library: an XcpTimer must stay valid while it is active.
+// A timer can only be used by the thread which started it.
+
+typedef void (*XcpTimerCb)(void *userData);
+
+typedef struct XcpTimer {
+  // Absolute expiration time, see xcp_timer_now.
+  longlong deadline;
+
+  XcpTimerCb cb;
+  void *userData;
+
+  // Private.
+  LIST_ENTRY(XcpTimer) entry;
+  uchar level;
+  uchar slot;
+  bool active;
+} XcpTimer;
+
+// Return the current time of the timers: CLOCK_MONOTONIC in milliseconds.
+XCP_NO_DISCARD longlong xcp_timer_now ();
+
+void xcp_timer_init (XcpTimer *timer, XcpTimerCb cb, void *userData);
+
+// Start (or restart) a timer expiring in `delay` milliseconds.
+// The current thread must have a reactor, otherwise errno is set to EINVAL.
+XcpError xcp_timer_start (XcpTimer *timer, longlong delay);
+
+// Start (or restart) a timer expiring at `deadline`.
+XcpError xcp_timer_start_at (XcpTimer *timer, longlong deadline);
+
+// Stop a timer. Return true if it was active.
+bool xcp_timer_cancel (XcpTimer *timer);
+
+XCP_NO_DISCARD static inline bool xcp_timer_is_active (const XcpTimer *timer) {
+  return timer->active;
+}
+
+// -----------------------------------------------------------------------------
+// Sleep.
+// -----------------------------------------------------------------------------
+
+// Suspend the current coroutine during `delay` milliseconds. Without reactor or outside of
+// a coroutine, the thread is blocked.
+XcpError xcp_coroutine_sleep_ms (longlong delay);
+
+// Suspend the current coroutine until `deadline` (see xcp_timer_now).
+XcpError xcp_coroutine_sleep_until (longlong deadline);
+
+#ifdef __cplusplus
+}
+#endif // ifdef __cplusplus
+
+#endif // _XCP_NG_GENERIC_TIMER_H_ included
@@ -0,0 +1,508 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "xcp-ng/generic/aligned-pool.h"
+#include "xcp-ng/generic/math.h"
+
+// =============================================================================
+
+#define XCP_ALIGNED_POOL_HUGE_PAGE_SIZE (2UL * 1024UL * 1024UL)
+
+// Free list entries are indexes: the top of the stack is tagged to prevent ABA.
+#define XCP_ALIGNED_POOL_NIL UINT32_MAX
+
+#define XCP_ALIGNED_POOL_HEAD(TAG, INDEX) (((uint64_t)(TAG) << 32) | (INDEX))
+#define XCP_ALIGNED_POOL_HEAD_TAG(HEAD) ((uint32_t)((HEAD) >> 32))
+#define XCP_ALIGNED_POOL_HEAD_INDEX(HEAD) ((uint32_t)(HEAD))
+
+struct XcpAlignedPool {
+  // Unique identifier, never reused: the thread caches can outlive the pool.
+  ulonglong id;
+
+  char *buffers;
+  size_t bufferSize;
+  size_t alignment;
+  size_t stride;
+  size_t capacity;
+
+  // Size of the thread caches, 0 if the pool is too small to be cached.
+  uint32_t cacheSize;
+
+  void *mapping;
+  size_t mappingSize;
+  bool hugePages;
+
+  uint64_t head;
+  uint32_t *nexts;
+
+  // Carving of the slabs. The counters can be read without the mutex.
+  pthread_mutex_t mutex;
+  size_t slabBuffers;
+  size_t slabCount;
+  size_t bufferCount;
+
+  ulonglong getCount;
+  ulonglong putCount;
+  ulonglong refillCount;
+  ulonglong flushCount;
+
+  LIST_ENTRY(XcpAlignedPool) next;
+};
+
+typedef struct {
+  XcpAlignedPool *pool;
+  ulonglong poolId; // 0 => unused entry.
+
+  ulonglong getCount;
+  ulonglong putCount;
+
+  uint32_t size;
+  uint32_t indexes[XCP_ALIGNED_POOL_CACHE_SIZE];
+} XcpAlignedPoolCache;
+
+typedef struct {
+  XcpAlignedPoolCache caches[XCP_ALIGNED_POOL_CACHE_COUNT];
+  uint victim;
+  bool registered;
+} XcpAlignedPoolThreadData;
+
+// Alive pools, used to flush the caches of a thread which may reference destroyed pools.
+static pthread_mutex_t PoolsMutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD( , XcpAlignedPool) Pools = LIST_HEAD_INITIALIZER(Pools);
+static ulonglong PoolId;
+
+static pthread_key_t CacheKey;
+static pthread_once_t CacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static __thread XcpAlignedPoolThreadData ThreadData;
+
+// -----------------------------------------------------------------------------
+
+static size_t xcp_aligned_pool_page_size () {
+  static size_t pageSize;
+  if (XCP_UNLIKELY(!pageSize))
+    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+static inline void *xcp_aligned_pool_buffer (const XcpAlignedPool *pool, uint32_t index) {
+  return pool->buffers + (size_t)index * pool->stride;
+}
+
+// -----------------------------------------------------------------------------
+// Shared free list.
+// -----------------------------------------------------------------------------
+
+// Push the chain `first` -> ... -> `last`, the links are already set in `nexts`.
+static void xcp_aligned_pool_push (XcpAlignedPool *pool, uint32_t first, uint32_t last) {
+  uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+  uint64_t newHead;
+  do {
+    __atomic_store_n(&pool->nexts[last], XCP_ALIGNED_POOL_HEAD_INDEX(head), __ATOMIC_RELAXED);
+    newHead = XCP_ALIGNED_POOL_HEAD(XCP_ALIGNED_POOL_HEAD_TAG(head) + 1, first);
+  } while (!__atomic_compare_exchange_n(
+    &pool->head, &head, newHead, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+  ));
+}
+
+static uint32_t xcp_aligned_pool_pop (XcpAlignedPool *pool) {
+  uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+  uint64_t newHead;
+  uint32_t index;
+  do {
+    if ((index = XCP_ALIGNED_POOL_HEAD_INDEX(head)) == XCP_ALIGNED_POOL_NIL)
+      return XCP_ALIGNED_POOL_NIL;
+
+    // The entry can be popped by another thread in the meantime: in this case the read
+    // value is garbage but the tag makes the exchange fail.
+    const uint32_t next = __atomic_load_n(&pool->nexts[index], __ATOMIC_RELAXED);
+    newHead = XCP_ALIGNED_POOL_HEAD(XCP_ALIGNED_POOL_HEAD_TAG(head) + 1, next);
+  } while (!__atomic_compare_exchange_n(
+    &pool->head, &head, newHead, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE
+  ));
+
+  return index;
+}
+
+static void xcp_aligned_pool_push_array (XcpAlignedPool *pool, const uint32_t *indexes, size_t count) {
+  if (!count)
+    return;
+
+  for (size_t i = 1; i < count; ++i)
+    __atomic_store_n(&pool->nexts[indexes[i - 1]], indexes[i], __ATOMIC_RELAXED);
+  xcp_aligned_pool_push(pool, indexes[0], indexes[count - 1]);
+}
+
+// -----------------------------------------------------------------------------
+// Slabs.
+// -----------------------------------------------------------------------------
+
+static void xcp_aligned_pool_prefault (void *address, size_t size) {
+  #ifdef MADV_POPULATE_WRITE
+    if (!madvise(address, size, MADV_POPULATE_WRITE))
+      return;
+  #endif // ifdef MADV_POPULATE_WRITE
+
+  // The slab is not used yet: its pages are zero-filled.
+  const size_t pageSize = xcp_aligned_pool_page_size();
+  volatile char *p = address;
+  for (size_t offset = 0; offset < size; offset += pageSize)
+    p[offset] = 0;
+}
+
+// Must be called with the pool mutex. Return false if the region is completely carved.
+static bool xcp_aligned_pool_carve (XcpAlignedPool *pool, bool prefault) {
+  const size_t first = pool->bufferCount;
+  const size_t count = XCP_MIN(pool->slabBuffers, pool->capacity - first);
+  if (!count)
+    return false;
+
+  if (prefault)
+    xcp_aligned_pool_prefault(xcp_aligned_pool_buffer(pool, (uint32_t)first), count * pool->stride);
+
+  const uint32_t last = (uint32_t)(first + count - 1);
+  for (uint32_t index = (uint32_t)first; index < last; ++index)
+    __atomic_store_n(&pool->nexts[index], index + 1, __ATOMIC_RELAXED);
+  xcp_aligned_pool_push(pool, (uint32_t)first, last);
+
+  __atomic_store_n(&pool->bufferCount, first + count, __ATOMIC_RELAXED);
+  __atomic_store_n(&pool->slabCount, pool->slabCount + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Thread caches.
+// -----------------------------------------------------------------------------
+
+static void xcp_aligned_pool_cache_publish (XcpAlignedPoolCache *cache) {
+  XcpAlignedPool *pool = cache->pool;
+  __atomic_fetch_add(&pool->getCount, cache->getCount, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pool->putCount, cache->putCount, __ATOMIC_RELAXED);
+  cache->getCount = cache->putCount = 0;
+}
+
+// Give `count` buffers of the cache back to the pool.
+static void xcp_aligned_pool_cache_flush (XcpAlignedPoolCache *cache, uint32_t count) {
+  XcpAlignedPool *pool = cache->pool;
+  cache->size -= count;
+  xcp_aligned_pool_push_array(pool, cache->indexes + cache->size, count);
+  __atomic_fetch_add(&pool->flushCount, 1, __ATOMIC_RELAXED);
+  xcp_aligned_pool_cache_publish(cache);
+}
+
+// Release a cache entry. Its pool may be destroyed: in this case the buffers are dropped.
+static void xcp_aligned_pool_cache_release (XcpAlignedPoolCache *cache) {
+  pthread_mutex_lock(&PoolsMutex);
+  XcpAlignedPool *pool;
+  LIST_FOREACH(pool, &Pools, next) {
+    if (pool->id == cache->poolId) {
+      xcp_aligned_pool_cache_flush(cache, cache->size);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&PoolsMutex);
+
+  cache->pool = NULL;
+  cache->poolId = 0;
+  cache->size = 0;
+  cache->getCount = cache->putCount = 0;
+}
+
+static void xcp_aligned_pool_cache_key_destructor (void *data) {
+  XcpAlignedPoolThreadData *threadData = data;
+  for (size_t i = 0; i < XCP_ALIGNED_POOL_CACHE_COUNT; ++i) {
+    if (threadData->caches[i].poolId)
+      xcp_aligned_pool_cache_release(&threadData->caches[i]);
+  }
+  threadData->registered = false;
+}
+
+static void xcp_aligned_pool_cache_key_create () {
+  if (pthread_key_create(&CacheKey, xcp_aligned_pool_cache_key_destructor))
+    abort();
+}
+
+// Return the cache of a pool, NULL if the thread cannot use a cache.
+static XcpAlignedPoolCache *xcp_aligned_pool_cache_get (XcpAlignedPool *pool) {
+  XcpAlignedPoolThreadData *threadData = &ThreadData;
+  XcpAlignedPoolCache *cache = threadData->caches;
+  for (size_t i = 0; i < XCP_ALIGNED_POOL_CACHE_COUNT; ++i, ++cache) {
+    if (cache->poolId == pool->id)
+      return cache;
+  }
+
+  // Register the thread data to flush the caches at thread exit.
+  if (XCP_UNLIKELY(!threadData->registered)) {
+    pthread_once(&CacheKeyOnce, xcp_aligned_pool_cache_key_create);
+    if (pthread_setspecific(CacheKey, threadData))
+      return NULL;
+    threadData->registered = true;
+  }
+
+  cache = NULL;
+  for (size_t i = 0; i < XCP_ALIGNED_POOL_CACHE_COUNT; ++i) {
+    if (!threadData->caches[i].poolId) {
+      cache = &threadData->caches[i];
+      break;
+    }
+  }
+
+  if (!cache) {
+    cache = &threadData->caches[threadData->victim];
+    threadData->victim = (threadData->victim + 1) % XCP_ALIGNED_POOL_CACHE_COUNT;
+    xcp_aligned_pool_cache_release(cache);
+  }
+
+  cache->pool = pool;
+  cache->poolId = pool->id;
+  return cache;
+}
+
+// Fill the half of the cache. Return false if the pool is exhausted.
+static bool xcp_aligned_pool_cache_refill (XcpAlignedPoolCache *cache) {
+  XcpAlignedPool *pool = cache->pool;
+  for (;;) {
+    uint32_t index;
+    while (
+      cache->size < pool->cacheSize / 2 &&
+      (index = xcp_aligned_pool_pop(pool)) != XCP_ALIGNED_POOL_NIL
+    )
+      cache->indexes[cache->size++] = index;
+
+    if (cache->size) {
+      __atomic_fetch_add(&pool->refillCount, 1, __ATOMIC_RELAXED);
+      xcp_aligned_pool_cache_publish(cache);
+      return true;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    // Another thread may have carved a slab in the meantime.
+    const uint64_t head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    const bool carved = XCP_ALIGNED_POOL_HEAD_INDEX(head) != XCP_ALIGNED_POOL_NIL ||
+      xcp_aligned_pool_carve(pool, false);
+    pthread_mutex_unlock(&pool->mutex);
+    if (!carved)
+      return false;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Region.
+// -----------------------------------------------------------------------------
+
+static bool xcp_aligned_pool_map (XcpAlignedPool *pool, size_t size, int flags) {
+  const size_t pageSize = xcp_aligned_pool_page_size();
+
+  if (flags & XCP_ALIGNED_POOL_HUGE_PAGES) {
+    // Huge pages are reserved at mmap time: if there are not enough free pages, the
+    // mmap call fails instead of raising a SIGBUS on a page fault.
+    const size_t alignment = XCP_MAX(pool->alignment, XCP_ALIGNED_POOL_HUGE_PAGE_SIZE);
+    const size_t extra = alignment - XCP_ALIGNED_POOL_HUGE_PAGE_SIZE;
+    pool->mappingSize = XCP_ROUND_UP_2(size + extra, XCP_ALIGNED_POOL_HUGE_PAGE_SIZE);
+    pool->mapping = mmap(
+      NULL, pool->mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0
+    );
+    if (pool->mapping != MAP_FAILED) {
+      pool->buffers = (char *)XCP_ROUND_UP_2((uintptr_t)pool->mapping, alignment);
+      pool->hugePages = true;
+      return true;
+    }
+  }
+
+  const size_t alignment = XCP_MAX(pool->alignment, pageSize);
+  const size_t extra = alignment - pageSize;
+  pool->mappingSize = XCP_ROUND_UP_2(size + extra, pageSize);
+  pool->mapping = mmap(
+    NULL, pool->mappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+  );
+  if (pool->mapping == MAP_FAILED)
+    return false;
+
+  pool->buffers = (char *)XCP_ROUND_UP_2((uintptr_t)pool->mapping, alignment);
+  if (flags & XCP_ALIGNED_POOL_HUGE_PAGES)
+    madvise(pool->mapping, pool->mappingSize, MADV_HUGEPAGE);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+XcpAlignedPool *xcp_aligned_pool_create (
+  size_t bufferSize,
+  size_t alignment,
+  size_t capacity,
+  int flags
+) {
+  if (!alignment)
+    alignment = xcp_aligned_pool_page_size();
+
+  if (
+    !bufferSize || !capacity || capacity >= XCP_ALIGNED_POOL_NIL ||
+    (alignment & (alignment - 1)) || bufferSize > SIZE_MAX - alignment
+  ) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  const size_t stride = XCP_ROUND_UP_2(bufferSize, alignment);
+  if (capacity > SIZE_MAX / 2 / stride) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  XcpAlignedPool *pool = calloc(1, sizeof *pool);
+  if (!pool)
+    return NULL;
+
+  pool->bufferSize = stride;
+  pool->alignment = alignment;
+  pool->stride = stride;
+  pool->capacity = capacity;
+  const size_t cacheSize = capacity / (2 * XCP_ALIGNED_POOL_CACHE_THREADS);
+  pool->cacheSize = cacheSize < 2 ? 0 : (uint32_t)XCP_MIN(cacheSize, (size_t)XCP_ALIGNED_POOL_CACHE_SIZE);
+  pool->slabBuffers = XCP_MAX(XCP_ALIGNED_POOL_SLAB_SIZE / stride, (size_t)1);
+  pool->head = XCP_ALIGNED_POOL_HEAD(0, XCP_ALIGNED_POOL_NIL);
+
+  if (!(pool->nexts = malloc(capacity * sizeof *pool->nexts)))
+    goto fail;
+
+  if (!xcp_aligned_pool_map(pool, capacity * stride, flags))
+    goto fail;
+
+  pthread_mutex_init(&pool->mutex, NULL);
+
+  pthread_mutex_lock(&PoolsMutex);
+  pool->id = ++PoolId;
+  LIST_INSERT_HEAD(&Pools, pool, next);
+  pthread_mutex_unlock(&PoolsMutex);
+
+  return pool;
+
+fail:
+  free(pool->nexts);
+  free(pool);
+  return NULL;
+}
+
+void xcp_aligned_pool_destroy (XcpAlignedPool *pool) {
+  // The caches of the other threads are dropped when they are released.
+  XcpAlignedPoolCache *cache = ThreadData.caches;
+  for (size_t i = 0; i < XCP_ALIGNED_POOL_CACHE_COUNT; ++i, ++cache) {
+    if (cache->poolId == pool->id) {
+      cache->pool = NULL;
+      cache->poolId = 0;
+      cache->size = 0;
+      cache->getCount = cache->putCount = 0;
+    }
+  }
+
+  pthread_mutex_lock(&PoolsMutex);
+  LIST_REMOVE(pool, next);
+  pthread_mutex_unlock(&PoolsMutex);
+
+  pthread_mutex_destroy(&pool->mutex);
+  munmap(pool->mapping, pool->mappingSize);
+  free(pool->nexts);
+  free(pool);
+}
+
+void *xcp_aligned_pool_get (XcpAlignedPool *pool) {
+  XcpAlignedPoolCache *cache = pool->cacheSize ? xcp_aligned_pool_cache_get(pool) : NULL;
+  if (XCP_LIKELY(cache)) {
+    if (!cache->size && !xcp_aligned_pool_cache_refill(cache)) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    ++cache->getCount;
+    return xcp_aligned_pool_buffer(pool, cache->indexes[--cache->size]);
+  }
+
+  // No cache, use the shared stack directly.
+  uint32_t index;
+  while ((index = xcp_aligned_pool_pop(pool)) == XCP_ALIGNED_POOL_NIL) {
+    pthread_mutex_lock(&pool->mutex);
+    const bool carved = xcp_aligned_pool_carve(pool, false);
+    pthread_mutex_unlock(&pool->mutex);
+    if (!carved) {
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+  __atomic_fetch_add(&pool->getCount, 1, __ATOMIC_RELAXED);
+  return xcp_aligned_pool_buffer(pool, index);
+}
+
+void xcp_aligned_pool_put (XcpAlignedPool *pool, void *buffer) {
+  const uint32_t index = (uint32_t)xcp_aligned_pool_get_index(pool, buffer);
+
+  XcpAlignedPoolCache *cache = pool->cacheSize ? xcp_aligned_pool_cache_get(pool) : NULL;
+  if (XCP_LIKELY(cache)) {
+    if (cache->size == pool->cacheSize)
+      xcp_aligned_pool_cache_flush(cache, pool->cacheSize / 2);
+    cache->indexes[cache->size++] = index;
+    ++cache->putCount;
+    return;
+  }
+
+  xcp_aligned_pool_push(pool, index, index);
+  __atomic_fetch_add(&pool->putCount, 1, __ATOMIC_RELAXED);
+}
+
+XcpError xcp_aligned_pool_reserve (XcpAlignedPool *pool, size_t count) {
+  if (count > pool->capacity) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->bufferCount < count)
+    xcp_aligned_pool_carve(pool, true);
+  pthread_mutex_unlock(&pool->mutex);
+
+  return XCP_ERR_OK;
+}
+
+size_t xcp_aligned_pool_get_index (const XcpAlignedPool *pool, const void *buffer) {
+  return (size_t)((const char *)buffer - pool->buffers) / pool->stride;
+}
+
+void xcp_aligned_pool_get_region (const XcpAlignedPool *pool, struct iovec *region) {
+  region->iov_base = pool->buffers;
+  region->iov_len = pool->capacity * pool->stride;
+}
+
+void xcp_aligned_pool_get_stats (const XcpAlignedPool *pool, XcpAlignedPoolStats *stats) {
+  stats->bufferSize = pool->bufferSize;
+  stats->alignment = pool->alignment;
+  stats->capacity = pool->capacity;
+  stats->hugePages = pool->hugePages;
+
+  stats->slabCount = __atomic_load_n(&pool->slabCount, __ATOMIC_RELAXED);
+  stats->bufferCount = __atomic_load_n(&pool->bufferCount, __ATOMIC_RELAXED);
+
+  stats->getCount = __atomic_load_n(&pool->getCount, __ATOMIC_RELAXED);
+  stats->putCount = __atomic_load_n(&pool->putCount, __ATOMIC_RELAXED);
+  stats->refillCount = __atomic_load_n(&pool->refillCount, __ATOMIC_RELAXED);
+  stats->flushCount = __atomic_load_n(&pool->flushCount, __ATOMIC_RELAXED);
+}
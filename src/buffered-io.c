@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "xcp-ng/generic/buffered-io.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+
+// =============================================================================
+
+XcpError xcp_buf_reader_init (XcpBufReader *reader, int fd, size_t capacity) {
+  if (!capacity)
+    capacity = XCP_BUF_IO_DEFAULT_SIZE;
+
+  if (!(reader->buf = malloc(capacity)))
+    return XCP_ERR_ERRNO;
+
+  reader->fd = fd;
+  reader->timeout = 0;
+  reader->capacity = capacity;
+  reader->begin = reader->end = reader->scanned = 0;
+  return XCP_ERR_OK;
+}
+
+void xcp_buf_reader_destroy (XcpBufReader *reader) {
+  free(reader->buf);
+  reader->buf = NULL;
+}
+
+size_t xcp_buf_reader_get_size (const XcpBufReader *reader) {
+  return reader->end - reader->begin;
+}
+
+// Read in the free space of the buffer. Return the count of read bytes, 0 at EOF.
+static XcpError xcp_buf_reader_fill (XcpBufReader *reader) {
+  if (reader->begin == reader->end)
+    reader->begin = reader->end = 0;
+  else if (reader->end == reader->capacity && reader->begin) {
+    reader->end -= reader->begin;
+    memmove(reader->buf, reader->buf + reader->begin, reader->end);
+    reader->begin = 0;
+  }
+
+  if (reader->end == reader->capacity) {
+    errno = ENOBUFS;
+    return XCP_ERR_ERRNO;
+  }
+
+  const XcpError ret = xcp_fd_wait_read(
+    reader->fd, reader->buf + reader->end, reader->capacity - reader->end, reader->timeout
+  );
+  if (ret > 0)
+    reader->end += (size_t)ret;
+  return ret;
+}
+
+XcpError xcp_buf_reader_read (XcpBufReader *reader, void *buf, size_t count) {
+  size_t size = xcp_buf_reader_get_size(reader);
+  if (!size) {
+    if (count >= reader->capacity)
+      return xcp_fd_wait_read(reader->fd, buf, count, reader->timeout);
+
+    const XcpError ret = xcp_buf_reader_fill(reader);
+    if (ret <= 0)
+      return ret;
+    size = (size_t)ret;
+  }
+
+  count = XCP_MIN(count, size);
+  memcpy(buf, reader->buf + reader->begin, count);
+  xcp_buf_reader_consume(reader, count);
+  return (XcpError)count;
+}
+
+XcpError xcp_buf_reader_peek (XcpBufReader *reader, size_t count, const char **data) {
+  if (count > reader->capacity) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  while (xcp_buf_reader_get_size(reader) < count) {
+    const XcpError ret = xcp_buf_reader_fill(reader);
+    if (ret < 0)
+      return ret;
+    if (ret == 0)
+      break;
+  }
+
+  *data = reader->buf + reader->begin;
+  return (XcpError)xcp_buf_reader_get_size(reader);
+}
+
+void xcp_buf_reader_consume (XcpBufReader *reader, size_t count) {
+  reader->begin += count;
+  reader->scanned = reader->scanned > count ? reader->scanned - count : 0;
+}
+
+XcpError xcp_buf_reader_read_until (XcpBufReader *reader, char delimiter, const char **data) {
+  for (;;) {
+    char *begin = reader->buf + reader->begin;
+    const size_t size = xcp_buf_reader_get_size(reader);
+
+    // Only the new bytes are scanned.
+    const char *p = memchr(begin + reader->scanned, delimiter, size - reader->scanned);
+    if (p) {
+      const size_t count = (size_t)(p - begin) + 1;
+      xcp_buf_reader_consume(reader, count);
+      *data = begin;
+      return (XcpError)count;
+    }
+    reader->scanned = size;
+
+    const XcpError ret = xcp_buf_reader_fill(reader);
+    if (ret < 0)
+      return ret;
+
+    if (ret == 0) {
+      // EOF, the buffer may be compacted by the fill.
+      const size_t count = xcp_buf_reader_get_size(reader);
+      *data = reader->buf + reader->begin;
+      xcp_buf_reader_consume(reader, count);
+      return (XcpError)count;
+    }
+  }
+}
+
+XcpError xcp_buf_reader_read_line (XcpBufReader *reader, const char **data) {
+  return xcp_buf_reader_read_until(reader, '\n', data);
+}
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_buf_writer_init (XcpBufWriter *writer, int fd, size_t capacity) {
+  if (!capacity)
+    capacity = XCP_BUF_IO_DEFAULT_SIZE;
+
+  if (!(writer->buf = malloc(capacity)))
+    return XCP_ERR_ERRNO;
+
+  writer->fd = fd;
+  writer->capacity = capacity;
+  writer->size = 0;
+  return XCP_ERR_OK;
+}
+
+void xcp_buf_writer_destroy (XcpBufWriter *writer) {
+  free(writer->buf);
+  writer->buf = NULL;
+}
+
+size_t xcp_buf_writer_get_size (const XcpBufWriter *writer) {
+  return writer->size;
+}
+
+// Keep the buffered bytes which are not written.
+static void xcp_buf_writer_drop (XcpBufWriter *writer, size_t count) {
+  count = XCP_MIN(count, writer->size);
+  writer->size -= count;
+  memmove(writer->buf, writer->buf + count, writer->size);
+}
+
+XcpError xcp_buf_writer_write (XcpBufWriter *writer, const void *buf, size_t count) {
+  if (count <= writer->capacity - writer->size) {
+    memcpy(writer->buf + writer->size, buf, count);
+    writer->size += count;
+    return XCP_ERR_OK;
+  }
+
+  const struct iovec iovs[] = {
+    { .iov_base = writer->buf, .iov_len = writer->size },
+    { .iov_base = (void *)buf, .iov_len = count }
+  };
+  size_t offset;
+  const XcpError ret = xcp_fd_writev_all(writer->fd, iovs, XCP_ARRAY_LEN(iovs), &offset);
+  if (ret < 0) {
+    xcp_buf_writer_drop(writer, offset);
+    return ret;
+  }
+
+  writer->size = 0;
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_buf_writer_write_str (XcpBufWriter *writer, const char *str) {
+  return xcp_buf_writer_write(writer, str, strlen(str));
+}
+
+XcpError xcp_buf_writer_flush (XcpBufWriter *writer) {
+  if (!writer->size)
+    return XCP_ERR_OK;
+
+  size_t offset;
+  const XcpError ret = xcp_fd_write_all(writer->fd, writer->buf, writer->size, &offset);
+  if (ret < 0) {
+    xcp_buf_writer_drop(writer, offset);
+    return ret;
+  }
+
+  writer->size = 0;
+  return XCP_ERR_OK;
+}
@@ -0,0 +1,541 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+#endif // ifdef HAVE_IO_URING
+
+#include "coroutine/async-io.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+
+// =============================================================================
+
+// Flags of preadv2/pwritev2, defined by glibc >= 2.26 or <linux/fs.h>.
+#ifndef RWF_HIPRI
+  #define RWF_HIPRI 0x00000001
+#endif // ifndef RWF_HIPRI
+
+#ifndef RWF_NOWAIT
+  #define RWF_NOWAIT 0x00000008
+#endif // ifndef RWF_NOWAIT
+
+#define URING_ENTRY_COUNT 256U
+#define THREAD_COUNT 4
+
+typedef struct {
+  XcpAsyncIoOp *first;
+  XcpAsyncIoOp **last;
+} XcpAsyncIoOpList;
+
+static inline void xcp_async_io_op_list_init (XcpAsyncIoOpList *list) {
+  list->first = NULL;
+  list->last = &list->first;
+}
+
+static inline void xcp_async_io_op_list_push (XcpAsyncIoOpList *list, XcpAsyncIoOp *op) {
+  op->next = NULL;
+  *list->last = op;
+  list->last = &op->next;
+}
+
+static inline XcpAsyncIoOp *xcp_async_io_op_list_pop (XcpAsyncIoOpList *list) {
+  XcpAsyncIoOp *op = list->first;
+  if (op && !(list->first = op->next))
+    list->last = &list->first;
+  return op;
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef HAVE_IO_URING
+  typedef struct {
+    int fd;
+
+    void *sqRing;
+    size_t sqRingSize;
+    uint *sqHead;
+    uint *sqTail;
+    uint sqMask;
+    uint sqEntryCount;
+    uint *sqArray;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    void *cqRing;
+    size_t cqRingSize;
+    uint *cqHead;
+    uint *cqTail;
+    uint cqMask;
+    struct io_uring_cqe *cqes;
+
+    uint inFlightCount;
+    uint toSubmitCount;
+  } XcpUring;
+#endif // ifdef HAVE_IO_URING
+
+struct XcpAsyncIo {
+  // Operations waiting for a free submission slot.
+  XcpAsyncIoOpList pendings;
+
+  // Operations which cannot be started after a submit error, returned by the next reap.
+  XcpAsyncIoOpList failed;
+
+  #ifdef HAVE_IO_URING
+    XcpUring *uring;
+  #endif // ifdef HAVE_IO_URING
+
+  // Fallback.
+  int eventFd;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  XcpAsyncIoOpList queue;
+  XcpAsyncIoOpList completed;
+  pthread_t threads[THREAD_COUNT];
+  int threadCount;
+  bool stop;
+};
+
+// -----------------------------------------------------------------------------
+
+#ifdef HAVE_PREADV2
+  #define xcp_preadv2 preadv2
+  #define xcp_pwritev2 pwritev2
+#else
+  // The offset is given in two parts to the syscalls.
+  static ssize_t xcp_preadv2 (int fd, const struct iovec *iovs, int iovCount, off_t offset, int flags) {
+    #ifdef __NR_preadv2
+      const ulonglong pos = (ulonglong)offset;
+      return syscall(__NR_preadv2, fd, iovs, iovCount, (ulong)pos, (ulong)(pos >> 32 >> 32), flags);
+    #else
+      XCP_UNUSED(fd); XCP_UNUSED(iovs); XCP_UNUSED(iovCount); XCP_UNUSED(offset); XCP_UNUSED(flags);
+      errno = ENOSYS;
+      return -1;
+    #endif // ifdef __NR_preadv2
+  }
+
+  static ssize_t xcp_pwritev2 (int fd, const struct iovec *iovs, int iovCount, off_t offset, int flags) {
+    #ifdef __NR_pwritev2
+      const ulonglong pos = (ulonglong)offset;
+      return syscall(__NR_pwritev2, fd, iovs, iovCount, (ulong)pos, (ulong)(pos >> 32 >> 32), flags);
+    #else
+      XCP_UNUSED(fd); XCP_UNUSED(iovs); XCP_UNUSED(iovCount); XCP_UNUSED(offset); XCP_UNUSED(flags);
+      errno = ENOSYS;
+      return -1;
+    #endif // ifdef __NR_pwritev2
+  }
+#endif // ifdef HAVE_PREADV2
+
+bool xcp_async_io_is_sync (const XcpAsyncIoOp *op) {
+  return op->flags & (RWF_NOWAIT | RWF_HIPRI);
+}
+
+void xcp_async_io_exec (XcpAsyncIoOp *op) {
+  ssize_t ret;
+  do {
+    switch (op->type) {
+      case XcpAsyncIoOpPreadv:
+        ret = op->flags
+          ? xcp_preadv2(op->fd, op->iovs, (int)op->iovCount, op->offset, op->flags)
+          : preadv(op->fd, op->iovs, (int)op->iovCount, op->offset);
+        break;
+      case XcpAsyncIoOpPwritev:
+        ret = op->flags
+          ? xcp_pwritev2(op->fd, op->iovs, (int)op->iovCount, op->offset, op->flags)
+          : pwritev(op->fd, op->iovs, (int)op->iovCount, op->offset);
+        break;
+      case XcpAsyncIoOpFsync:
+        ret = fsync(op->fd);
+        break;
+      case XcpAsyncIoOpFdatasync:
+        ret = fdatasync(op->fd);
+        break;
+      default:
+        ret = -1;
+        errno = EINVAL;
+    }
+  } while (ret < 0 && errno == EINTR);
+
+  op->result = ret < 0 ? -errno : ret;
+}
+
+// -----------------------------------------------------------------------------
+// io_uring engine.
+// See: https://kernel.dk/io_uring.pdf
+// -----------------------------------------------------------------------------
+
+#ifdef HAVE_IO_URING
+  static void xcp_uring_destroy (XcpUring *uring) {
+    if (uring->sqes)
+      munmap(uring->sqes, uring->sqesSize);
+    if (uring->cqRing && uring->cqRing != uring->sqRing)
+      munmap(uring->cqRing, uring->cqRingSize);
+    if (uring->sqRing)
+      munmap(uring->sqRing, uring->sqRingSize);
+    xcp_fd_close(uring->fd);
+    free(uring);
+  }
+
+  static XcpUring *xcp_uring_create () {
+    XcpUring *uring = calloc(1, sizeof *uring);
+    if (!uring)
+      return NULL;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    if ((uring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRY_COUNT, &params)) < 0) {
+      free(uring);
+      return NULL;
+    }
+    xcp_fd_set_close_on_exec(uring->fd, true);
+
+    uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint);
+    uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+      uring->sqRingSize = uring->cqRingSize = XCP_MAX(uring->sqRingSize, uring->cqRingSize);
+
+    void *ring = mmap(
+      NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING
+    );
+    if (ring == MAP_FAILED)
+      goto fail;
+    uring->sqRing = ring;
+
+    if (singleMmap)
+      uring->cqRing = ring;
+    else {
+      ring = mmap(
+        NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING
+      );
+      if (ring == MAP_FAILED)
+        goto fail;
+      uring->cqRing = ring;
+    }
+
+    uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring = mmap(
+      NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES
+    );
+    if (ring == MAP_FAILED)
+      goto fail;
+    uring->sqes = ring;
+
+    char *sq = uring->sqRing;
+    uring->sqHead = (uint *)(sq + params.sq_off.head);
+    uring->sqTail = (uint *)(sq + params.sq_off.tail);
+    uring->sqMask = *(uint *)(sq + params.sq_off.ring_mask);
+    uring->sqEntryCount = *(uint *)(sq + params.sq_off.ring_entries);
+    uring->sqArray = (uint *)(sq + params.sq_off.array);
+
+    char *cq = uring->cqRing;
+    uring->cqHead = (uint *)(cq + params.cq_off.head);
+    uring->cqTail = (uint *)(cq + params.cq_off.tail);
+    uring->cqMask = *(uint *)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return uring;
+
+  fail:
+    xcp_uring_destroy(uring);
+    return NULL;
+  }
+
+  static void xcp_uring_prep (XcpUring *uring, XcpAsyncIoOp *op) {
+    const uint tail = *uring->sqTail;
+    const uint index = tail & uring->sqMask;
+
+    struct io_uring_sqe *sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = op->fd;
+    sqe->user_data = (__u64)(uintptr_t)op;
+
+    switch (op->type) {
+      case XcpAsyncIoOpPreadv:
+      case XcpAsyncIoOpPwritev:
+        sqe->opcode = op->type == XcpAsyncIoOpPreadv ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->addr = (__u64)(uintptr_t)op->iovs;
+        sqe->len = op->iovCount;
+        sqe->off = (__u64)op->offset;
+        sqe->rw_flags = (__u32)op->flags;
+        break;
+      case XcpAsyncIoOpFsync:
+      case XcpAsyncIoOpFdatasync:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = op->type == XcpAsyncIoOpFdatasync ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    }
+
+    uring->sqArray[index] = index;
+    __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++uring->inFlightCount;
+    ++uring->toSubmitCount;
+  }
+
+  // Take back the prepared entries which are not consumed by the kernel after an
+  // io_uring_enter error: they are the last ones of the submission queue.
+  static void xcp_uring_unprep (XcpUring *uring, XcpAsyncIoOpList *failed) {
+    uint tail = *uring->sqTail;
+    for (; uring->toSubmitCount; --uring->toSubmitCount) {
+      const uint index = uring->sqArray[--tail & uring->sqMask];
+      xcp_async_io_op_list_push(failed, (XcpAsyncIoOp *)(uintptr_t)uring->sqes[index].user_data);
+      --uring->inFlightCount;
+    }
+    __atomic_store_n(uring->sqTail, tail, __ATOMIC_RELEASE);
+  }
+
+  static XcpError xcp_uring_submit (XcpUring *uring, XcpAsyncIoOpList *pendings, XcpAsyncIoOpList *failed) {
+    // Limit the in-flight operations to never overflow the completion queue.
+    XcpAsyncIoOp *op;
+    while (uring->inFlightCount < uring->sqEntryCount && (op = xcp_async_io_op_list_pop(pendings)))
+      xcp_uring_prep(uring, op);
+
+    while (uring->toSubmitCount) {
+      const int ret = (int)syscall(__NR_io_uring_enter, uring->fd, uring->toSubmitCount, 0, 0, NULL, 0);
+      if (ret < 0) {
+        // Retry at the next submit call: no completion may notify the fd.
+        if (errno == EAGAIN || errno == EBUSY)
+          return XCP_ERR_AGAIN;
+        if (errno == EINTR)
+          continue;
+        xcp_uring_unprep(uring, failed);
+        return XCP_ERR_ERRNO;
+      }
+      uring->toSubmitCount -= (uint)ret;
+    }
+    return XCP_ERR_OK;
+  }
+
+  static XcpAsyncIoOp *xcp_uring_reap (XcpUring *uring) {
+    XcpAsyncIoOpList completed;
+    xcp_async_io_op_list_init(&completed);
+
+    uint head = *uring->cqHead;
+    const uint tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe *cqe = &uring->cqes[head & uring->cqMask];
+      XcpAsyncIoOp *op = (XcpAsyncIoOp *)(uintptr_t)cqe->user_data;
+      op->result = cqe->res;
+      xcp_async_io_op_list_push(&completed, op);
+      --uring->inFlightCount;
+    }
+    __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+
+    return completed.first;
+  }
+#endif // ifdef HAVE_IO_URING
+
+// -----------------------------------------------------------------------------
+// Thread pool engine.
+// -----------------------------------------------------------------------------
+
+static void *xcp_async_io_thread (void *data) {
+  XcpAsyncIo *asyncIo = data;
+
+  pthread_mutex_lock(&asyncIo->mutex);
+  for (;;) {
+    XcpAsyncIoOp *op;
+    while (!(op = xcp_async_io_op_list_pop(&asyncIo->queue)) && !asyncIo->stop)
+      pthread_cond_wait(&asyncIo->cond, &asyncIo->mutex);
+    if (!op)
+      break;
+    pthread_mutex_unlock(&asyncIo->mutex);
+
+    xcp_async_io_exec(op);
+
+    pthread_mutex_lock(&asyncIo->mutex);
+    const bool notify = !asyncIo->completed.first;
+    xcp_async_io_op_list_push(&asyncIo->completed, op);
+    if (notify) {
+      const uint64_t value = 1;
+      xcp_fd_write(asyncIo->eventFd, &value, sizeof value);
+    }
+  }
+  pthread_mutex_unlock(&asyncIo->mutex);
+
+  return NULL;
+}
+
+static void xcp_async_io_stop_threads (XcpAsyncIo *asyncIo) {
+  pthread_mutex_lock(&asyncIo->mutex);
+  asyncIo->stop = true;
+  pthread_cond_broadcast(&asyncIo->cond);
+  pthread_mutex_unlock(&asyncIo->mutex);
+
+  for (int i = 0; i < asyncIo->threadCount; ++i)
+    pthread_join(asyncIo->threads[i], NULL);
+
+  pthread_cond_destroy(&asyncIo->cond);
+  pthread_mutex_destroy(&asyncIo->mutex);
+  xcp_fd_close(asyncIo->eventFd);
+}
+
+static XcpError xcp_async_io_start_threads (XcpAsyncIo *asyncIo) {
+  if ((asyncIo->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    return XCP_ERR_ERRNO;
+
+  pthread_mutex_init(&asyncIo->mutex, NULL);
+  pthread_cond_init(&asyncIo->cond, NULL);
+  xcp_async_io_op_list_init(&asyncIo->queue);
+  xcp_async_io_op_list_init(&asyncIo->completed);
+
+  for (; asyncIo->threadCount < THREAD_COUNT; ++asyncIo->threadCount) {
+    const int ret = pthread_create(&asyncIo->threads[asyncIo->threadCount], NULL, xcp_async_io_thread, asyncIo);
+    if (ret) {
+      xcp_async_io_stop_threads(asyncIo);
+      errno = ret;
+      return XCP_ERR_ERRNO;
+    }
+  }
+
+  return XCP_ERR_OK;
+}
+
+// -----------------------------------------------------------------------------
+
+XcpAsyncIo *xcp_async_io_create () {
+  XcpAsyncIo *asyncIo = calloc(1, sizeof *asyncIo);
+  if (!asyncIo)
+    return NULL;
+  xcp_async_io_op_list_init(&asyncIo->pendings);
+  xcp_async_io_op_list_init(&asyncIo->failed);
+
+  #ifdef HAVE_IO_URING
+    // io_uring may be unavailable at runtime (old kernel, seccomp...).
+    if ((asyncIo->uring = xcp_uring_create()))
+      return asyncIo;
+  #endif // ifdef HAVE_IO_URING
+
+  if (xcp_async_io_start_threads(asyncIo) != XCP_ERR_OK) {
+    free(asyncIo);
+    return NULL;
+  }
+
+  return asyncIo;
+}
+
+void xcp_async_io_destroy (XcpAsyncIo *asyncIo) {
+  #ifdef HAVE_IO_URING
+    if (asyncIo->uring) {
+      xcp_uring_destroy(asyncIo->uring);
+      free(asyncIo);
+      return;
+    }
+  #endif // ifdef HAVE_IO_URING
+
+  xcp_async_io_stop_threads(asyncIo);
+  free(asyncIo);
+}
+
+int xcp_async_io_get_fd (const XcpAsyncIo *asyncIo) {
+  #ifdef HAVE_IO_URING
+    if (asyncIo->uring)
+      return asyncIo->uring->fd;
+  #endif // ifdef HAVE_IO_URING
+  return asyncIo->eventFd;
+}
+
+void xcp_async_io_queue (XcpAsyncIo *asyncIo, XcpAsyncIoOp *op) {
+  xcp_async_io_op_list_push(&asyncIo->pendings, op);
+}
+
+#ifdef HAVE_IO_URING
+  static XcpError xcp_async_io_submit_uring (XcpAsyncIo *asyncIo) {
+    const XcpError ret = xcp_uring_submit(asyncIo->uring, &asyncIo->pendings, &asyncIo->failed);
+    if (ret != XCP_ERR_ERRNO)
+      return ret;
+
+    // Complete all the operations which are not started: nothing else would.
+    const int error = errno;
+    *asyncIo->failed.last = asyncIo->pendings.first;
+    if (asyncIo->pendings.first)
+      asyncIo->failed.last = asyncIo->pendings.last;
+    xcp_async_io_op_list_init(&asyncIo->pendings);
+
+    for (XcpAsyncIoOp *op = asyncIo->failed.first; op; op = op->next)
+      op->result = -error;
+
+    errno = error;
+    return XCP_ERR_ERRNO;
+  }
+#endif // ifdef HAVE_IO_URING
+
+XcpError xcp_async_io_submit (XcpAsyncIo *asyncIo) {
+  if (!asyncIo->pendings.first) {
+    #ifdef HAVE_IO_URING
+      if (asyncIo->uring && asyncIo->uring->toSubmitCount)
+        return xcp_async_io_submit_uring(asyncIo);
+    #endif // ifdef HAVE_IO_URING
+    return XCP_ERR_OK;
+  }
+
+  #ifdef HAVE_IO_URING
+    if (asyncIo->uring)
+      return xcp_async_io_submit_uring(asyncIo);
+  #endif // ifdef HAVE_IO_URING
+
+  pthread_mutex_lock(&asyncIo->mutex);
+  *asyncIo->queue.last = asyncIo->pendings.first;
+  asyncIo->queue.last = asyncIo->pendings.last;
+  pthread_cond_broadcast(&asyncIo->cond);
+  pthread_mutex_unlock(&asyncIo->mutex);
+
+  xcp_async_io_op_list_init(&asyncIo->pendings);
+  return XCP_ERR_OK;
+}
+
+XcpAsyncIoOp *xcp_async_io_reap (XcpAsyncIo *asyncIo) {
+  #ifdef HAVE_IO_URING
+    if (asyncIo->uring) {
+      XcpAsyncIoOp *op = xcp_uring_reap(asyncIo->uring);
+      if (!asyncIo->failed.first)
+        return op;
+
+      // Return the failed operations first.
+      *asyncIo->failed.last = op;
+      op = asyncIo->failed.first;
+      xcp_async_io_op_list_init(&asyncIo->failed);
+      return op;
+    }
+  #endif // ifdef HAVE_IO_URING
+
+  // Reset the eventfd counter, it is only incremented when the completed list was empty.
+  uint64_t value;
+  const ssize_t ret = read(asyncIo->eventFd, &value, sizeof value);
+  XCP_UNUSED(ret);
+
+  pthread_mutex_lock(&asyncIo->mutex);
+  XcpAsyncIoOp *op = asyncIo->completed.first;
+  xcp_async_io_op_list_init(&asyncIo->completed);
+  pthread_mutex_unlock(&asyncIo->mutex);
+
+  return op;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_COROUTINE_ASYNC_IO_H_
+#define _XCP_NG_COROUTINE_ASYNC_IO_H_
+
+#include "xcp-ng/generic/coroutine.h"
+
+// =============================================================================
+
+// Asynchronous positional I/O engine of the reactor: io_uring if available,
+// a small pool of threads otherwise.
+
+struct iovec;
+
+typedef enum {
+  XcpAsyncIoOpPreadv,
+  XcpAsyncIoOpPwritev,
+  XcpAsyncIoOpFsync,
+  XcpAsyncIoOpFdatasync
+} XcpAsyncIoOpType;
+
+typedef struct XcpAsyncIoOp {
+  XcpAsyncIoOpType type;
+  int fd;
+  const struct iovec *iovs;
+  uint iovCount;
+  off_t offset;
+  int flags; // RWF_* flags of preadv2/pwritev2.
+
+  // Woken by the reactor on completion, unless `cb` is set: in this case `cb` is called.
+  XcpCoroutine *coroutine;
+  void (*cb)(struct XcpAsyncIoOp *op);
+
+  // Number of bytes or -errno.
+  ssize_t result;
+
+  struct XcpAsyncIoOp *next;
+} XcpAsyncIoOp;
+
+typedef struct XcpAsyncIo XcpAsyncIo;
+
+XCP_NO_DISCARD XcpAsyncIo *xcp_async_io_create ();
+
+// In-flight operations are never completed.
+void xcp_async_io_destroy (XcpAsyncIo *asyncIo);
+
+// Readable when completed operations can be reaped.
+XCP_NO_DISCARD int xcp_async_io_get_fd (const XcpAsyncIo *asyncIo);
+
+// Queue an operation, it is only started by the next xcp_async_io_submit call.
+void xcp_async_io_queue (XcpAsyncIo *asyncIo, XcpAsyncIoOp *op);
+
+// Delay before a new submit call after XCP_ERR_AGAIN, in milliseconds.
+#define XCP_ASYNC_IO_RETRY_DELAY 1
+
+// Start the queued operations in one batch. Return XCP_ERR_AGAIN if the kernel cannot accept
+// them yet: the fd may never be notified, submit again after XCP_ASYNC_IO_RETRY_DELAY.
+// On error, the operations which cannot be started are completed with the error: they are
+// returned by the next xcp_async_io_reap call but the fd is not notified.
+XcpError xcp_async_io_submit (XcpAsyncIo *asyncIo);
+
+// Return the list of completed operations.
+XCP_NO_DISCARD XcpAsyncIoOp *xcp_async_io_reap (XcpAsyncIo *asyncIo);
+
+// Execute an operation synchronously.
+void xcp_async_io_exec (XcpAsyncIoOp *op);
+
+// Return true if the operation must be executed synchronously: RWF_NOWAIT must not
+// wait and RWF_HIPRI polls the completion in the caller.
+XCP_NO_DISCARD bool xcp_async_io_is_sync (const XcpAsyncIoOp *op);
+
+// -----------------------------------------------------------------------------
+
+// Queue an operation in the engine of the reactor of the current thread. The reactor
+// keeps running until `op->cb` is called by its loop.
+XcpError xcp_reactor_queue_async_io (XcpAsyncIoOp *op);
+
+#endif // _XCP_NG_COROUTINE_ASYNC_IO_H_ included
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "coroutine/coroutine-private.h"
+#include "xcp-ng/generic/cancel.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+#include "xcp-ng/generic/timer.h"
+
+// =============================================================================
+
+XcpError xcp_cancel_init (XcpCancel *cancel, longlong deadline) {
+  if ((cancel->eventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    return XCP_ERR_ERRNO;
+
+  cancel->deadline = deadline;
+  cancel->cancelled = 0;
+  return XCP_ERR_OK;
+}
+
+void xcp_cancel_destroy (XcpCancel *cancel) {
+  xcp_fd_close(cancel->eventFd);
+  cancel->eventFd = -1;
+}
+
+void xcp_cancel_request (XcpCancel *cancel) {
+  if (__atomic_exchange_n(&cancel->cancelled, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  // The counter is never read: the eventfd stays readable for all pollers and reactors.
+  const uint64_t value = 1;
+  while (write(cancel->eventFd, &value, sizeof value) < 0 && errno == EINTR);
+}
+
+bool xcp_cancel_is_cancelled (const XcpCancel *cancel) {
+  return __atomic_load_n(&cancel->cancelled, __ATOMIC_ACQUIRE);
+}
+
+XcpError xcp_cancel_check (const XcpCancel *cancel) {
+  if (!cancel)
+    return XCP_ERR_OK;
+
+  if (xcp_cancel_is_cancelled(cancel)) {
+    errno = ECANCELED;
+    return XCP_ERR_ERRNO;
+  }
+
+  if (cancel->deadline != XCP_CANCEL_NO_DEADLINE && xcp_timer_now() >= cancel->deadline) {
+    errno = ETIMEDOUT;
+    return XCP_ERR_TIMEOUT;
+  }
+
+  return XCP_ERR_OK;
+}
+
+int xcp_cancel_get_timeout (const XcpCancel *cancel, int timeout) {
+  if (!cancel || cancel->deadline == XCP_CANCEL_NO_DEADLINE)
+    return timeout;
+
+  const longlong remaining = XCP_MAX(cancel->deadline - xcp_timer_now(), 0LL);
+  if (timeout >= 0 && timeout < remaining)
+    return timeout;
+  return (int)XCP_MIN(remaining, (longlong)INT_MAX);
+}
+
+XcpCancel *xcp_cancel_set_current (XcpCancel *cancel) {
+  XcpCoroutine *self = xcp_coroutine_get_self();
+  XcpCancel *prev = self->cancel;
+  self->cancel = cancel;
+  return prev;
+}
+
+XcpCancel *xcp_cancel_get_current () {
+  return xcp_coroutine_get_self()->cancel;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_COROUTINE_CONTEXT_H_
+#define _XCP_NG_COROUTINE_CONTEXT_H_
+
+#include "config.h"
+
+#ifndef HAVE_COROUTINE_NATIVE_CONTEXT
+  #include <setjmp.h>
+#endif // ifndef HAVE_COROUTINE_NATIVE_CONTEXT
+
+#include "xcp-ng/generic/global.h"
+
+// =============================================================================
+
+typedef void (*XcpCoroutineContextEntry)(void *arg);
+
+typedef struct {
+  #ifdef HAVE_COROUTINE_NATIVE_CONTEXT
+    void *sp;
+  #else
+    sigjmp_buf env;
+  #endif // ifdef HAVE_COROUTINE_NATIVE_CONTEXT
+} XcpCoroutineContext;
+
+// Prepare a context which executes `entry(arg)` on `stack` at the first switch.
+// `entry` must never return.
+void xcp_coroutine_context_init (
+  XcpCoroutineContext *context,
+  void *stack,
+  size_t stackSize,
+  XcpCoroutineContextEntry entry,
+  void *arg
+);
+
+// Save the current execution context in `from` and restore `to`.
+// Return the non-zero `value` given by the switch which restores `from` later.
+int xcp_coroutine_context_switch (XcpCoroutineContext *from, XcpCoroutineContext *to, int value);
+
+#endif // _XCP_NG_COROUTINE_CONTEXT_H_ included
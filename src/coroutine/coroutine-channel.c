@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "coroutine/coroutine-private.h"
+#include "coroutine/spinlock.h"
+#include "xcp-ng/generic/coroutine-channel.h"
+#include "xcp-ng/generic/math.h"
+
+// =============================================================================
+
+// Blocked sender or receiver, allocated on the stack of its coroutine.
+typedef struct XcpCoChanWaiter {
+  XcpCoroutine *coroutine;
+
+  // Remaining elements to send or remaining space to receive.
+  char *elems;
+  size_t count;
+
+  // Count of transferred elements.
+  size_t done;
+  bool closed;
+
+  // Set if the waiter is in the wait list of its channel.
+  bool queued;
+
+  // Select only: index of the executed operation, shared by all waiters of the select.
+  int *selected;
+  int index;
+
+  TAILQ_ENTRY(XcpCoChanWaiter) next;
+
+  // Waiters to wake once the channel is unlocked.
+  struct XcpCoChanWaiter *nextToWake;
+} XcpCoChanWaiter;
+
+typedef TAILQ_HEAD(XcpCoChanWaitList, XcpCoChanWaiter) XcpCoChanWaitList;
+
+struct XcpCoChan {
+  int spinlock;
+  bool closed;
+
+  size_t elemSize;
+  size_t capacity;
+
+  // Ring buffer.
+  size_t head;
+  size_t size;
+
+  // If there are senders, the buffer is full. If there are receivers, the buffer is empty.
+  XcpCoChanWaitList senders;
+  XcpCoChanWaitList receivers;
+
+  char buffer[];
+};
+
+// -----------------------------------------------------------------------------
+
+static inline void xcp_co_chan_ring_push (XcpCoChan *chan, const char *elems, size_t count) {
+  const size_t elemSize = chan->elemSize;
+  const size_t tail = (chan->head + chan->size) % chan->capacity;
+  const size_t first = XCP_MIN(count, chan->capacity - tail);
+  memcpy(chan->buffer + tail * elemSize, elems, first * elemSize);
+  memcpy(chan->buffer, elems + first * elemSize, (count - first) * elemSize);
+  chan->size += count;
+}
+
+static inline void xcp_co_chan_ring_pop (XcpCoChan *chan, char *elems, size_t count) {
+  const size_t elemSize = chan->elemSize;
+  const size_t first = XCP_MIN(count, chan->capacity - chan->head);
+  memcpy(elems, chan->buffer + chan->head * elemSize, first * elemSize);
+  memcpy(elems + first * elemSize, chan->buffer, (count - first) * elemSize);
+  chan->head = (chan->head + count) % chan->capacity;
+  chan->size -= count;
+}
+
+// Return the first waiter which can be served. The waiters of an already executed
+// select are removed.
+static XcpCoChanWaiter *xcp_co_chan_first_waiter (XcpCoChanWaitList *waiters) {
+  XcpCoChanWaiter *waiter;
+  while ((waiter = TAILQ_FIRST(waiters))) {
+    if (!waiter->selected)
+      return waiter;
+
+    int expected = -1;
+    if (__atomic_compare_exchange_n(
+      waiter->selected, &expected, waiter->index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+    ))
+      return waiter;
+
+    TAILQ_REMOVE(waiters, waiter, next);
+    waiter->queued = false;
+  }
+  return NULL;
+}
+
+static inline void xcp_co_chan_remove_waiter (
+  XcpCoChanWaitList *waiters,
+  XcpCoChanWaiter *waiter,
+  XcpCoChanWaiter **toWake
+) {
+  TAILQ_REMOVE(waiters, waiter, next);
+  waiter->queued = false;
+  waiter->nextToWake = *toWake;
+  *toWake = waiter;
+}
+
+static void xcp_co_chan_wake_waiters (XcpCoChanWaiter *toWake) {
+  while (toWake) {
+    // The waiter can be destroyed once its coroutine is woken.
+    XcpCoChanWaiter *next = toWake->nextToWake;
+    xcp_coroutine_wake(toWake->coroutine);
+    toWake = next;
+  }
+}
+
+// Transfer up to `count` elements to the receivers or in the buffer without blocking.
+static size_t xcp_co_chan_push (XcpCoChan *chan, const char *elems, size_t count, XcpCoChanWaiter **toWake) {
+  const size_t elemSize = chan->elemSize;
+  size_t sent = 0;
+
+  // 1. Give the elements directly to the waiting receivers.
+  XcpCoChanWaiter *waiter;
+  while (sent < count && (waiter = xcp_co_chan_first_waiter(&chan->receivers))) {
+    const size_t n = XCP_MIN(count - sent, waiter->count);
+    memcpy(waiter->elems, elems + sent * elemSize, n * elemSize);
+    waiter->done += n;
+    sent += n;
+
+    // A receiver is woken as soon as it has at least one element.
+    xcp_co_chan_remove_waiter(&chan->receivers, waiter, toWake);
+  }
+
+  // 2. Fill the buffer.
+  const size_t n = XCP_MIN(count - sent, chan->capacity - chan->size);
+  if (n) {
+    xcp_co_chan_ring_push(chan, elems + sent * elemSize, n);
+    sent += n;
+  }
+
+  return sent;
+}
+
+// Transfer up to `count` elements from the buffer or the senders without blocking.
+static size_t xcp_co_chan_pop (XcpCoChan *chan, char *elems, size_t count, XcpCoChanWaiter **toWake) {
+  const size_t elemSize = chan->elemSize;
+
+  // 1. Take the buffered elements first to keep the order.
+  size_t received = XCP_MIN(count, chan->size);
+  if (received)
+    xcp_co_chan_ring_pop(chan, elems, received);
+
+  // 2. Take the elements of the waiting senders, directly if the buffer is empty,
+  // and refill the buffer.
+  XcpCoChanWaiter *waiter;
+  while (
+    ((received < count && !chan->size) || chan->size < chan->capacity) &&
+    (waiter = xcp_co_chan_first_waiter(&chan->senders))
+  ) {
+    if (received < count && !chan->size) {
+      const size_t n = XCP_MIN(count - received, waiter->count);
+      memcpy(elems + received * elemSize, waiter->elems, n * elemSize);
+      waiter->elems += n * elemSize;
+      waiter->count -= n;
+      waiter->done += n;
+      received += n;
+    }
+
+    const size_t n = XCP_MIN(waiter->count, chan->capacity - chan->size);
+    if (n) {
+      xcp_co_chan_ring_push(chan, waiter->elems, n);
+      waiter->elems += n * elemSize;
+      waiter->count -= n;
+      waiter->done += n;
+    }
+
+    // A sender is woken once all its elements are transferred.
+    if (!waiter->count)
+      xcp_co_chan_remove_waiter(&chan->senders, waiter, toWake);
+  }
+
+  return received;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  int *spinlock;
+  XcpCoChanWaiter *toWake;
+} XcpCoChanParkData;
+
+static void xcp_co_chan_park_cb (void *userData) {
+  const XcpCoChanParkData data = *(XcpCoChanParkData *)userData;
+  xcp_spin_unlock(data.spinlock);
+  xcp_co_chan_wake_waiters(data.toWake);
+}
+
+// Wait until the waiter is served. The channel must be locked, it is released once
+// the coroutine is suspended.
+static void xcp_co_chan_wait (
+  XcpCoChan *chan,
+  XcpCoChanWaitList *waiters,
+  XcpCoChanWaiter *waiter,
+  XcpCoChanWaiter *toWake
+) {
+  assert(xcp_coroutine_in_coroutine());
+
+  waiter->coroutine = xcp_coroutine_get_self();
+  waiter->queued = true;
+  TAILQ_INSERT_TAIL(waiters, waiter, next);
+
+  XcpCoChanParkData data = { &chan->spinlock, toWake };
+  xcp_coroutine_park(xcp_co_chan_park_cb, &data);
+}
+
+static XcpError xcp_co_chan_send_impl (XcpCoChan *chan, const char *elems, size_t count, bool block) {
+  XcpCoChanWaiter *toWake = NULL;
+
+  xcp_spin_lock(&chan->spinlock);
+  if (chan->closed) {
+    xcp_spin_unlock(&chan->spinlock);
+    errno = EPIPE;
+    return XCP_ERR_ERRNO;
+  }
+
+  const size_t sent = xcp_co_chan_push(chan, elems, count, &toWake);
+  if (sent == count || !block) {
+    xcp_spin_unlock(&chan->spinlock);
+    xcp_co_chan_wake_waiters(toWake);
+    if (!sent) {
+      errno = EAGAIN;
+      return XCP_ERR_ERRNO;
+    }
+    return (XcpError)sent;
+  }
+
+  XcpCoChanWaiter waiter = {
+    .elems = (char *)elems + sent * chan->elemSize,
+    .count = count - sent,
+    .done = sent
+  };
+  xcp_co_chan_wait(chan, &chan->senders, &waiter, toWake);
+
+  if (!waiter.done) {
+    errno = EPIPE;
+    return XCP_ERR_ERRNO;
+  }
+  return (XcpError)waiter.done;
+}
+
+static XcpError xcp_co_chan_recv_impl (XcpCoChan *chan, char *elems, size_t count, bool block) {
+  XcpCoChanWaiter *toWake = NULL;
+
+  xcp_spin_lock(&chan->spinlock);
+  const size_t received = xcp_co_chan_pop(chan, elems, count, &toWake);
+  if (received || chan->closed || !block) {
+    const bool closed = chan->closed;
+    xcp_spin_unlock(&chan->spinlock);
+    xcp_co_chan_wake_waiters(toWake);
+    if (!received) {
+      errno = closed ? EPIPE : EAGAIN;
+      return XCP_ERR_ERRNO;
+    }
+    return (XcpError)received;
+  }
+
+  XcpCoChanWaiter waiter = { .elems = elems, .count = count };
+  xcp_co_chan_wait(chan, &chan->receivers, &waiter, toWake);
+
+  if (!waiter.done) {
+    errno = EPIPE;
+    return XCP_ERR_ERRNO;
+  }
+  return (XcpError)waiter.done;
+}
+
+// -----------------------------------------------------------------------------
+
+XcpCoChan *xcp_co_chan_create (size_t elemSize, size_t capacity) {
+  if (!elemSize) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  XcpCoChan *chan = malloc(sizeof *chan + elemSize * capacity);
+  if (!chan)
+    return NULL;
+
+  chan->spinlock = 0;
+  chan->closed = false;
+  chan->elemSize = elemSize;
+  chan->capacity = capacity;
+  chan->head = 0;
+  chan->size = 0;
+  TAILQ_INIT(&chan->senders);
+  TAILQ_INIT(&chan->receivers);
+
+  return chan;
+}
+
+void xcp_co_chan_destroy (XcpCoChan *chan) {
+  assert(TAILQ_EMPTY(&chan->senders) && TAILQ_EMPTY(&chan->receivers));
+  free(chan);
+}
+
+void xcp_co_chan_close (XcpCoChan *chan) {
+  XcpCoChanWaiter *toWake = NULL;
+
+  xcp_spin_lock(&chan->spinlock);
+  chan->closed = true;
+
+  XcpCoChanWaitList *lists[] = { &chan->senders, &chan->receivers };
+  for (size_t i = 0; i < XCP_ARRAY_LEN(lists); ++i) {
+    XcpCoChanWaiter *waiter;
+    while ((waiter = xcp_co_chan_first_waiter(lists[i]))) {
+      waiter->closed = true;
+      xcp_co_chan_remove_waiter(lists[i], waiter, &toWake);
+    }
+  }
+  xcp_spin_unlock(&chan->spinlock);
+
+  xcp_co_chan_wake_waiters(toWake);
+}
+
+XcpError xcp_co_chan_send (XcpCoChan *chan, const void *elem) {
+  const XcpError ret = xcp_co_chan_send_impl(chan, elem, 1, true);
+  return ret < 0 ? ret : XCP_ERR_OK;
+}
+
+XcpError xcp_co_chan_recv (XcpCoChan *chan, void *elem) {
+  const XcpError ret = xcp_co_chan_recv_impl(chan, elem, 1, true);
+  return ret < 0 ? ret : XCP_ERR_OK;
+}
+
+XcpError xcp_co_chan_try_send (XcpCoChan *chan, const void *elem) {
+  const XcpError ret = xcp_co_chan_send_impl(chan, elem, 1, false);
+  return ret < 0 ? ret : XCP_ERR_OK;
+}
+
+XcpError xcp_co_chan_try_recv (XcpCoChan *chan, void *elem) {
+  const XcpError ret = xcp_co_chan_recv_impl(chan, elem, 1, false);
+  return ret < 0 ? ret : XCP_ERR_OK;
+}
+
+XcpError xcp_co_chan_send_batch (XcpCoChan *chan, const void *elems, size_t count) {
+  if (!count)
+    return 0;
+  return xcp_co_chan_send_impl(chan, elems, count, true);
+}
+
+XcpError xcp_co_chan_recv_batch (XcpCoChan *chan, void *elems, size_t count) {
+  if (!count)
+    return 0;
+  return xcp_co_chan_recv_impl(chan, elems, count, true);
+}
+
+// -----------------------------------------------------------------------------
+// Select.
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  XcpCoChan **chans;
+  size_t count;
+} XcpCoChanSet;
+
+// Lock the channels in address order to avoid deadlocks between concurrent selects.
+static size_t xcp_co_chan_lock_all (const XcpCoChanOp *ops, size_t count, XcpCoChan **chans) {
+  size_t chanCount = 0;
+  for (size_t i = 0; i < count; ++i) {
+    XcpCoChan *chan = ops[i].chan;
+
+    size_t j = chanCount;
+    while (j > 0 && chans[j - 1] > chan)
+      --j;
+    if (j > 0 && chans[j - 1] == chan)
+      continue;
+
+    memmove(chans + j + 1, chans + j, (chanCount - j) * sizeof *chans);
+    chans[j] = chan;
+    ++chanCount;
+  }
+
+  for (size_t i = 0; i < chanCount; ++i)
+    xcp_spin_lock(&chans[i]->spinlock);
+  return chanCount;
+}
+
+static void xcp_co_chan_unlock_all (XcpCoChan **chans, size_t count) {
+  // Read each channel before the previous unlock: the selecting coroutine can be resumed
+  // as soon as one channel is released, but cannot return before all are released.
+  for (size_t i = count; i > 0; --i)
+    xcp_spin_unlock(&chans[i - 1]->spinlock);
+}
+
+static void xcp_co_chan_select_park_cb (void *userData) {
+  const XcpCoChanSet set = *(XcpCoChanSet *)userData;
+  xcp_co_chan_unlock_all(set.chans, set.count);
+}
+
+static XcpError xcp_co_chan_select_impl (XcpCoChanOp *ops, size_t count, bool block) {
+  if (!count || count > XCP_CO_CHAN_SELECT_MAX) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  XcpCoChan *chans[XCP_CO_CHAN_SELECT_MAX];
+  const size_t chanCount = xcp_co_chan_lock_all(ops, count, chans);
+
+  // 1. Execute the first ready operation.
+  XcpCoChanWaiter *toWake = NULL;
+  for (size_t i = 0; i < count; ++i) {
+    XcpCoChanOp *op = &ops[i];
+    XcpCoChan *chan = op->chan;
+    op->closed = false;
+
+    bool done;
+    if (op->type == XcpCoChanOpSend)
+      done = (op->closed = chan->closed) || xcp_co_chan_push(chan, op->elem, 1, &toWake);
+    else
+      done = xcp_co_chan_pop(chan, op->elem, 1, &toWake) || (op->closed = chan->closed);
+
+    if (done) {
+      xcp_co_chan_unlock_all(chans, chanCount);
+      xcp_co_chan_wake_waiters(toWake);
+      return (XcpError)i;
+    }
+  }
+
+  if (!block) {
+    xcp_co_chan_unlock_all(chans, chanCount);
+    errno = EAGAIN;
+    return XCP_ERR_ERRNO;
+  }
+
+  // 2. Wait on all channels, the first served waiter wins.
+  assert(xcp_coroutine_in_coroutine());
+
+  XcpCoroutine *self = xcp_coroutine_get_self();
+  XcpCoChanWaiter waiters[XCP_CO_CHAN_SELECT_MAX];
+  int selected = -1;
+  for (size_t i = 0; i < count; ++i) {
+    XcpCoChanWaiter *waiter = &waiters[i];
+    *waiter = (XcpCoChanWaiter){
+      .coroutine = self,
+      .elems = ops[i].elem,
+      .count = 1,
+      .queued = true,
+      .selected = &selected,
+      .index = (int)i
+    };
+
+    XcpCoChan *chan = ops[i].chan;
+    TAILQ_INSERT_TAIL(ops[i].type == XcpCoChanOpSend ? &chan->senders : &chan->receivers, waiter, next);
+  }
+
+  XcpCoChanSet set = { chans, chanCount };
+  xcp_coroutine_park(xcp_co_chan_select_park_cb, &set);
+
+  // 3. Remove the remaining waiters.
+  xcp_co_chan_lock_all(ops, count, chans);
+  for (size_t i = 0; i < count; ++i) {
+    XcpCoChanWaiter *waiter = &waiters[i];
+    if (waiter->queued) {
+      XcpCoChan *chan = ops[i].chan;
+      TAILQ_REMOVE(ops[i].type == XcpCoChanOpSend ? &chan->senders : &chan->receivers, waiter, next);
+    }
+  }
+  xcp_co_chan_unlock_all(chans, chanCount);
+
+  const int index = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+  ops[index].closed = waiters[index].closed;
+  return index;
+}
+
+XcpError xcp_co_chan_select (XcpCoChanOp *ops, size_t count) {
+  return xcp_co_chan_select_impl(ops, count, true);
+}
+
+XcpError xcp_co_chan_try_select (XcpCoChanOp *ops, size_t count) {
+  return xcp_co_chan_select_impl(ops, count, false);
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "coroutine/coroutine-private.h"
+#include "coroutine/spinlock.h"
+#include "xcp-ng/generic/coroutine-future.h"
+
+// =============================================================================
+
+// Waiters registered on the stack of xcp_future_when_any without allocation.
+#define XCP_FUTURE_WAITER_STACK_COUNT 16
+
+typedef enum {
+  XcpFutureWaitRegistering = 0,
+  XcpFutureWaitParked = 1,
+  XcpFutureWaitSignaled = 2
+} XcpFutureWaitState;
+
+// State shared by the waiters of one xcp_future_when_any call.
+// The first ready future claims `index`, then the coroutine is woken by the party which
+// observes the other one: the signaler if the coroutine is parked, the park callback
+// if the coroutine was signaled during the registration.
+typedef struct {
+  XcpCoroutine *coroutine;
+  int state;
+  int index;
+} XcpFutureWait;
+
+typedef struct XcpFutureWaiter {
+  XcpFutureWait *wait;
+  int index;
+  bool queued;
+  TAILQ_ENTRY(XcpFutureWaiter) next;
+} XcpFutureWaiter;
+
+struct XcpFuture {
+  int spinlock;
+  bool ready;
+  int refCount;
+
+  void *value;
+
+  // Only used by spawned coroutines.
+  XcpFutureCb cb;
+  void *userData;
+
+  TAILQ_HEAD( , XcpFutureWaiter) waiters;
+};
+
+// -----------------------------------------------------------------------------
+
+static XcpFuture *xcp_future_alloc (int refCount) {
+  XcpFuture *future = malloc(sizeof *future);
+  if (!future)
+    return NULL;
+
+  future->spinlock = 0;
+  future->ready = false;
+  future->refCount = refCount;
+  future->value = NULL;
+  future->cb = NULL;
+  future->userData = NULL;
+  TAILQ_INIT(&future->waiters);
+
+  return future;
+}
+
+static void xcp_future_unref (XcpFuture *future) {
+  if (__atomic_sub_fetch(&future->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+    assert(TAILQ_EMPTY(&future->waiters));
+    free(future);
+  }
+}
+
+static void xcp_future_wait_park_cb (void *userData) {
+  XcpFutureWait *wait = userData;
+
+  // The wait structure can be released as soon as the state is modified.
+  XcpCoroutine *coroutine = wait->coroutine;
+  if (__atomic_exchange_n(&wait->state, XcpFutureWaitParked, __ATOMIC_ACQ_REL) == XcpFutureWaitSignaled)
+    xcp_coroutine_wake(coroutine);
+}
+
+// -----------------------------------------------------------------------------
+
+XcpFuture *xcp_future_create () {
+  return xcp_future_alloc(1);
+}
+
+void xcp_future_destroy (XcpFuture *future) {
+  if (future)
+    xcp_future_unref(future);
+}
+
+void xcp_future_set (XcpFuture *future, void *value) {
+  STAILQ_HEAD( , XcpCoroutine) coroutines = STAILQ_HEAD_INITIALIZER(coroutines);
+
+  xcp_spin_lock(&future->spinlock);
+  assert(!future->ready);
+  future->value = value;
+  __atomic_store_n(&future->ready, true, __ATOMIC_RELEASE);
+
+  XcpFutureWaiter *waiter;
+  while ((waiter = TAILQ_FIRST(&future->waiters))) {
+    TAILQ_REMOVE(&future->waiters, waiter, next);
+    waiter->queued = false;
+
+    // Already claimed by another future.
+    XcpFutureWait *wait = waiter->wait;
+    int expected = -1;
+    if (!__atomic_compare_exchange_n(
+      &wait->index, &expected, waiter->index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+    ))
+      continue;
+
+    XcpCoroutine *coroutine = wait->coroutine;
+    if (__atomic_exchange_n(&wait->state, XcpFutureWaitSignaled, __ATOMIC_ACQ_REL) == XcpFutureWaitParked)
+      STAILQ_INSERT_TAIL(&coroutines, coroutine, next);
+  }
+  xcp_spin_unlock(&future->spinlock);
+
+  XcpCoroutine *coroutine;
+  while ((coroutine = STAILQ_FIRST(&coroutines))) {
+    STAILQ_REMOVE_HEAD(&coroutines, next);
+    xcp_coroutine_wake(coroutine);
+  }
+}
+
+bool xcp_future_is_ready (const XcpFuture *future) {
+  return __atomic_load_n(&future->ready, __ATOMIC_ACQUIRE);
+}
+
+void *xcp_future_get (XcpFuture *future) {
+  if (!xcp_future_is_ready(future)) {
+    const XcpError ret = xcp_future_when_any(&future, 1);
+    assert(ret == 0);
+    XCP_UNUSED(ret);
+  }
+  return future->value;
+}
+
+void xcp_future_when_all (XcpFuture *const *futures, size_t count) {
+  for (size_t i = 0; i < count; ++i)
+    xcp_future_get(futures[i]);
+}
+
+XcpError xcp_future_when_any (XcpFuture *const *futures, size_t count) {
+  if (!count || count > INT_MAX) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  for (size_t i = 0; i < count; ++i)
+    if (xcp_future_is_ready(futures[i]))
+      return (XcpError)i;
+
+  assert(xcp_coroutine_in_coroutine());
+
+  XcpFutureWaiter stackWaiters[XCP_FUTURE_WAITER_STACK_COUNT];
+  XcpFutureWaiter *waiters = stackWaiters;
+  if (count > XCP_FUTURE_WAITER_STACK_COUNT && !(waiters = malloc(count * sizeof *waiters)))
+    return XCP_ERR_ERRNO;
+
+  XcpFutureWait wait = { xcp_coroutine_get_self(), XcpFutureWaitRegistering, -1 };
+
+  // Register a waiter on each future until one is ready.
+  bool park = true;
+  size_t registered = 0;
+  for (; registered < count; ++registered) {
+    XcpFuture *future = futures[registered];
+    XcpFutureWaiter *waiter = &waiters[registered];
+    waiter->wait = &wait;
+    waiter->index = (int)registered;
+
+    xcp_spin_lock(&future->spinlock);
+    waiter->queued = !future->ready;
+    if (waiter->queued)
+      TAILQ_INSERT_TAIL(&future->waiters, waiter, next);
+    xcp_spin_unlock(&future->spinlock);
+
+    if (!waiter->queued) {
+      // If another future has claimed the wait, its signal must be consumed by parking.
+      int expected = -1;
+      park = !__atomic_compare_exchange_n(
+        &wait.index, &expected, waiter->index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+      );
+      break;
+    }
+  }
+
+  if (park)
+    xcp_coroutine_park(xcp_future_wait_park_cb, &wait);
+
+  for (size_t i = 0; i < registered; ++i) {
+    XcpFuture *future = futures[i];
+    XcpFutureWaiter *waiter = &waiters[i];
+    xcp_spin_lock(&future->spinlock);
+    if (waiter->queued)
+      TAILQ_REMOVE(&future->waiters, waiter, next);
+    xcp_spin_unlock(&future->spinlock);
+  }
+
+  if (waiters != stackWaiters)
+    free(waiters);
+
+  return __atomic_load_n(&wait.index, __ATOMIC_ACQUIRE);
+}
+
+// -----------------------------------------------------------------------------
+// Join handles.
+// -----------------------------------------------------------------------------
+
+static void xcp_future_coroutine_cb (void *userData) {
+  XcpFuture *future = userData;
+  xcp_future_set(future, (*future->cb)(future->userData));
+  xcp_future_unref(future);
+}
+
+XcpFuture *xcp_coroutine_spawn (XcpFutureCb cb, void *userData) {
+  return xcp_coroutine_spawn_ex(cb, userData, NULL);
+}
+
+XcpFuture *xcp_coroutine_spawn_ex (XcpFutureCb cb, void *userData, const XcpCoroutineAttr *attr) {
+  // One reference for the caller, one for the coroutine.
+  XcpFuture *future = xcp_future_alloc(2);
+  if (!future)
+    return NULL;
+
+  future->cb = cb;
+  future->userData = userData;
+
+  XcpCoroutine *coroutine = xcp_coroutine_create_ex(xcp_future_coroutine_cb, future, attr);
+  if (!coroutine) {
+    free(future);
+    return NULL;
+  }
+
+  xcp_coroutine_process(coroutine);
+  return future;
+}
+
+void *xcp_coroutine_join (XcpFuture *future) {
+  void *value = xcp_future_get(future);
+  xcp_future_unref(future);
+  return value;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_COROUTINE_PRIVATE_H_
+#define _XCP_NG_COROUTINE_PRIVATE_H_
+
+#include <sys/queue.h>
+#include <time.h>
+
+#include "config.h"
+#include "coroutine/context.h"
+#include "xcp-ng/generic/cancel.h"
+#include "xcp-ng/generic/coroutine.h"
+
+// =============================================================================
+
+typedef struct XcpScheduler XcpScheduler;
+
+typedef enum {
+  XcpCoroutineStatusRunning = 1,
+  XcpCoroutineStatusSuspend = 2,
+  XcpCoroutineStatusTerminated = 3
+} XcpCoroutineStatus;
+
+struct XcpCoroutine {
+  XcpCoroutine *caller;
+  XcpCoroutineContext context;
+
+  void *stack;
+  size_t stackSize;
+  bool guard;
+  bool userStack;
+
+  // Frame of the terminated coroutine, the stack under this address can be discarded.
+  void *idleFrame;
+
+  XcpCoroutineCb cb;
+
+  void *arg;
+
+  // Executed by the resumer once the coroutine is parked.
+  XcpCoroutineParkCb parkCb;
+  void *parkArg;
+
+  // Owner scheduler, NULL if the coroutine is only executed by the current thread.
+  XcpScheduler *scheduler;
+  int pinnedWorker;
+
+  // Thread of an unscheduled coroutine, set when it is resumed. NULL if never executed.
+  struct XcpCoroutineThreadData *thread;
+  bool parked;
+
+  // Local storage, a slot is valid only if its bit is set in `localMask`.
+  uint localMask;
+  void *locals[XCP_COROUTINE_KEYS_MAX];
+
+  // Cancellation token of the blocking helpers, see cancel.h.
+  XcpCancel *cancel;
+
+  #ifdef HAVE_VALGRIND
+    uint valgrindStackId;
+  #endif // ifdef HAVE_VALGRIND
+
+  #ifdef HAVE_COROUTINE_STATS
+    XcpCoroutineStats stats;
+
+    // Time of the last insertion in a pending list/run queue, 0 if resumed directly.
+    ulonglong readyTime;
+  #endif // ifdef HAVE_COROUTINE_STATS
+
+  STAILQ_ENTRY(XcpCoroutine) next;
+  STAILQ_HEAD( , XcpCoroutine) pendings;
+};
+
+// -----------------------------------------------------------------------------
+// Stats.
+// -----------------------------------------------------------------------------
+
+#ifdef HAVE_COROUTINE_STATS
+  static inline ulonglong xcp_coroutine_stats_now () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ulonglong)ts.tv_sec * 1000000000ULL + (ulonglong)ts.tv_nsec;
+  }
+#endif // ifdef HAVE_COROUTINE_STATS
+
+// Called when a coroutine becomes runnable without being resumed directly.
+static inline void xcp_coroutine_stats_set_ready (XcpCoroutine *coroutine) {
+  #ifdef HAVE_COROUTINE_STATS
+    coroutine->readyTime = xcp_coroutine_stats_now();
+  #else
+    XCP_UNUSED(coroutine);
+  #endif // ifdef HAVE_COROUTINE_STATS
+}
+
+// -----------------------------------------------------------------------------
+// Remote wakes.
+// -----------------------------------------------------------------------------
+
+// An unscheduled coroutine woken by another thread is added to the wake queue of its own
+// thread. This queue is drained by the reactor which polls the returned eventfd.
+int xcp_coroutine_wake_queue_open ();
+
+void xcp_coroutine_wake_queue_close ();
+
+// Resume the coroutines of the wake queue of the current thread. Return their count.
+size_t xcp_coroutine_wake_queue_drain ();
+
+// Add a parked coroutine of the current thread to its wake queue: it is resumed by the next
+// drain, after the coroutines which are already ready.
+void xcp_coroutine_wake_later (XcpCoroutine *coroutine);
+
+// Count of unscheduled coroutines of the current thread which are parked.
+size_t xcp_coroutine_get_parked_count ();
+
+// -----------------------------------------------------------------------------
+// Scheduler hooks.
+// -----------------------------------------------------------------------------
+
+// Register a new coroutine in the scheduler.
+void xcp_scheduler_attach (XcpScheduler *scheduler, XcpCoroutine *coroutine);
+
+// Add a runnable coroutine in a run queue.
+void xcp_scheduler_enqueue (XcpScheduler *scheduler, XcpCoroutine *coroutine);
+
+// Called when a coroutine of the scheduler is terminated.
+void xcp_scheduler_detach (XcpScheduler *scheduler);
+
+#endif // _XCP_NG_COROUTINE_PRIVATE_H_ included
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+
+#include "coroutine/coroutine-private.h"
+#include "coroutine/spinlock.h"
+#include "xcp-ng/generic/coroutine-sync.h"
+
+// =============================================================================
+
+static void xcp_spin_unlock_cb (void *userData) {
+  xcp_spin_unlock(userData);
+}
+
+// Add the current coroutine in a wait list and park it. `spinlock` must be locked,
+// it is released once the coroutine is suspended.
+static inline void xcp_co_wait (XcpCoWaitList *waiters, int *spinlock) {
+  assert(xcp_coroutine_in_coroutine());
+  STAILQ_INSERT_TAIL(waiters, xcp_coroutine_get_self(), next);
+  xcp_coroutine_park(xcp_spin_unlock_cb, spinlock);
+}
+
+static inline XcpCoroutine *xcp_co_pop_waiter (XcpCoWaitList *waiters) {
+  XcpCoroutine *coroutine = STAILQ_FIRST(waiters);
+  if (coroutine)
+    STAILQ_REMOVE_HEAD(waiters, next);
+  return coroutine;
+}
+
+static inline void xcp_co_wake_all (XcpCoWaitList *waiters) {
+  XcpCoroutine *coroutine;
+  while ((coroutine = STAILQ_FIRST(waiters))) {
+    STAILQ_REMOVE_HEAD(waiters, next);
+    xcp_coroutine_wake(coroutine);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// Mutex.
+// -----------------------------------------------------------------------------
+
+void xcp_co_mutex_init (XcpCoMutex *mutex) {
+  mutex->spinlock = 0;
+  mutex->locked = false;
+  STAILQ_INIT(&mutex->waiters);
+}
+
+void xcp_co_mutex_lock (XcpCoMutex *mutex) {
+  xcp_spin_lock(&mutex->spinlock);
+  if (!mutex->locked) {
+    mutex->locked = true;
+    xcp_spin_unlock(&mutex->spinlock);
+    return;
+  }
+
+  // The ownership is transferred by xcp_co_mutex_unlock.
+  xcp_co_wait(&mutex->waiters, &mutex->spinlock);
+}
+
+bool xcp_co_mutex_try_lock (XcpCoMutex *mutex) {
+  xcp_spin_lock(&mutex->spinlock);
+  const bool locked = !mutex->locked;
+  mutex->locked = true;
+  xcp_spin_unlock(&mutex->spinlock);
+  return locked;
+}
+
+void xcp_co_mutex_unlock (XcpCoMutex *mutex) {
+  xcp_spin_lock(&mutex->spinlock);
+  assert(mutex->locked);
+  XcpCoroutine *coroutine = xcp_co_pop_waiter(&mutex->waiters);
+  if (!coroutine)
+    mutex->locked = false;
+  xcp_spin_unlock(&mutex->spinlock);
+
+  if (coroutine)
+    xcp_coroutine_wake(coroutine);
+}
+
+// -----------------------------------------------------------------------------
+// Condition variable.
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  int *spinlock;
+  XcpCoMutex *mutex;
+} XcpCoCondWait;
+
+static void xcp_co_cond_wait_cb (void *userData) {
+  // Copy the data: the waiter can be resumed as soon as the spinlock is released.
+  const XcpCoCondWait wait = *(XcpCoCondWait *)userData;
+
+  // The cond spinlock must be released first: unlocking the mutex can execute
+  // a coroutine which signals the condition.
+  xcp_spin_unlock(wait.spinlock);
+  xcp_co_mutex_unlock(wait.mutex);
+}
+
+void xcp_co_cond_init (XcpCoCond *cond) {
+  cond->spinlock = 0;
+  STAILQ_INIT(&cond->waiters);
+}
+
+void xcp_co_cond_wait (XcpCoCond *cond, XcpCoMutex *mutex) {
+  assert(xcp_coroutine_in_coroutine());
+
+  XcpCoCondWait wait = { &cond->spinlock, mutex };
+  xcp_spin_lock(&cond->spinlock);
+  STAILQ_INSERT_TAIL(&cond->waiters, xcp_coroutine_get_self(), next);
+  xcp_coroutine_park(xcp_co_cond_wait_cb, &wait);
+
+  xcp_co_mutex_lock(mutex);
+}
+
+void xcp_co_cond_signal (XcpCoCond *cond) {
+  xcp_spin_lock(&cond->spinlock);
+  XcpCoroutine *coroutine = xcp_co_pop_waiter(&cond->waiters);
+  xcp_spin_unlock(&cond->spinlock);
+
+  if (coroutine)
+    xcp_coroutine_wake(coroutine);
+}
+
+void xcp_co_cond_broadcast (XcpCoCond *cond) {
+  XcpCoWaitList waiters;
+  xcp_spin_lock(&cond->spinlock);
+  STAILQ_INIT(&waiters);
+  STAILQ_CONCAT(&waiters, &cond->waiters);
+  xcp_spin_unlock(&cond->spinlock);
+
+  xcp_co_wake_all(&waiters);
+}
+
+// -----------------------------------------------------------------------------
+// Semaphore.
+// -----------------------------------------------------------------------------
+
+void xcp_co_semaphore_init (XcpCoSemaphore *semaphore, size_t value) {
+  semaphore->spinlock = 0;
+  semaphore->value = value;
+  STAILQ_INIT(&semaphore->waiters);
+}
+
+void xcp_co_semaphore_acquire (XcpCoSemaphore *semaphore) {
+  xcp_spin_lock(&semaphore->spinlock);
+  if (semaphore->value) {
+    --semaphore->value;
+    xcp_spin_unlock(&semaphore->spinlock);
+    return;
+  }
+
+  // The unit is directly given by xcp_co_semaphore_release.
+  xcp_co_wait(&semaphore->waiters, &semaphore->spinlock);
+}
+
+bool xcp_co_semaphore_try_acquire (XcpCoSemaphore *semaphore) {
+  xcp_spin_lock(&semaphore->spinlock);
+  const bool acquired = semaphore->value > 0;
+  if (acquired)
+    --semaphore->value;
+  xcp_spin_unlock(&semaphore->spinlock);
+  return acquired;
+}
+
+void xcp_co_semaphore_release (XcpCoSemaphore *semaphore) {
+  xcp_spin_lock(&semaphore->spinlock);
+  XcpCoroutine *coroutine = xcp_co_pop_waiter(&semaphore->waiters);
+  if (!coroutine)
+    ++semaphore->value;
+  xcp_spin_unlock(&semaphore->spinlock);
+
+  if (coroutine)
+    xcp_coroutine_wake(coroutine);
+}
+
+// -----------------------------------------------------------------------------
+// Wait group.
+// -----------------------------------------------------------------------------
+
+void xcp_co_wait_group_init (XcpCoWaitGroup *waitGroup) {
+  waitGroup->spinlock = 0;
+  waitGroup->counter = 0;
+  STAILQ_INIT(&waitGroup->waiters);
+}
+
+void xcp_co_wait_group_add (XcpCoWaitGroup *waitGroup, size_t count) {
+  xcp_spin_lock(&waitGroup->spinlock);
+  waitGroup->counter += count;
+  xcp_spin_unlock(&waitGroup->spinlock);
+}
+
+void xcp_co_wait_group_done (XcpCoWaitGroup *waitGroup) {
+  XcpCoWaitList waiters;
+  STAILQ_INIT(&waiters);
+
+  xcp_spin_lock(&waitGroup->spinlock);
+  assert(waitGroup->counter > 0);
+  if (!--waitGroup->counter)
+    STAILQ_CONCAT(&waiters, &waitGroup->waiters);
+  xcp_spin_unlock(&waitGroup->spinlock);
+
+  xcp_co_wake_all(&waiters);
+}
+
+void xcp_co_wait_group_wait (XcpCoWaitGroup *waitGroup) {
+  xcp_spin_lock(&waitGroup->spinlock);
+  if (!waitGroup->counter) {
+    xcp_spin_unlock(&waitGroup->spinlock);
+    return;
+  }
+
+  xcp_co_wait(&waitGroup->waiters, &waitGroup->spinlock);
+}
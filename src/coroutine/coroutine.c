@@ -0,0 +1,879 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_VALGRIND
+  #include <valgrind/valgrind.h>
+#endif // ifdef HAVE_VALGRIND
+
+#include "coroutine/coroutine-private.h"
+#include "coroutine/spinlock.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+
+// =============================================================================
+
+static size_t xcp_coroutine_page_size () {
+  static size_t pageSize;
+  if (XCP_UNLIKELY(!pageSize))
+    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+// Mapping: [guardpage (optional)][stack]. Pages are only committed when touched.
+static void *xcp_coroutine_create_stack (size_t stackSize, bool guard) {
+  const size_t guardSize = guard ? xcp_coroutine_page_size() : 0;
+
+  void *mapping = mmap(
+    NULL, stackSize + guardSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+  );
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  // See: https://devarea.com/using-mprotect-system-call-to-debug-memory-problems/
+  // And: https://rethinkdb.com/blog/handling-stack-overflow-on-custom-stacks/
+  if (guard && mprotect(mapping, guardSize, PROT_NONE)) {
+    munmap(mapping, stackSize + guardSize);
+    return NULL;
+  }
+
+  return (char *)mapping + guardSize;
+}
+
+static void xcp_coroutine_destroy_stack (void *stack, size_t stackSize, bool guard) {
+  const size_t guardSize = guard ? xcp_coroutine_page_size() : 0;
+  munmap((char *)stack - guardSize, stackSize + guardSize);
+}
+
+// ---------------------------------------------------------------------------
+
+// Free list of terminated coroutines sharing the same stack attributes.
+typedef struct XcpCoroutinePool {
+  size_t stackSize;
+  bool guard;
+
+  STAILQ_HEAD( , XcpCoroutine) coroutines;
+  size_t size;
+
+  SLIST_ENTRY(XcpCoroutinePool) next;
+} XcpCoroutinePool;
+
+typedef struct XcpCoroutineThreadData {
+  XcpCoroutine *current;
+
+  XcpCoroutine dummy;
+
+  // Coroutines of this thread woken by other threads, protected by `wakeLock`.
+  int wakeLock;
+  STAILQ_HEAD( , XcpCoroutine) wakes;
+  int wakeFd;
+  size_t parkedCount;
+
+  XcpCoroutinePool defaultPool;
+  SLIST_HEAD( , XcpCoroutinePool) pools;
+  size_t poolLowWatermark;
+  size_t poolHighWatermark;
+  bool poolDiscardStacks;
+  bool poolRegistered;
+
+  #ifdef HAVE_COROUTINE_STATS
+    XcpCoroutineThreadStats stats;
+  #endif // ifdef HAVE_COROUTINE_STATS
+} XcpCoroutineThreadData;
+
+// Scheduled coroutines can migrate between threads: never inline this function to
+// prevent the compiler from caching the TLS address across a context switch.
+static __attribute__((noinline)) XcpCoroutineThreadData *xcp_coroutine_get_thread_data () {
+  static __thread XcpCoroutineThreadData threadData;
+  if (!threadData.current) {
+    threadData.current = &threadData.dummy;
+
+    STAILQ_INIT(&threadData.wakes);
+    threadData.wakeFd = -1;
+
+    XcpCoroutinePool *pool = &threadData.defaultPool;
+    pool->stackSize = XCP_ROUND_UP_2(XCP_COROUTINE_STACK_SIZE, xcp_coroutine_page_size());
+    pool->guard = true;
+    STAILQ_INIT(&pool->coroutines);
+
+    SLIST_INIT(&threadData.pools);
+    SLIST_INSERT_HEAD(&threadData.pools, pool, next);
+    threadData.poolLowWatermark = XCP_COROUTINE_POOL_LOW_WATERMARK;
+    threadData.poolHighWatermark = XCP_COROUTINE_POOL_HIGH_WATERMARK;
+  }
+  return &threadData;
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef HAVE_COROUTINE_STATS
+  // Fresh stack pages are zero-filled by the kernel: the peak is given by the lowest
+  // resident page (mincore) and the first non-zero word of this page. Untouched pages
+  // are never committed by the scan. Pooled stacks are cleared at termination and
+  // discarded at release.
+  static size_t xcp_coroutine_get_stack_peak (const XcpCoroutine *coroutine) {
+    if (coroutine->userStack)
+      return 0;
+
+    const size_t pageSize = xcp_coroutine_page_size();
+    const size_t pageCount = coroutine->stackSize / pageSize;
+    char *stack = coroutine->stack;
+
+    unsigned char residency[256];
+    for (size_t first = 0; first < pageCount; first += sizeof residency) {
+      const size_t count = XCP_MIN(pageCount - first, sizeof residency);
+      if (mincore(stack + first * pageSize, count * pageSize, residency) < 0)
+        return 0;
+
+      for (size_t i = 0; i < count; ++i) {
+        if (!(residency[i] & 1))
+          continue;
+
+        const uintptr_t *word = (const uintptr_t *)(void *)(stack + (first + i) * pageSize);
+        const uintptr_t *end = (const uintptr_t *)(void *)(stack + coroutine->stackSize);
+        while (word < end && !*word)
+          ++word;
+        return (size_t)(stack + coroutine->stackSize - (const char *)word);
+      }
+    }
+
+    return 0;
+  }
+
+  static inline void xcp_coroutine_stats_on_resume (
+    XcpCoroutineThreadData *threadData,
+    XcpCoroutine *coroutine,
+    ulonglong now
+  ) {
+    XcpCoroutineThreadStats *threadStats = &threadData->stats;
+    ++coroutine->stats.resumeCount;
+    ++threadStats->resumeCount;
+
+    if (coroutine->readyTime) {
+      const ulonglong pendingTime = now > coroutine->readyTime ? now - coroutine->readyTime : 0;
+      coroutine->readyTime = 0;
+      coroutine->stats.pendingTime += pendingTime;
+      threadStats->pendingTime += pendingTime;
+      threadStats->pendingTimeMax = XCP_MAX(threadStats->pendingTimeMax, pendingTime);
+    }
+  }
+
+  static inline void xcp_coroutine_stats_on_return (
+    XcpCoroutineThreadData *threadData,
+    const XcpCoroutine *caller,
+    XcpCoroutine *coroutine,
+    ulonglong start
+  ) {
+    const ulonglong now = xcp_coroutine_stats_now();
+    const ulonglong runTime = now > start ? now - start : 0;
+    coroutine->stats.runTime += runTime;
+    coroutine->stats.runTimeMax = XCP_MAX(coroutine->stats.runTimeMax, runTime);
+
+    // Nested coroutines are already counted in the time of their caller.
+    if (caller == &threadData->dummy) {
+      XcpCoroutineThreadStats *threadStats = &threadData->stats;
+      threadStats->runTime += runTime;
+      threadStats->runTimeMax = XCP_MAX(threadStats->runTimeMax, runTime);
+    }
+  }
+
+  static void xcp_coroutine_stats_on_terminate (XcpCoroutineThreadData *threadData, const XcpCoroutine *coroutine) {
+    XcpCoroutineThreadStats *threadStats = &threadData->stats;
+    ++threadStats->terminateCount;
+
+    const size_t stackPeak = xcp_coroutine_get_stack_peak(coroutine);
+    if (!stackPeak)
+      return;
+
+    threadStats->stackPeakMax = XCP_MAX(threadStats->stackPeakMax, stackPeak);
+
+    size_t bucket = 0;
+    for (size_t limit = 4096; bucket < XCP_COROUTINE_STATS_STACK_BUCKET_COUNT - 1 && stackPeak >= limit; limit <<= 1)
+      ++bucket;
+    ++threadStats->stackPeakHistogram[bucket];
+  }
+#endif // ifdef HAVE_COROUTINE_STATS
+
+// -----------------------------------------------------------------------------
+
+// The pages under this address can be discarded when the coroutine is terminated: the top
+// of the stack contains its suspended execution context.
+static inline uintptr_t xcp_coroutine_get_discard_end (const XcpCoroutine *coroutine) {
+  const size_t pageSize = xcp_coroutine_page_size();
+  return XCP_ROUND_DOWN_2((uintptr_t)coroutine->idleFrame, pageSize) - pageSize;
+}
+
+#ifdef HAVE_COROUTINE_STATS
+  // Executed by a terminated coroutine on its own stack: zero the part which is not discarded
+  // at release (see xcp_coroutine_release) under the current frame. Keep a margin for the
+  // locals and the red zone.
+  static __attribute__((noinline)) void xcp_coroutine_clear_stack (const XcpCoroutine *coroutine) {
+    if (coroutine->userStack)
+      return;
+
+    const uintptr_t begin = XCP_MAX(xcp_coroutine_get_discard_end(coroutine), (uintptr_t)coroutine->stack);
+    const uintptr_t end = (uintptr_t)__builtin_frame_address(0) - 256;
+    for (volatile uintptr_t *word = (uintptr_t *)begin; (uintptr_t)word < end; ++word)
+      *word = 0;
+  }
+#endif // ifdef HAVE_COROUTINE_STATS
+
+// -----------------------------------------------------------------------------
+
+// Keys of the local storage: a key is allocated if its bit is set in `KeyMask`.
+static uint KeyMask;
+static XcpCoroutineKeyDestructor KeyDestructors[XCP_COROUTINE_KEYS_MAX];
+
+static void xcp_coroutine_destroy_locals (XcpCoroutine *coroutine) {
+  // A destructor can set new values, retry a limited count of times like pthread.
+  for (int i = 0; coroutine->localMask && i < XCP_COROUTINE_KEY_DESTRUCTOR_ITERATIONS; ++i) {
+    uint mask = coroutine->localMask;
+    coroutine->localMask = 0;
+    while (mask) {
+      const int key = __builtin_ctz(mask);
+      mask &= mask - 1;
+
+      void *value = coroutine->locals[key];
+      const XcpCoroutineKeyDestructor destructor = __atomic_load_n(&KeyDestructors[key], __ATOMIC_ACQUIRE);
+      if (value && destructor)
+        (*destructor)(value);
+    }
+  }
+  coroutine->localMask = 0;
+}
+
+// -----------------------------------------------------------------------------
+
+static int xcp_coroutine_exec (
+  XcpCoroutineThreadData *threadData,
+  XcpCoroutine *caller,
+  XcpCoroutine *callee,
+  XcpCoroutineStatus status
+) {
+  threadData->current = callee;
+
+  return xcp_coroutine_context_switch(&caller->context, &callee->context, status);
+}
+
+static void xcp_coroutine_run (void *arg) {
+  XcpCoroutine *coroutine = arg;
+  coroutine->idleFrame = __builtin_frame_address(0);
+
+  // A terminated coroutine can be reused by the pool: the callback is replaced
+  // and the next resume continues the loop.
+  for (;;) {
+    (*coroutine->cb)(coroutine->arg);
+    if (coroutine->localMask)
+      xcp_coroutine_destroy_locals(coroutine);
+    #ifdef HAVE_COROUTINE_STATS
+      xcp_coroutine_clear_stack(coroutine);
+    #endif // ifdef HAVE_COROUTINE_STATS
+
+    XcpCoroutine *caller = coroutine->caller;
+    coroutine->caller = NULL;
+    xcp_coroutine_exec(xcp_coroutine_get_thread_data(), coroutine, caller, XcpCoroutineStatusTerminated);
+  }
+}
+
+static void xcp_coroutine_destroy (XcpCoroutine *coroutine) {
+  #ifdef HAVE_VALGRIND
+    VALGRIND_STACK_DEREGISTER(coroutine->valgrindStackId);
+  #endif // ifdef HAVE_VALGRIND
+
+  if (!coroutine->userStack)
+    xcp_coroutine_destroy_stack(coroutine->stack, coroutine->stackSize, coroutine->guard);
+  free(coroutine);
+}
+
+static XcpCoroutine *xcp_coroutine_alloc (void *stack, size_t stackSize, bool guard) {
+  // 0. Create coroutine + stack.
+  XcpCoroutine *coroutine = malloc(sizeof *coroutine);
+  if (!coroutine) return NULL;
+
+  coroutine->userStack = stack != NULL;
+  if (!stack && !(stack = xcp_coroutine_create_stack(stackSize, guard))) {
+    free(coroutine);
+    return NULL;
+  }
+  coroutine->stack = stack;
+  coroutine->stackSize = stackSize;
+  coroutine->guard = guard;
+  coroutine->caller = NULL;
+
+  STAILQ_INIT(&coroutine->pendings);
+
+  xcp_coroutine_context_init(&coroutine->context, stack, stackSize, xcp_coroutine_run, coroutine);
+
+  #ifdef HAVE_VALGRIND
+    coroutine->valgrindStackId = VALGRIND_STACK_REGISTER(stack, (char *)stack + stackSize);
+  #endif // ifdef HAVE_VALGRIND
+
+  return coroutine;
+}
+
+// Give the stack pages of a terminated coroutine back to the kernel.
+// The top of the stack is kept: it contains the suspended execution context.
+static void xcp_coroutine_discard_stack (XcpCoroutine *coroutine) {
+  const uintptr_t begin = (uintptr_t)coroutine->stack;
+  const uintptr_t end = xcp_coroutine_get_discard_end(coroutine);
+  if (end > begin)
+    madvise(coroutine->stack, end - begin, MADV_DONTNEED);
+}
+
+// -----------------------------------------------------------------------------
+
+static pthread_key_t PoolKey;
+static pthread_once_t PoolKeyOnce = PTHREAD_ONCE_INIT;
+
+static void xcp_coroutine_pool_trim (XcpCoroutinePool *pool, size_t size) {
+  while (pool->size > size) {
+    XcpCoroutine *coroutine = STAILQ_FIRST(&pool->coroutines);
+    STAILQ_REMOVE_HEAD(&pool->coroutines, next);
+    --pool->size;
+    xcp_coroutine_destroy(coroutine);
+  }
+}
+
+static void xcp_coroutine_pools_clear (XcpCoroutineThreadData *threadData) {
+  XcpCoroutinePool *pool;
+  while ((pool = SLIST_FIRST(&threadData->pools)) != &threadData->defaultPool) {
+    SLIST_REMOVE_HEAD(&threadData->pools, next);
+    xcp_coroutine_pool_trim(pool, 0);
+    free(pool);
+  }
+  xcp_coroutine_pool_trim(pool, 0);
+}
+
+static void xcp_coroutine_pool_key_destructor (void *data) {
+  xcp_coroutine_pools_clear(data);
+}
+
+static void xcp_coroutine_pool_key_create () {
+  if (pthread_key_create(&PoolKey, xcp_coroutine_pool_key_destructor))
+    abort();
+}
+
+static XcpCoroutinePool *xcp_coroutine_pool_find (
+  XcpCoroutineThreadData *threadData,
+  size_t stackSize,
+  bool guard,
+  bool create
+) {
+  XcpCoroutinePool *pool;
+  SLIST_FOREACH(pool, &threadData->pools, next) {
+    if (pool->stackSize == stackSize && pool->guard == guard)
+      return pool;
+  }
+
+  if (!create || !(pool = malloc(sizeof *pool)))
+    return NULL;
+
+  pool->stackSize = stackSize;
+  pool->guard = guard;
+  STAILQ_INIT(&pool->coroutines);
+  pool->size = 0;
+
+  // Keep the default pool at the end of the list.
+  SLIST_INSERT_HEAD(&threadData->pools, pool, next);
+  return pool;
+}
+
+static void xcp_coroutine_pool_push (
+  XcpCoroutineThreadData *threadData,
+  XcpCoroutinePool *pool,
+  XcpCoroutine *coroutine
+) {
+  // Register the thread data to release the pool at thread exit.
+  if (XCP_UNLIKELY(!threadData->poolRegistered)) {
+    pthread_once(&PoolKeyOnce, xcp_coroutine_pool_key_create);
+    if (pthread_setspecific(PoolKey, threadData)) {
+      xcp_coroutine_destroy(coroutine);
+      return;
+    }
+    threadData->poolRegistered = true;
+  }
+
+  STAILQ_INSERT_HEAD(&pool->coroutines, coroutine, next);
+  ++pool->size;
+}
+
+static void xcp_coroutine_release (XcpCoroutineThreadData *threadData, XcpCoroutine *coroutine) {
+  XcpCoroutinePool *pool;
+  if (
+    coroutine->userStack ||
+    !(pool = xcp_coroutine_pool_find(threadData, coroutine->stackSize, coroutine->guard, true))
+  ) {
+    xcp_coroutine_destroy(coroutine);
+    return;
+  }
+
+  if (pool->size >= threadData->poolHighWatermark) {
+    xcp_coroutine_destroy(coroutine);
+    xcp_coroutine_pool_trim(pool, threadData->poolLowWatermark);
+    return;
+  }
+
+  #ifdef HAVE_COROUTINE_STATS
+    // The stack peak is computed from the zero-filled pages: a reused stack must be clean.
+    xcp_coroutine_discard_stack(coroutine);
+  #else
+    if (threadData->poolDiscardStacks)
+      xcp_coroutine_discard_stack(coroutine);
+  #endif // ifdef HAVE_COROUTINE_STATS
+  xcp_coroutine_pool_push(threadData, pool, coroutine);
+}
+
+XcpError xcp_coroutine_pool_set_watermarks (size_t lowWatermark, size_t highWatermark) {
+  if (lowWatermark > highWatermark) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  threadData->poolLowWatermark = lowWatermark;
+  threadData->poolHighWatermark = highWatermark;
+
+  XcpCoroutinePool *pool;
+  SLIST_FOREACH(pool, &threadData->pools, next)
+    xcp_coroutine_pool_trim(pool, highWatermark);
+  return XCP_ERR_OK;
+}
+
+void xcp_coroutine_pool_set_discard_stacks (bool status) {
+  xcp_coroutine_get_thread_data()->poolDiscardStacks = status;
+}
+
+// -----------------------------------------------------------------------------
+
+// Compute the stack attributes of a new coroutine.
+static XcpError xcp_coroutine_attr_resolve (const XcpCoroutineAttr *attr, size_t *stackSize, bool *guard) {
+  *stackSize = attr && attr->stackSize ? attr->stackSize : XCP_COROUTINE_STACK_SIZE;
+  *guard = !attr || attr->guard == XcpCoroutineGuardPage;
+  if (*stackSize < XCP_COROUTINE_STACK_MIN_SIZE) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  if (attr && attr->stack)
+    *guard = false;
+  else
+    *stackSize = XCP_ROUND_UP_2(*stackSize, xcp_coroutine_page_size());
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_coroutine_pool_prewarm (size_t count) {
+  return xcp_coroutine_pool_prewarm_ex(count, NULL);
+}
+
+XcpError xcp_coroutine_pool_prewarm_ex (size_t count, const XcpCoroutineAttr *attr) {
+  if (attr && attr->stack) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  size_t stackSize;
+  bool guard;
+  if (xcp_coroutine_attr_resolve(attr, &stackSize, &guard) != XCP_ERR_OK)
+    return XCP_ERR_ERRNO;
+
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  XcpCoroutinePool *pool = xcp_coroutine_pool_find(threadData, stackSize, guard, true);
+  if (!pool)
+    return XCP_ERR_ERRNO;
+
+  count = XCP_MIN(count, threadData->poolHighWatermark);
+  while (pool->size < count) {
+    XcpCoroutine *coroutine = xcp_coroutine_alloc(NULL, stackSize, guard);
+    if (!coroutine)
+      return XCP_ERR_ERRNO;
+    xcp_coroutine_pool_push(threadData, pool, coroutine);
+  }
+  return XCP_ERR_OK;
+}
+
+void xcp_coroutine_pool_clear () {
+  xcp_coroutine_pools_clear(xcp_coroutine_get_thread_data());
+}
+
+// -----------------------------------------------------------------------------
+
+XcpCoroutine *xcp_coroutine_create (XcpCoroutineCb cb, void *userData) {
+  return xcp_coroutine_create_ex(cb, userData, NULL);
+}
+
+XcpCoroutine *xcp_coroutine_create_ex (XcpCoroutineCb cb, void *userData, const XcpCoroutineAttr *attr) {
+  size_t stackSize;
+  bool guard;
+  if (xcp_coroutine_attr_resolve(attr, &stackSize, &guard) != XCP_ERR_OK)
+    return NULL;
+
+  XcpCoroutine *coroutine = NULL;
+  if (attr && attr->stack)
+    coroutine = xcp_coroutine_alloc(attr->stack, stackSize, false);
+  else {
+    XcpCoroutinePool *pool = xcp_coroutine_pool_find(xcp_coroutine_get_thread_data(), stackSize, guard, false);
+    if (XCP_LIKELY(pool && (coroutine = STAILQ_FIRST(&pool->coroutines)))) {
+      STAILQ_REMOVE_HEAD(&pool->coroutines, next);
+      --pool->size;
+    } else
+      coroutine = xcp_coroutine_alloc(NULL, stackSize, guard);
+  }
+  if (!coroutine)
+    return NULL;
+
+  coroutine->cb = cb;
+  coroutine->arg = userData;
+  coroutine->parkCb = NULL;
+  coroutine->scheduler = NULL;
+  coroutine->pinnedWorker = -1;
+  coroutine->thread = NULL;
+  coroutine->parked = false;
+  coroutine->localMask = 0;
+  coroutine->cancel = NULL;
+
+  #ifdef HAVE_COROUTINE_STATS
+    memset(&coroutine->stats, 0, sizeof coroutine->stats);
+    coroutine->readyTime = 0;
+    ++xcp_coroutine_get_thread_data()->stats.createCount;
+  #endif // ifdef HAVE_COROUTINE_STATS
+
+  return coroutine;
+}
+
+XcpCoroutine *xcp_coroutine_get_self () {
+  return xcp_coroutine_get_thread_data()->current;
+}
+
+bool xcp_coroutine_in_coroutine () {
+  return xcp_coroutine_get_thread_data()->current->caller != NULL;
+}
+
+void xcp_coroutine_resume (XcpCoroutine *coroutine) {
+  // 1. Add the coroutine in a pending list.
+  STAILQ_HEAD( , XcpCoroutine) pendings;
+  STAILQ_INIT(&pendings);
+  STAILQ_INSERT_TAIL(&pendings, coroutine, next);
+
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  XcpCoroutine *self = threadData->current;
+  while (!STAILQ_EMPTY(&pendings)) {
+    // 2.a. Fetch and resume the first pending coroutine.
+    XcpCoroutine *callee = STAILQ_FIRST(&pendings);
+    STAILQ_REMOVE_HEAD(&pendings, next);
+    if (callee->caller)
+      abort(); // Already called!
+    callee->caller = self;
+    if (!callee->scheduler)
+      callee->thread = threadData;
+
+    #ifdef HAVE_COROUTINE_STATS
+      const ulonglong start = xcp_coroutine_stats_now();
+      xcp_coroutine_stats_on_resume(threadData, callee, start);
+    #endif // ifdef HAVE_COROUTINE_STATS
+
+    const int ret = xcp_coroutine_exec(threadData, self, callee, XcpCoroutineStatusRunning);
+
+    #ifdef HAVE_COROUTINE_STATS
+      xcp_coroutine_stats_on_return(threadData, self, callee, start);
+    #endif // ifdef HAVE_COROUTINE_STATS
+
+    // 2.b. If there are pendings (async) coroutines on the last executed
+    // coroutine, add them in the main pending list.
+    STAILQ_CONCAT(&callee->pendings, &pendings);
+    STAILQ_CONCAT(&pendings, &callee->pendings);
+
+    switch (ret) {
+      case XcpCoroutineStatusTerminated:
+        if (callee->scheduler)
+          xcp_scheduler_detach(callee->scheduler);
+        #ifdef HAVE_COROUTINE_STATS
+          xcp_coroutine_stats_on_terminate(threadData, callee);
+        #endif // ifdef HAVE_COROUTINE_STATS
+        xcp_coroutine_release(threadData, callee);
+        break;
+      case XcpCoroutineStatusSuspend:
+        // 2.c. The callee is now completely suspended: it can be woken up by another thread
+        // when the park callback is executed. So never use it after this point.
+        if (callee->parkCb) {
+          const XcpCoroutineParkCb parkCb = callee->parkCb;
+          callee->parkCb = NULL;
+          (*parkCb)(callee->parkArg);
+        }
+        break;
+      default:
+        abort();
+    }
+  }
+}
+
+void xcp_coroutine_yield () {
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  XcpCoroutine *self = threadData->current;
+  if (!self->caller)
+    abort(); // Cannot yield if there is no caller.
+
+  #ifdef HAVE_COROUTINE_STATS
+    ++self->stats.yieldCount;
+    ++threadData->stats.yieldCount;
+  #endif // ifdef HAVE_COROUTINE_STATS
+
+  XcpCoroutine *caller = self->caller;
+  self->caller = NULL;
+  xcp_coroutine_exec(threadData, self, caller, XcpCoroutineStatusSuspend);
+}
+
+void xcp_coroutine_process (XcpCoroutine *coroutine) {
+  const XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  if (!threadData->current->caller)
+    xcp_coroutine_resume(coroutine);
+  else {
+    XcpCoroutine *self = xcp_coroutine_get_self();
+    assert(coroutine != self); // Avoid recursion...
+
+    // A new coroutine processed by a scheduled coroutine joins the same scheduler.
+    // Coroutines which are already executed by a thread are never migrated.
+    if (self->scheduler && !coroutine->scheduler && !coroutine->thread)
+      xcp_scheduler_attach(self->scheduler, coroutine);
+    xcp_coroutine_stats_set_ready(coroutine);
+    STAILQ_INSERT_TAIL(&self->pendings, coroutine, next);
+  }
+}
+
+void xcp_coroutine_park (XcpCoroutineParkCb cb, void *userData) {
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  XcpCoroutine *self = threadData->current;
+  if (!self->scheduler) {
+    self->parked = true;
+    ++threadData->parkedCount;
+  }
+
+  self->parkCb = cb;
+  self->parkArg = userData;
+  xcp_coroutine_yield();
+}
+
+static void xcp_coroutine_wake_queue_push (XcpCoroutineThreadData *owner, XcpCoroutine *coroutine) {
+  xcp_coroutine_stats_set_ready(coroutine);
+  xcp_spin_lock(&owner->wakeLock);
+  const bool notify = STAILQ_EMPTY(&owner->wakes);
+  STAILQ_INSERT_TAIL(&owner->wakes, coroutine, next);
+  if (notify && owner->wakeFd >= 0)
+    eventfd_write(owner->wakeFd, 1);
+  xcp_spin_unlock(&owner->wakeLock);
+}
+
+void xcp_coroutine_wake (XcpCoroutine *coroutine) {
+  if (coroutine->scheduler) {
+    xcp_coroutine_stats_set_ready(coroutine);
+    xcp_scheduler_enqueue(coroutine->scheduler, coroutine);
+    return;
+  }
+
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  XcpCoroutineThreadData *owner = coroutine->thread;
+  if (owner && owner != threadData) {
+    // Never resume the coroutine here: it uses the reactor and the TLS of its thread.
+    xcp_coroutine_wake_queue_push(owner, coroutine);
+    return;
+  }
+
+  if (coroutine->parked) {
+    coroutine->parked = false;
+    --threadData->parkedCount;
+  }
+  xcp_coroutine_process(coroutine);
+}
+
+void xcp_coroutine_wake_later (XcpCoroutine *coroutine) {
+  xcp_coroutine_wake_queue_push(xcp_coroutine_get_thread_data(), coroutine);
+}
+
+// -----------------------------------------------------------------------------
+
+int xcp_coroutine_wake_queue_open () {
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  if (threadData->wakeFd >= 0)
+    return threadData->wakeFd;
+
+  const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0)
+    return -1;
+
+  // Coroutines may have been woken before the creation of the fd.
+  xcp_spin_lock(&threadData->wakeLock);
+  threadData->wakeFd = fd;
+  if (!STAILQ_EMPTY(&threadData->wakes))
+    eventfd_write(fd, 1);
+  xcp_spin_unlock(&threadData->wakeLock);
+  return fd;
+}
+
+void xcp_coroutine_wake_queue_close () {
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+  xcp_spin_lock(&threadData->wakeLock);
+  const int fd = threadData->wakeFd;
+  threadData->wakeFd = -1;
+  xcp_spin_unlock(&threadData->wakeLock);
+
+  if (fd >= 0)
+    xcp_fd_close(fd);
+}
+
+size_t xcp_coroutine_wake_queue_drain () {
+  XcpCoroutineThreadData *threadData = xcp_coroutine_get_thread_data();
+
+  STAILQ_HEAD( , XcpCoroutine) wakes;
+  STAILQ_INIT(&wakes);
+  xcp_spin_lock(&threadData->wakeLock);
+  if (threadData->wakeFd >= 0) {
+    eventfd_t value;
+    eventfd_read(threadData->wakeFd, &value);
+  }
+  STAILQ_CONCAT(&wakes, &threadData->wakes);
+  xcp_spin_unlock(&threadData->wakeLock);
+
+  size_t count = 0;
+  XcpCoroutine *coroutine;
+  while ((coroutine = STAILQ_FIRST(&wakes))) {
+    STAILQ_REMOVE_HEAD(&wakes, next);
+    xcp_coroutine_wake(coroutine);
+    ++count;
+  }
+  return count;
+}
+
+size_t xcp_coroutine_get_parked_count () {
+  return xcp_coroutine_get_thread_data()->parkedCount;
+}
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_coroutine_key_create (XcpCoroutineKey *key, XcpCoroutineKeyDestructor destructor) {
+  uint mask = __atomic_load_n(&KeyMask, __ATOMIC_RELAXED);
+  for (;;) {
+    const uint freeMask = ~mask & ((1U << XCP_COROUTINE_KEYS_MAX) - 1);
+    if (!freeMask) {
+      errno = EAGAIN;
+      return XCP_ERR_ERRNO;
+    }
+
+    const uint index = (uint)__builtin_ctz(freeMask);
+    if (__atomic_compare_exchange_n(&KeyMask, &mask, mask | (1U << index), true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&KeyDestructors[index], destructor, __ATOMIC_RELEASE);
+      *key = index;
+      return XCP_ERR_OK;
+    }
+  }
+}
+
+void xcp_coroutine_key_delete (XcpCoroutineKey key) {
+  assert(key < XCP_COROUTINE_KEYS_MAX);
+  __atomic_store_n(&KeyDestructors[key], NULL, __ATOMIC_RELEASE);
+  __atomic_fetch_and(&KeyMask, ~(1U << key), __ATOMIC_RELEASE);
+}
+
+void *xcp_coroutine_getspecific (XcpCoroutineKey key) {
+  assert(key < XCP_COROUTINE_KEYS_MAX);
+  const XcpCoroutine *self = xcp_coroutine_get_self();
+  return (self->localMask >> key) & 1 ? self->locals[key] : NULL;
+}
+
+void xcp_coroutine_setspecific (XcpCoroutineKey key, void *value) {
+  assert(key < XCP_COROUTINE_KEYS_MAX);
+  XcpCoroutine *self = xcp_coroutine_get_self();
+  self->locals[key] = value;
+  self->localMask |= 1U << key;
+}
+
+// -----------------------------------------------------------------------------
+
+#ifdef HAVE_COROUTINE_STATS
+  XcpError xcp_coroutine_get_stats (const XcpCoroutine *coroutine, XcpCoroutineStats *stats) {
+    *stats = coroutine->stats;
+    stats->stackPeak = xcp_coroutine_get_stack_peak(coroutine);
+    return XCP_ERR_OK;
+  }
+
+  XcpError xcp_coroutine_get_thread_stats (XcpCoroutineThreadStats *stats) {
+    *stats = xcp_coroutine_get_thread_data()->stats;
+    return XCP_ERR_OK;
+  }
+
+  void xcp_coroutine_reset_thread_stats () {
+    memset(&xcp_coroutine_get_thread_data()->stats, 0, sizeof(XcpCoroutineThreadStats));
+  }
+
+  char *xcp_coroutine_dump_thread_stats () {
+    const XcpCoroutineThreadStats *stats = &xcp_coroutine_get_thread_data()->stats;
+
+    char histogram[XCP_COROUTINE_STATS_STACK_BUCKET_COUNT * 24];
+    size_t histogramSize = 0;
+    for (size_t i = 0; i < XCP_COROUTINE_STATS_STACK_BUCKET_COUNT; ++i)
+      histogramSize += (size_t)snprintf(
+        histogram + histogramSize, sizeof histogram - histogramSize, "%s%llu", i ? "," : "", stats->stackPeakHistogram[i]
+      );
+
+    const size_t jsonSize = 512 + sizeof histogram;
+    char *json = malloc(jsonSize);
+    if (!json)
+      return NULL;
+
+    snprintf(
+      json,
+      jsonSize,
+      "{\"createCount\":%llu,\"terminateCount\":%llu,\"resumeCount\":%llu,\"yieldCount\":%llu,"
+      "\"runTime\":%llu,\"runTimeMax\":%llu,\"pendingTime\":%llu,\"pendingTimeMax\":%llu,"
+      "\"stackPeakMax\":%zu,\"stackPeakHistogram\":[%s]}",
+      stats->createCount, stats->terminateCount, stats->resumeCount, stats->yieldCount,
+      stats->runTime, stats->runTimeMax, stats->pendingTime, stats->pendingTimeMax,
+      stats->stackPeakMax, histogram
+    );
+    return json;
+  }
+#else
+  XcpError xcp_coroutine_get_stats (const XcpCoroutine *coroutine, XcpCoroutineStats *stats) {
+    XCP_UNUSED(coroutine);
+    XCP_UNUSED(stats);
+    errno = ENOTSUP;
+    return XCP_ERR_ERRNO;
+  }
+
+  XcpError xcp_coroutine_get_thread_stats (XcpCoroutineThreadStats *stats) {
+    XCP_UNUSED(stats);
+    errno = ENOTSUP;
+    return XCP_ERR_ERRNO;
+  }
+
+  void xcp_coroutine_reset_thread_stats () {}
+
+  char *xcp_coroutine_dump_thread_stats () {
+    errno = ENOTSUP;
+    return NULL;
+  }
+#endif // ifdef HAVE_COROUTINE_STATS
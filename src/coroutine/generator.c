@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+
+#include "coroutine/coroutine-private.h"
+#include "xcp-ng/generic/generator.h"
+#include "xcp-ng/generic/reactor.h"
+#include "xcp-ng/generic/scheduler.h"
+
+// =============================================================================
+
+static void xcp_generator_wake_later (void *userData) {
+  xcp_coroutine_wake_later(userData);
+}
+
+XcpError xcp_generator_run (XcpGeneratorStepCb step, void *userData) {
+  while ((*step)(userData) != XcpGeneratorDone) {
+    if (xcp_coroutine_get_self()->scheduler)
+      xcp_scheduler_yield();
+    else if (xcp_reactor_can_suspend()) {
+      // Resumed by the next reactor iteration without timer, after the other ready coroutines.
+      xcp_coroutine_park(xcp_generator_wake_later, xcp_coroutine_get_self());
+    } else if (xcp_coroutine_in_coroutine()) {
+      // The other coroutines of the thread cannot be executed: the step would never change.
+      errno = EDEADLK;
+      return XCP_ERR_ERRNO;
+    }
+  }
+  return XCP_ERR_OK;
+}
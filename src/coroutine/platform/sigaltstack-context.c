@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// =============================================================================
+// See: https://www.gnu.org/software/pth/ (pth_mctx.c)
+// Implementation of: http://runtime.bordeaux.inria.fr/ssep/Biblio/Eng_gnupth_usenix00.pdf
+// Old paper: www.mit.edu/afs.new/sipb/user/nathanw/work/sched/papers/rse-pmt.ps
+// =============================================================================
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "coroutine/context.h"
+
+// =============================================================================
+
+// Using sigsetjmp seems better... See `man 3 setjmp`:
+//
+// POSIX does not specify whether setjmp() will save the signal mask (to
+// be later restored during longjmp()).  In System V it will not.  In
+// 4.3BSD it will, and there is a function _setjmp() that will not.  The
+// behavior under Linux depends on the glibc version and the setting of
+// feature test macros.
+//
+// So, it seems nice to have the same behavior on all supported platforms.
+
+typedef struct {
+  sigjmp_buf env;
+  volatile sig_atomic_t called;
+
+  XcpCoroutineContext *context;
+  XcpCoroutineContextEntry entry;
+  void *arg;
+
+  sigjmp_buf *initEnv;
+} Trampoline;
+
+static __thread Trampoline trampoline;
+
+// -----------------------------------------------------------------------------
+
+static void xcp_coroutine_context_bootstrap () {
+  XcpCoroutineContext *context = trampoline.context;
+  const XcpCoroutineContextEntry entry = trampoline.entry;
+  void *arg = trampoline.arg;
+
+  // 10. Save context for the first entry execution.
+  if (!sigsetjmp(context->env, 0))
+    // 11. Return to xcp_coroutine_context_init for the last time.
+    siglongjmp(*trampoline.initEnv, 1);
+
+  (*entry)(arg);
+
+  // Not reachable.
+  abort();
+}
+
+static void xcp_coroutine_context_trampoline (int signal) {
+  XCP_UNUSED(signal);
+
+  trampoline.called = true;
+
+  // 5. Save context and return to the xcp_coroutine_context_init function.
+  if (!sigsetjmp(trampoline.env, 0))
+    return;
+
+  // 9. Called again! Go to a clean stack frame!
+  xcp_coroutine_context_bootstrap();
+}
+
+// -----------------------------------------------------------------------------
+
+void xcp_coroutine_context_init (
+  XcpCoroutineContext *context,
+  void *stack,
+  size_t stackSize,
+  XcpCoroutineContextEntry entry,
+  void *arg
+) {
+  // 1. Block temporarily SIGUSR1 and save old sig mask set.
+  sigset_t set, oldSet;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  if (pthread_sigmask(SIG_BLOCK, &set, &oldSet))
+    abort();
+
+  // 2. Save the current sigaction for the SIGUSR1 signal + add custom handler with alternate stack flag.
+  struct sigaction sa, oldSa;
+  sa.sa_handler = xcp_coroutine_context_trampoline;
+  sa.sa_flags = SA_ONSTACK;
+  sigfillset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, &oldSa))
+    abort();
+
+  // 3. Save the current alternate signal stack + replace it with our custom stack.
+  stack_t ss, oldSs;
+  ss.ss_sp = stack;
+  ss.ss_size = stackSize;
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, &oldSs))
+    abort();
+
+  // 4. Exec trampoline for the first time.
+  trampoline.called = false;
+  trampoline.context = context;
+  trampoline.entry = entry;
+  trampoline.arg = arg;
+
+  pthread_kill(pthread_self(), SIGUSR1);
+  sigfillset(&set);
+  sigdelset(&set, SIGUSR1);
+  while (!trampoline.called)
+    sigsuspend(&set);
+    // 5. Saving context in the trampoline function.
+    // ...
+
+  // 6. Restore previous stack, sigaction for SIGUSR1 and sig mask set.
+  ss.ss_flags = SS_DISABLE;
+  if (
+    sigaltstack(&ss, NULL) ||
+    sigaltstack(&oldSs, NULL) ||
+    sigaction(SIGUSR1, &oldSa, NULL) ||
+    pthread_sigmask(SIG_SETMASK, &oldSet, NULL)
+  )
+    abort();
+
+  // 7. Save current context.
+  sigjmp_buf oldEnv;
+  trampoline.initEnv = &oldEnv;
+
+  if (!sigsetjmp(oldEnv, 0))
+    // 8. Restore previous context in the trampoline.
+    siglongjmp(trampoline.env, 1);
+    // 9-11: Trampoline execution...
+
+  // 12. So far so good! :)
+}
+
+int xcp_coroutine_context_switch (XcpCoroutineContext *from, XcpCoroutineContext *to, int value) {
+  const int ret = sigsetjmp(from->env, 0);
+  if (ret == 0)
+    siglongjmp(to->env, value);
+  return ret;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// =============================================================================
+// Only the callee-saved registers of the System V AMD64 ABI are saved on the
+// stack of the suspended context: rbp, rbx, r12-r15, the MXCSR control bits and
+// the x87 control word. The stack pointer is stored in the context.
+// See: https://refspecs.linuxbase.org/elf/x86_64-abi-0.99.pdf (3.2.1 and 3.2.3)
+// =============================================================================
+
+#include <stdint.h>
+
+#include "coroutine/context.h"
+
+// =============================================================================
+
+#if !defined(__x86_64__)
+  #error "The native coroutine context is only available on x86-64."
+#endif // if !defined(__x86_64__)
+
+// Saved frame, from the lowest address:
+// [MXCSR | x87 CW] r15 r14 r13 r12 rbx rbp rip
+#define FRAME_SIZE 64
+
+void xcp_coroutine_context_entry ();
+
+__asm__(
+  ".text\n"
+  ".globl xcp_coroutine_context_switch\n"
+  ".hidden xcp_coroutine_context_switch\n"
+  ".type xcp_coroutine_context_switch, @function\n"
+  ".p2align 4\n"
+  "xcp_coroutine_context_switch:\n"
+  "  .cfi_startproc\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $8, %rsp\n"
+  "  stmxcsr (%rsp)\n"
+  "  fnstcw 4(%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq (%rsi), %rsp\n"
+  "  ldmxcsr (%rsp)\n"
+  "  fldcw 4(%rsp)\n"
+  "  addq $8, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  movl %edx, %eax\n"
+  "  ret\n"
+  "  .cfi_endproc\n"
+  ".size xcp_coroutine_context_switch, .-xcp_coroutine_context_switch\n"
+
+  // First function executed by a new context: call entry(arg) stored in r13 and r12.
+  ".globl xcp_coroutine_context_entry\n"
+  ".hidden xcp_coroutine_context_entry\n"
+  ".type xcp_coroutine_context_entry, @function\n"
+  ".p2align 4\n"
+  "xcp_coroutine_context_entry:\n"
+  "  .cfi_startproc\n"
+  "  .cfi_undefined rip\n"
+  "  movq %r12, %rdi\n"
+  "  callq *%r13\n"
+  "  ud2\n"
+  "  .cfi_endproc\n"
+  ".size xcp_coroutine_context_entry, .-xcp_coroutine_context_entry\n"
+);
+
+// -----------------------------------------------------------------------------
+
+void xcp_coroutine_context_init (
+  XcpCoroutineContext *context,
+  void *stack,
+  size_t stackSize,
+  XcpCoroutineContextEntry entry,
+  void *arg
+) {
+  // Keep a null slot at the top (fake return address of the entry) and
+  // align the frame to have a 16-byte aligned stack at the entry call.
+  const uintptr_t top = ((uintptr_t)stack + stackSize) & ~(uintptr_t)15;
+  uint64_t *frame = (uint64_t *)(top - FRAME_SIZE - 16);
+
+  uint32_t mxcsr;
+  uint16_t fpucw;
+  __asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+  __asm__ volatile ("fnstcw %0" : "=m" (fpucw));
+
+  frame[0] = (uint64_t)mxcsr | ((uint64_t)fpucw << 32);
+  frame[1] = 0; // r15
+  frame[2] = 0; // r14
+  frame[3] = (uint64_t)(uintptr_t)entry; // r13
+  frame[4] = (uint64_t)(uintptr_t)arg; // r12
+  frame[5] = 0; // rbx
+  frame[6] = 0; // rbp
+  frame[7] = (uint64_t)(uintptr_t)xcp_coroutine_context_entry; // rip
+  frame[8] = 0;
+  frame[9] = 0;
+
+  context->sp = frame;
+}
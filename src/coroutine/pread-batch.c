@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+#include "coroutine/async-io.h"
+#include "xcp-ng/generic/cancel.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+#include "xcp-ng/generic/reactor.h"
+
+// =============================================================================
+
+// IOV_MAX is only defined by <limits.h> with _XOPEN_SOURCE, this is the Linux value.
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif // ifndef IOV_MAX
+
+// Max size of merged requests: keep enough calls to use the queue depth.
+#define MERGE_MAX_SIZE (8UL * 1024UL * 1024UL)
+
+// Adjacent requests read by one preadv call.
+typedef struct {
+  XcpAsyncIoOp op; // Must be the first member.
+
+  struct XcpReadBatch *batch;
+  XcpReadRequest **requests;
+  struct iovec *iovs;
+  size_t count;
+  size_t pos; // First incomplete request.
+} XcpReadGroup;
+
+typedef struct XcpReadBatch {
+  XcpReadRequest **sorted;
+  struct iovec *iovs;
+  XcpReadGroup *groups;
+  size_t groupCount;
+
+  // Engine of the thread, NULL to use the engine of the reactor.
+  XcpAsyncIo *asyncIo;
+
+  // Calls completed by the reactor loop, and the coroutine to wake up.
+  XcpAsyncIoOp *completed;
+  XcpCoroutine *waiter;
+} XcpReadBatch;
+
+// Engine used outside the reactor, destroyed at thread exit.
+static pthread_key_t AsyncIoKey;
+static pthread_once_t AsyncIoKeyOnce = PTHREAD_ONCE_INIT;
+
+static __thread XcpAsyncIo *ThreadAsyncIo;
+
+// -----------------------------------------------------------------------------
+
+static int xcp_read_request_compare (const void *a, const void *b) {
+  const off_t offsetA = (*(XcpReadRequest *const *)a)->offset;
+  const off_t offsetB = (*(XcpReadRequest *const *)b)->offset;
+  return (offsetA > offsetB) - (offsetA < offsetB);
+}
+
+static void xcp_read_batch_destroy (XcpReadBatch *batch) {
+  free(batch->sorted);
+  free(batch->iovs);
+  free(batch->groups);
+}
+
+// Sort the requests and merge the adjacent ones.
+static XcpError xcp_read_batch_init (XcpReadBatch *batch, int fd, XcpReadRequest *requests, size_t count) {
+  size_t size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    requests[i].result = 0;
+    if (requests[i].length)
+      ++size;
+  }
+
+  batch->sorted = NULL;
+  batch->iovs = NULL;
+  batch->groups = NULL;
+  batch->groupCount = 0;
+  if (!size)
+    return XCP_ERR_OK;
+
+  batch->sorted = malloc(size * sizeof *batch->sorted);
+  batch->iovs = malloc(size * sizeof *batch->iovs);
+  batch->groups = malloc(size * sizeof *batch->groups);
+  if (!batch->sorted || !batch->iovs || !batch->groups) {
+    xcp_read_batch_destroy(batch);
+    return XCP_ERR_ERRNO;
+  }
+
+  size = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (requests[i].length)
+      batch->sorted[size++] = &requests[i];
+  }
+  qsort(batch->sorted, size, sizeof *batch->sorted, xcp_read_request_compare);
+
+  XcpReadGroup *group = NULL;
+  size_t groupSize = 0;
+  for (size_t i = 0; i < size; ++i) {
+    XcpReadRequest *request = batch->sorted[i];
+    batch->iovs[i] = (struct iovec){ request->buf, request->length };
+
+    const XcpReadRequest *last = group ? group->requests[group->count - 1] : NULL;
+    if (
+      last &&
+      last->offset + (off_t)last->length == request->offset &&
+      group->count < IOV_MAX &&
+      groupSize + request->length <= MERGE_MAX_SIZE
+    ) {
+      ++group->count;
+      groupSize += request->length;
+      continue;
+    }
+
+    group = &batch->groups[batch->groupCount++];
+    group->op = (XcpAsyncIoOp){ .type = XcpAsyncIoOpPreadv, .fd = fd, .offset = request->offset };
+    group->batch = batch;
+    group->requests = batch->sorted + i;
+    group->iovs = batch->iovs + i;
+    group->count = 1;
+    group->pos = 0;
+    groupSize = request->length;
+  }
+
+  for (size_t i = 0; i < batch->groupCount; ++i) {
+    group = &batch->groups[i];
+    group->op.iovs = group->iovs;
+    group->op.iovCount = (uint)group->count;
+  }
+
+  return XCP_ERR_OK;
+}
+
+static void xcp_read_group_fail (XcpReadGroup *group, int error) {
+  for (; group->pos < group->count; ++group->pos)
+    group->requests[group->pos]->result = -error;
+}
+
+// Dispatch the result of a call in the requests. Return true if the remaining part of a
+// short read must be read.
+static bool xcp_read_group_complete (XcpReadGroup *group) {
+  const ssize_t result = group->op.result;
+  if (result < 0) {
+    xcp_read_group_fail(group, (int)-result);
+    return false;
+  }
+
+  // EOF: the incomplete requests keep their count of read bytes.
+  if (result == 0) {
+    group->pos = group->count;
+    return false;
+  }
+
+  size_t remaining = (size_t)result;
+  while (remaining) {
+    XcpReadRequest *request = group->requests[group->pos];
+    const size_t count = XCP_MIN(remaining, request->length - (size_t)request->result);
+    request->result += (ssize_t)count;
+    remaining -= count;
+    if ((size_t)request->result == request->length)
+      ++group->pos;
+  }
+
+  if (group->pos == group->count)
+    return false;
+
+  // The iovecs are owned by the batch: continue after the read bytes.
+  XcpReadRequest *request = group->requests[group->pos];
+  struct iovec *iov = &group->iovs[group->pos];
+  iov->iov_base = (char *)request->buf + request->result;
+  iov->iov_len = request->length - (size_t)request->result;
+
+  group->op.iovs = iov;
+  group->op.iovCount = (uint)(group->count - group->pos);
+  group->op.offset = request->offset + request->result;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+static void xcp_read_batch_run_sync (XcpReadBatch *batch) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
+  for (size_t i = 0; i < batch->groupCount; ++i) {
+    XcpReadGroup *group = &batch->groups[i];
+    do {
+      if (xcp_cancel_check(cancel) != XCP_ERR_OK) {
+        xcp_read_group_fail(group, errno);
+        break;
+      }
+      xcp_async_io_exec(&group->op);
+    } while (xcp_read_group_complete(group));
+  }
+}
+
+static void xcp_read_batch_async_io_key_destructor (void *data) {
+  xcp_async_io_destroy(data);
+  ThreadAsyncIo = NULL;
+}
+
+static void xcp_read_batch_async_io_key_create () {
+  if (pthread_key_create(&AsyncIoKey, xcp_read_batch_async_io_key_destructor))
+    abort();
+}
+
+static XcpAsyncIo *xcp_read_batch_get_thread_async_io () {
+  if (XCP_LIKELY(ThreadAsyncIo))
+    return ThreadAsyncIo;
+
+  pthread_once(&AsyncIoKeyOnce, xcp_read_batch_async_io_key_create);
+  XcpAsyncIo *asyncIo = xcp_async_io_create();
+  if (!asyncIo)
+    return NULL;
+
+  if (pthread_setspecific(AsyncIoKey, asyncIo)) {
+    xcp_async_io_destroy(asyncIo);
+    return NULL;
+  }
+  return ThreadAsyncIo = asyncIo;
+}
+
+// Called by the reactor loop.
+static void xcp_read_group_on_completed (XcpAsyncIoOp *op) {
+  XcpReadBatch *batch = ((XcpReadGroup *)op)->batch;
+  op->next = batch->completed;
+  batch->completed = op;
+
+  XcpCoroutine *waiter = batch->waiter;
+  if (waiter) {
+    batch->waiter = NULL;
+    xcp_coroutine_wake(waiter);
+  }
+}
+
+static XcpError xcp_read_batch_queue (XcpReadBatch *batch, XcpReadGroup *group) {
+  if (batch->asyncIo) {
+    xcp_async_io_queue(batch->asyncIo, &group->op);
+    return XCP_ERR_OK;
+  }
+
+  group->op.cb = xcp_read_group_on_completed;
+  return xcp_reactor_queue_async_io(&group->op);
+}
+
+// Wait for the in-flight calls without suspending: the token cannot be used anymore.
+static void xcp_read_batch_drain_wait (int fd, int timeout) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  while (poll(&pfd, 1, timeout) < 0 && errno == EINTR);
+}
+
+// Return the completed calls, NULL if the wait must be retried. `stopError` is set if
+// the wait is interrupted.
+static XcpAsyncIoOp *xcp_read_batch_wait (XcpReadBatch *batch, int *stopError) {
+  XcpAsyncIoOp *op;
+  if (!batch->asyncIo) {
+    // Submitted and dispatched by the reactor loop: the token is checked between the
+    // completions.
+    if (!batch->completed) {
+      batch->waiter = xcp_coroutine_get_self();
+      xcp_coroutine_yield();
+    }
+    op = batch->completed;
+    batch->completed = NULL;
+    return op;
+  }
+
+  // On error, the calls which are not started are returned by the reap with the error.
+  const XcpError submitted = xcp_async_io_submit(batch->asyncIo);
+  if (submitted == XCP_ERR_ERRNO && !*stopError)
+    *stopError = errno;
+
+  if ((op = xcp_async_io_reap(batch->asyncIo)))
+    return op;
+
+  // Calls not accepted by the kernel: the fd may never be notified.
+  const int fd = xcp_async_io_get_fd(batch->asyncIo);
+  const int timeout = submitted == XCP_ERR_AGAIN ? XCP_ASYNC_IO_RETRY_DELAY : -1;
+  if (*stopError)
+    xcp_read_batch_drain_wait(fd, timeout);
+  else {
+    const XcpError ret = xcp_reactor_wait_fd(fd, POLLIN, timeout);
+    if (ret != XCP_ERR_OK && (ret != XCP_ERR_TIMEOUT || timeout < 0))
+      *stopError = errno;
+  }
+  return NULL;
+}
+
+static void xcp_read_batch_run_async (XcpReadBatch *batch, uint queueDepth) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
+
+  size_t next = 0;
+  uint inFlightCount = 0;
+  int stopError = 0;
+
+  for (;;) {
+    if (!stopError && xcp_cancel_check(cancel) != XCP_ERR_OK)
+      stopError = errno;
+
+    for (; !stopError && inFlightCount < queueDepth && next < batch->groupCount; ++next) {
+      if (xcp_read_batch_queue(batch, &batch->groups[next]) != XCP_ERR_OK) {
+        stopError = errno;
+        break;
+      }
+      ++inFlightCount;
+    }
+    if (!inFlightCount)
+      break;
+
+    // The queued calls are always completed, even after an error: their buffers are owned
+    // by the caller.
+    XcpAsyncIoOp *op = xcp_read_batch_wait(batch, &stopError);
+    while (op) {
+      XcpAsyncIoOp *nextOp = op->next;
+      XcpReadGroup *group = (XcpReadGroup *)op;
+      --inFlightCount;
+      if (xcp_read_group_complete(group)) {
+        if (stopError || xcp_read_batch_queue(batch, group) != XCP_ERR_OK)
+          xcp_read_group_fail(group, stopError ? stopError : errno);
+        else
+          ++inFlightCount;
+      }
+      op = nextOp;
+    }
+  }
+
+  // Never submitted.
+  for (; next < batch->groupCount; ++next)
+    xcp_read_group_fail(&batch->groups[next], stopError);
+}
+
+XcpError xcp_fd_pread_batch (int fd, XcpReadRequest *requests, size_t count, uint queueDepth) {
+  XcpReadBatch batch;
+  if (xcp_read_batch_init(&batch, fd, requests, count) != XCP_ERR_OK)
+    return XCP_ERR_ERRNO;
+
+  if (batch.groupCount == 1)
+    xcp_read_batch_run_sync(&batch);
+  else if (batch.groupCount) {
+    // Reuse the engine of the reactor if the coroutine can be suspended, otherwise the
+    // engine of the thread: no other batch can use it before the end of this one.
+    batch.asyncIo = NULL;
+    batch.completed = NULL;
+    batch.waiter = NULL;
+    if (xcp_reactor_can_suspend() || (batch.asyncIo = xcp_read_batch_get_thread_async_io()))
+      xcp_read_batch_run_async(&batch, queueDepth ? queueDepth : XCP_FD_PREAD_BATCH_DEPTH);
+    else
+      xcp_read_batch_run_sync(&batch);
+  }
+
+  // Report the first error by offset.
+  XcpError ret = XCP_ERR_OK;
+  for (size_t i = 0; ret == XCP_ERR_OK && i < batch.groupCount; ++i) {
+    const XcpReadGroup *group = &batch.groups[i];
+    for (size_t j = 0; j < group->count; ++j) {
+      if (group->requests[j]->result < 0) {
+        errno = (int)-group->requests[j]->result;
+        ret = XCP_ERR_ERRNO;
+        break;
+      }
+    }
+  }
+
+  xcp_read_batch_destroy(&batch);
+  return ret;
+}
@@ -0,0 +1,624 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "coroutine/async-io.h"
+#include "coroutine/coroutine-private.h"
+#include "coroutine/timer-wheel.h"
+#include "xcp-ng/generic/cancel.h"
+#include "xcp-ng/generic/coroutine.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+#include "xcp-ng/generic/reactor.h"
+#include "xcp-ng/generic/timer.h"
+
+// =============================================================================
+
+#define EVENTS_MAX_COUNT 256
+
+// Registered by a suspended coroutine, lives on its stack.
+typedef struct XcpReactorWaiter {
+  XcpCoroutine *coroutine;
+  int fd;
+
+  XcpTimer timer;
+  bool expired;
+  bool ready;
+
+  // Registered on the entry of the token eventfd.
+  XcpCancel *cancel;
+  bool cancelled;
+  LIST_ENTRY(XcpReactorWaiter) cancelEntry;
+
+  struct XcpReactorWaiter *nextReady;
+} XcpReactorWaiter;
+
+typedef struct {
+  XcpReactorWaiter *reader;
+  XcpReactorWaiter *writer;
+
+  // Waiters interrupted when the fd (eventfd of a cancellation token) is readable.
+  LIST_HEAD( , XcpReactorWaiter) cancelWaiters;
+
+  bool added;
+} XcpReactorFd;
+
+typedef struct {
+  int epollFd;
+
+  XcpReactorFd *fds;
+  size_t fdsSize;
+
+  size_t waiterCount;
+  XcpTimerWheel timers;
+
+  XcpAsyncIo *asyncIo;
+  int asyncIoFd;
+
+  // Notified when coroutines of this thread are woken by other threads.
+  int wakeFd;
+
+  bool stop;
+} XcpReactor;
+
+static __thread XcpReactor *ThreadReactor;
+
+// -----------------------------------------------------------------------------
+
+// The token eventfd is polled with the fd, the timeout is recomputed after an interruption.
+static XcpError xcp_reactor_poll_fd (int fd, int events, int timeout, const XcpCancel *cancel) {
+  struct pollfd fds[2] = {
+    { fd, (short)events, 0 },
+    { cancel ? cancel->eventFd : -1, POLLIN, 0 }
+  };
+  const longlong deadline = timeout > 0 ? xcp_timer_now() + timeout : -1;
+  for (;;) {
+    const int ret = poll(fds, 2, timeout);
+    if (ret > 0) {
+      if (fds[0].revents)
+        return XCP_ERR_OK;
+      errno = ECANCELED;
+      return XCP_ERR_ERRNO;
+    }
+    if (ret == 0) {
+      errno = ETIMEDOUT;
+      return XCP_ERR_TIMEOUT;
+    }
+    if (errno != EAGAIN && errno != EINTR)
+      return XCP_ERR_ERRNO;
+    if (deadline >= 0)
+      timeout = (int)XCP_MAX(deadline - xcp_timer_now(), 0LL);
+  }
+}
+
+static XcpReactorFd *xcp_reactor_get_fd (XcpReactor *reactor, int fd) {
+  const size_t index = (size_t)fd;
+  if (index >= reactor->fdsSize) {
+    size_t size = XCP_MAX(reactor->fdsSize, (size_t)64);
+    while (size <= index)
+      size <<= 1;
+
+    XcpReactorFd *fds = realloc(reactor->fds, size * sizeof *fds);
+    if (!fds)
+      return NULL;
+    memset(fds + reactor->fdsSize, 0, (size - reactor->fdsSize) * sizeof *fds);
+    reactor->fds = fds;
+    reactor->fdsSize = size;
+  }
+  return &reactor->fds[index];
+}
+
+// Fds are registered in one-shot mode: re-arm them with the interests of the current waiters.
+static XcpError xcp_reactor_arm (XcpReactor *reactor, int fd, XcpReactorFd *entry) {
+  struct epoll_event event = { 0 };
+  if (entry->reader || !LIST_EMPTY(&entry->cancelWaiters))
+    event.events |= EPOLLIN;
+  if (entry->writer)
+    event.events |= EPOLLOUT;
+  if (!event.events)
+    return XCP_ERR_OK;
+
+  event.events |= EPOLLONESHOT;
+  event.data.fd = fd;
+
+  // The fd may have been closed or replaced since the last registration.
+  int op = entry->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(reactor->epollFd, op, fd, &event) < 0) {
+    if (errno != (op == EPOLL_CTL_MOD ? ENOENT : EEXIST))
+      return XCP_ERR_ERRNO;
+
+    op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(reactor->epollFd, op, fd, &event) < 0)
+      return XCP_ERR_ERRNO;
+  }
+
+  entry->added = true;
+  return XCP_ERR_OK;
+}
+
+static void xcp_reactor_detach (XcpReactorFd *entry, const XcpReactorWaiter *waiter) {
+  if (entry->reader == waiter)
+    entry->reader = NULL;
+  if (entry->writer == waiter)
+    entry->writer = NULL;
+}
+
+static inline void xcp_reactor_detach_cancel (XcpReactorWaiter *waiter) {
+  if (waiter->cancel) {
+    LIST_REMOVE(waiter, cancelEntry);
+    waiter->cancel = NULL;
+  }
+}
+
+static void xcp_reactor_set_ready (XcpReactor *reactor, XcpReactorWaiter *waiter, XcpReactorWaiter **readyList) {
+  waiter->ready = true;
+  waiter->nextReady = *readyList;
+  xcp_reactor_detach_cancel(waiter);
+  *readyList = waiter;
+
+  if (waiter->timer.active)
+    xcp_timer_wheel_remove(&reactor->timers, &waiter->timer);
+  --reactor->waiterCount;
+}
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_reactor_init () {
+  if (ThreadReactor)
+    return XCP_ERR_OK;
+
+  XcpReactor *reactor = calloc(1, sizeof *reactor);
+  if (!reactor)
+    return XCP_ERR_ERRNO;
+
+  if ((reactor->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    free(reactor);
+    return XCP_ERR_ERRNO;
+  }
+  xcp_timer_wheel_init(&reactor->timers, xcp_timer_now());
+
+  struct epoll_event event = { 0 };
+  event.events = EPOLLIN;
+  if (
+    (event.data.fd = reactor->wakeFd = xcp_coroutine_wake_queue_open()) < 0 ||
+    epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, event.data.fd, &event) < 0
+  ) {
+    xcp_coroutine_wake_queue_close();
+    xcp_fd_close(reactor->epollFd);
+    free(reactor);
+    return XCP_ERR_ERRNO;
+  }
+
+  ThreadReactor = reactor;
+  return XCP_ERR_OK;
+}
+
+void xcp_reactor_destroy () {
+  XcpReactor *reactor = ThreadReactor;
+  if (!reactor)
+    return;
+
+  if (reactor->asyncIo)
+    xcp_async_io_destroy(reactor->asyncIo);
+  xcp_coroutine_wake_queue_close();
+  xcp_fd_close(reactor->epollFd);
+  free(reactor->fds);
+  free(reactor);
+  ThreadReactor = NULL;
+}
+
+bool xcp_reactor_is_active () {
+  return ThreadReactor != NULL;
+}
+
+bool xcp_reactor_can_suspend () {
+  return ThreadReactor && xcp_coroutine_in_coroutine();
+}
+
+static void xcp_reactor_expire_waiter (void *userData) {
+  XcpReactorWaiter *waiter = userData;
+  XcpReactor *reactor = ThreadReactor;
+
+  waiter->expired = true;
+  xcp_reactor_detach(&reactor->fds[waiter->fd], waiter);
+  xcp_reactor_detach_cancel(waiter);
+  --reactor->waiterCount;
+  xcp_coroutine_wake(waiter->coroutine);
+}
+
+XcpError xcp_reactor_wait_fd (int fd, int events, int timeout) {
+  XcpCancel *cancel = xcp_cancel_get_current();
+  if (cancel) {
+    const XcpError ret = xcp_cancel_check(cancel);
+    if (ret != XCP_ERR_OK)
+      return ret;
+    timeout = xcp_cancel_get_timeout(cancel, timeout);
+  }
+
+  if (!timeout || !xcp_reactor_can_suspend())
+    return xcp_reactor_poll_fd(fd, events, timeout, cancel);
+
+  if (fd < 0 || !(events & (POLLIN | POLLOUT))) {
+    errno = fd < 0 ? EBADF : EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  // Get the entry of the token first: the fd array can be reallocated.
+  XcpReactor *reactor = ThreadReactor;
+  if (cancel && !xcp_reactor_get_fd(reactor, cancel->eventFd))
+    return XCP_ERR_ERRNO;
+
+  XcpReactorFd *entry = xcp_reactor_get_fd(reactor, fd);
+  if (!entry)
+    return XCP_ERR_ERRNO;
+
+  if (((events & POLLIN) && entry->reader) || ((events & POLLOUT) && entry->writer)) {
+    errno = EBUSY;
+    return XCP_ERR_ERRNO;
+  }
+
+  XcpReactorWaiter waiter;
+  waiter.coroutine = xcp_coroutine_get_self();
+  waiter.fd = fd;
+  xcp_timer_init(&waiter.timer, xcp_reactor_expire_waiter, &waiter);
+  waiter.expired = false;
+  waiter.ready = false;
+  waiter.cancel = NULL;
+  waiter.cancelled = false;
+
+  if (events & POLLIN)
+    entry->reader = &waiter;
+  if (events & POLLOUT)
+    entry->writer = &waiter;
+
+  if (xcp_reactor_arm(reactor, fd, entry) != XCP_ERR_OK) {
+    xcp_reactor_detach(entry, &waiter);
+    // Regular files are not supported by epoll but are always ready.
+    return errno == EPERM ? XCP_ERR_OK : XCP_ERR_ERRNO;
+  }
+
+  if (cancel) {
+    XcpReactorFd *cancelEntry = &reactor->fds[cancel->eventFd];
+    waiter.cancel = cancel;
+    LIST_INSERT_HEAD(&cancelEntry->cancelWaiters, &waiter, cancelEntry);
+    if (xcp_reactor_arm(reactor, cancel->eventFd, cancelEntry) != XCP_ERR_OK) {
+      xcp_reactor_detach(entry, &waiter);
+      xcp_reactor_detach_cancel(&waiter);
+      return XCP_ERR_ERRNO;
+    }
+  }
+
+  if (timeout > 0) {
+    waiter.timer.deadline = xcp_timer_now() + timeout;
+    xcp_timer_wheel_add(&reactor->timers, &waiter.timer);
+  }
+  ++reactor->waiterCount;
+
+  xcp_coroutine_yield();
+
+  if (waiter.cancelled) {
+    errno = ECANCELED;
+    return XCP_ERR_ERRNO;
+  }
+  if (waiter.expired) {
+    errno = ETIMEDOUT;
+    return XCP_ERR_TIMEOUT;
+  }
+  return XCP_ERR_OK;
+}
+
+// -----------------------------------------------------------------------------
+
+static XcpAsyncIo *xcp_reactor_get_async_io (XcpReactor *reactor) {
+  if (XCP_LIKELY(reactor->asyncIo))
+    return reactor->asyncIo;
+
+  XcpAsyncIo *asyncIo = xcp_async_io_create();
+  if (!asyncIo)
+    return NULL;
+
+  // Completions are notified by a level-triggered fd.
+  struct epoll_event event = { 0 };
+  event.events = EPOLLIN;
+  event.data.fd = xcp_async_io_get_fd(asyncIo);
+  if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, event.data.fd, &event) < 0) {
+    xcp_async_io_destroy(asyncIo);
+    return NULL;
+  }
+
+  reactor->asyncIoFd = event.data.fd;
+  return reactor->asyncIo = asyncIo;
+}
+
+XcpError xcp_reactor_queue_async_io (XcpAsyncIoOp *op) {
+  XcpAsyncIo *asyncIo;
+  if (!ThreadReactor) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+  if (!(asyncIo = xcp_reactor_get_async_io(ThreadReactor)))
+    return XCP_ERR_ERRNO;
+
+  xcp_async_io_queue(asyncIo, op);
+  ++ThreadReactor->waiterCount;
+  return XCP_ERR_OK;
+}
+
+static XcpError xcp_reactor_exec_async_io (XcpAsyncIoOp *op) {
+  XcpAsyncIo *asyncIo;
+  if (
+    !xcp_reactor_can_suspend() ||
+    xcp_async_io_is_sync(op) ||
+    !(asyncIo = xcp_reactor_get_async_io(ThreadReactor))
+  )
+    xcp_async_io_exec(op);
+  else {
+    // Submitted in one batch by the next loop iteration.
+    op->coroutine = xcp_coroutine_get_self();
+    xcp_async_io_queue(asyncIo, op);
+    ++ThreadReactor->waiterCount;
+
+    xcp_coroutine_yield();
+  }
+
+  if (op->result < 0) {
+    errno = (int)-op->result;
+    return XCP_ERR_ERRNO;
+  }
+  return op->result;
+}
+
+XcpError xcp_reactor_preadv (int fd, const struct iovec *iovs, size_t iovCount, off_t offset) {
+  return xcp_reactor_preadv2(fd, iovs, iovCount, offset, 0);
+}
+
+XcpError xcp_reactor_pwritev (int fd, const struct iovec *iovs, size_t iovCount, off_t offset) {
+  return xcp_reactor_pwritev2(fd, iovs, iovCount, offset, 0);
+}
+
+XcpError xcp_reactor_preadv2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags) {
+  XcpAsyncIoOp op = {
+    .type = XcpAsyncIoOpPreadv, .fd = fd, .iovs = iovs, .iovCount = (uint)iovCount, .offset = offset, .flags = flags
+  };
+  return xcp_reactor_exec_async_io(&op);
+}
+
+XcpError xcp_reactor_pwritev2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags) {
+  XcpAsyncIoOp op = {
+    .type = XcpAsyncIoOpPwritev, .fd = fd, .iovs = iovs, .iovCount = (uint)iovCount, .offset = offset, .flags = flags
+  };
+  return xcp_reactor_exec_async_io(&op);
+}
+
+XcpError xcp_reactor_fsync (int fd, bool dataOnly) {
+  XcpAsyncIoOp op = { .type = dataOnly ? XcpAsyncIoOpFdatasync : XcpAsyncIoOpFsync, .fd = fd };
+  return xcp_reactor_exec_async_io(&op);
+}
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_reactor_run_once (int timeout) {
+  XcpReactor *reactor = ThreadReactor;
+  if (!reactor || xcp_coroutine_in_coroutine()) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  // 1. Start the asynchronous I/O queued since the last iteration. On error, the operations
+  // are completed with it but the fd is not notified: reap them without waiting.
+  const XcpError submitted = reactor->asyncIo ? xcp_async_io_submit(reactor->asyncIo) : XCP_ERR_OK;
+  bool reap = submitted == XCP_ERR_ERRNO;
+  if (reap)
+    timeout = 0;
+  else if (submitted == XCP_ERR_AGAIN && (timeout < 0 || timeout > XCP_ASYNC_IO_RETRY_DELAY))
+    timeout = XCP_ASYNC_IO_RETRY_DELAY;
+
+  // 2. Do not wait after the next timer.
+  const longlong nextTick = xcp_timer_wheel_get_next_tick(&reactor->timers);
+  if (nextTick >= 0) {
+    const longlong remaining = XCP_MAX(nextTick - xcp_timer_now(), 0LL);
+    if (timeout < 0 || remaining < timeout)
+      timeout = (int)XCP_MIN(remaining, (longlong)INT_MAX);
+  }
+
+  struct epoll_event events[EVENTS_MAX_COUNT];
+  int count = epoll_wait(reactor->epollFd, events, EVENTS_MAX_COUNT, timeout);
+  if (count < 0) {
+    if (errno != EINTR)
+      return XCP_ERR_ERRNO;
+    count = 0;
+  }
+
+  // 3. Detach the waiters of the ready fds.
+  XcpReactorWaiter *waiter;
+  XcpReactorWaiter *readyList = NULL;
+  XcpAsyncIoOp *completedOps = NULL;
+  bool woken = false;
+  for (int i = 0; i < count; ++i) {
+    const int fd = events[i].data.fd;
+    if (reactor->asyncIo && fd == reactor->asyncIoFd) {
+      reap = true;
+      continue;
+    }
+    if (fd == reactor->wakeFd) {
+      woken = true;
+      continue;
+    }
+
+    const uint32_t revents = events[i].events;
+    XcpReactorFd *entry = &reactor->fds[fd];
+
+    // Cancelled token: interrupt its waiters. The eventfd stays readable.
+    while ((waiter = LIST_FIRST(&entry->cancelWaiters))) {
+      waiter->cancelled = true;
+      xcp_reactor_detach(&reactor->fds[waiter->fd], waiter);
+      xcp_reactor_set_ready(reactor, waiter, &readyList);
+    }
+
+    if ((waiter = entry->reader) && (revents & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+      xcp_reactor_detach(entry, waiter);
+      xcp_reactor_set_ready(reactor, waiter, &readyList);
+    }
+    if ((waiter = entry->writer) && (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+      xcp_reactor_detach(entry, waiter);
+      xcp_reactor_set_ready(reactor, waiter, &readyList);
+    }
+
+    // Wake up the remaining waiters if the fd cannot be re-armed.
+    if (xcp_reactor_arm(reactor, fd, entry) != XCP_ERR_OK) {
+      XcpReactorWaiter *reader = entry->reader;
+      XcpReactorWaiter *writer = entry->writer;
+      entry->reader = entry->writer = NULL;
+      if (reader)
+        xcp_reactor_set_ready(reactor, reader, &readyList);
+      if (writer && writer != reader)
+        xcp_reactor_set_ready(reactor, writer, &readyList);
+    }
+  }
+
+  if (reap)
+    completedOps = xcp_async_io_reap(reactor->asyncIo);
+
+  // 4. Execute the expired timers.
+  XcpError resumed = (XcpError)xcp_timer_wheel_advance(&reactor->timers, xcp_timer_now());
+
+  // 5. Resume!
+  while ((waiter = readyList)) {
+    readyList = waiter->nextReady;
+    xcp_coroutine_wake(waiter->coroutine);
+    ++resumed;
+  }
+
+  XcpAsyncIoOp *op;
+  while ((op = completedOps)) {
+    completedOps = op->next;
+    --reactor->waiterCount;
+    if (op->cb)
+      (*op->cb)(op);
+    else
+      xcp_coroutine_wake(op->coroutine);
+    ++resumed;
+  }
+
+  if (woken)
+    resumed += (XcpError)xcp_coroutine_wake_queue_drain();
+
+  return resumed;
+}
+
+XcpError xcp_reactor_run () {
+  XcpReactor *reactor = ThreadReactor;
+  if (!reactor) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  reactor->stop = false;
+  while (!reactor->stop && (reactor->waiterCount || reactor->timers.count || xcp_coroutine_get_parked_count()))
+    if (xcp_reactor_run_once(-1) < 0)
+      return XCP_ERR_ERRNO;
+  return XCP_ERR_OK;
+}
+
+void xcp_reactor_stop () {
+  if (ThreadReactor)
+    ThreadReactor->stop = true;
+}
+
+// -----------------------------------------------------------------------------
+// Timers.
+// -----------------------------------------------------------------------------
+
+longlong xcp_timer_now () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (longlong)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void xcp_timer_init (XcpTimer *timer, XcpTimerCb cb, void *userData) {
+  timer->deadline = 0;
+  timer->cb = cb;
+  timer->userData = userData;
+  timer->level = 0;
+  timer->slot = 0;
+  timer->active = false;
+}
+
+XcpError xcp_timer_start (XcpTimer *timer, longlong delay) {
+  return xcp_timer_start_at(timer, xcp_timer_now() + XCP_MAX(delay, 0LL));
+}
+
+XcpError xcp_timer_start_at (XcpTimer *timer, longlong deadline) {
+  XcpReactor *reactor = ThreadReactor;
+  if (!reactor) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  if (timer->active)
+    xcp_timer_wheel_remove(&reactor->timers, timer);
+  timer->deadline = deadline;
+  xcp_timer_wheel_add(&reactor->timers, timer);
+  return XCP_ERR_OK;
+}
+
+bool xcp_timer_cancel (XcpTimer *timer) {
+  if (!timer->active)
+    return false;
+
+  xcp_timer_wheel_remove(&ThreadReactor->timers, timer);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+
+static void xcp_reactor_wake_sleeper (void *userData) {
+  xcp_coroutine_wake(userData);
+}
+
+XcpError xcp_coroutine_sleep_ms (longlong delay) {
+  return xcp_coroutine_sleep_until(xcp_timer_now() + XCP_MAX(delay, 0LL));
+}
+
+XcpError xcp_coroutine_sleep_until (longlong deadline) {
+  if (!xcp_reactor_can_suspend()) {
+    const struct timespec ts = { (time_t)(deadline / 1000), (long)(deadline % 1000) * 1000000L };
+    int ret;
+    while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR);
+    if (ret) {
+      errno = ret;
+      return XCP_ERR_ERRNO;
+    }
+    return XCP_ERR_OK;
+  }
+
+  XcpTimer timer;
+  xcp_timer_init(&timer, xcp_reactor_wake_sleeper, xcp_coroutine_get_self());
+  timer.deadline = deadline;
+  xcp_timer_wheel_add(&ThreadReactor->timers, &timer);
+
+  xcp_coroutine_yield();
+  return XCP_ERR_OK;
+}
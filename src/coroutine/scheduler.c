@@ -0,0 +1,590 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "coroutine/coroutine-private.h"
+#include "xcp-ng/generic/scheduler.h"
+
+// =============================================================================
+
+#define CACHE_LINE_SIZE 64
+
+#define DEQUE_INITIAL_SIZE 256
+
+// Check the global queue from time to time even if the local queue is not empty
+// to avoid starvation.
+#define GLOBAL_QUEUE_INTERVAL 61
+
+#define STEAL_RETRY_COUNT 4
+
+// -----------------------------------------------------------------------------
+// Chase-Lev deque.
+// See: https://fzn.fr/readings/ppopp13.pdf
+// The owner pushes and takes at the bottom, the thieves steal at the top.
+// -----------------------------------------------------------------------------
+
+typedef struct XcpDequeArray {
+  int64_t size;
+
+  // Retired arrays: thieves may still read them, they are released with the deque.
+  struct XcpDequeArray *previous;
+
+  _Atomic(XcpCoroutine *) buffer[];
+} XcpDequeArray;
+
+typedef struct {
+  _Alignas(CACHE_LINE_SIZE) _Atomic int64_t top;
+  _Alignas(CACHE_LINE_SIZE) _Atomic int64_t bottom;
+  _Atomic(XcpDequeArray *) array;
+} XcpDeque;
+
+static XcpDequeArray *xcp_deque_array_create (int64_t size) {
+  XcpDequeArray *array = malloc(sizeof *array + (size_t)size * sizeof array->buffer[0]);
+  if (array) {
+    array->size = size;
+    array->previous = NULL;
+  }
+  return array;
+}
+
+static XcpError xcp_deque_init (XcpDeque *deque) {
+  XcpDequeArray *array = xcp_deque_array_create(DEQUE_INITIAL_SIZE);
+  if (!array)
+    return XCP_ERR_ERRNO;
+
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  atomic_init(&deque->array, array);
+  return XCP_ERR_OK;
+}
+
+static void xcp_deque_uninit (XcpDeque *deque) {
+  XcpDequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  while (array) {
+    XcpDequeArray *previous = array->previous;
+    free(array);
+    array = previous;
+  }
+}
+
+static inline bool xcp_deque_is_empty (XcpDeque *deque) {
+  return atomic_load_explicit(&deque->bottom, memory_order_acquire) <=
+    atomic_load_explicit(&deque->top, memory_order_acquire);
+}
+
+static bool xcp_deque_push (XcpDeque *deque, XcpCoroutine *coroutine) {
+  const int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  const int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  XcpDequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+  if (b - t > array->size - 1) {
+    XcpDequeArray *newArray = xcp_deque_array_create(array->size * 2);
+    if (!newArray)
+      return false;
+
+    for (int64_t i = t; i < b; ++i)
+      atomic_store_explicit(
+        &newArray->buffer[i & (newArray->size - 1)],
+        atomic_load_explicit(&array->buffer[i & (array->size - 1)], memory_order_relaxed),
+        memory_order_relaxed
+      );
+    newArray->previous = array;
+    atomic_store_explicit(&deque->array, newArray, memory_order_release);
+    array = newArray;
+  }
+
+  atomic_store_explicit(&array->buffer[b & (array->size - 1)], coroutine, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+  return true;
+}
+
+static XcpCoroutine *xcp_deque_take (XcpDeque *deque) {
+  const int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  XcpDequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  XcpCoroutine *coroutine = NULL;
+  if (t <= b) {
+    coroutine = atomic_load_explicit(&array->buffer[b & (array->size - 1)], memory_order_relaxed);
+    if (t == b) {
+      // Last element: race with the thieves.
+      if (!atomic_compare_exchange_strong_explicit(
+        &deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+      ))
+        coroutine = NULL;
+      atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+  } else
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+
+  return coroutine;
+}
+
+// Return NULL if the deque is empty or if the steal failed, `*retry` is set in the last case.
+static XcpCoroutine *xcp_deque_steal (XcpDeque *deque, bool *retry) {
+  int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  const int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  *retry = false;
+  if (t >= b)
+    return NULL;
+
+  XcpDequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+  XcpCoroutine *coroutine = atomic_load_explicit(&array->buffer[t & (array->size - 1)], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(
+    &deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed
+  )) {
+    *retry = true;
+    return NULL;
+  }
+
+  return coroutine;
+}
+
+// -----------------------------------------------------------------------------
+
+typedef STAILQ_HEAD(XcpCoroutineQueue, XcpCoroutine) XcpCoroutineQueue;
+
+typedef struct {
+  XcpDeque deque;
+
+  XcpScheduler *scheduler;
+  uint index;
+  pthread_t thread;
+
+  // Protect the inbox and the sleep state.
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // Coroutines pinned to this worker.
+  XcpCoroutineQueue inbox;
+  atomic_size_t inboxSize;
+
+  atomic_bool sleeping;
+  bool notified;
+
+  uint tick;
+  uint seed;
+} XcpSchedulerWorker;
+
+struct XcpScheduler {
+  XcpSchedulerWorker *workers;
+  uint workerCount;
+
+  // Protect the global queue and the idle condition.
+  pthread_mutex_t mutex;
+  pthread_cond_t idleCond;
+
+  // Coroutines woken by non-worker threads or yielded.
+  XcpCoroutineQueue queue;
+  atomic_size_t queueSize;
+
+  atomic_size_t coroutineCount;
+  atomic_uint sleepingCount;
+  atomic_bool stop;
+};
+
+static __thread XcpSchedulerWorker *CurrentWorker;
+
+// -----------------------------------------------------------------------------
+
+static XcpCoroutine *xcp_scheduler_pop_global (XcpScheduler *scheduler) {
+  if (!atomic_load_explicit(&scheduler->queueSize, memory_order_relaxed))
+    return NULL;
+
+  pthread_mutex_lock(&scheduler->mutex);
+  XcpCoroutine *coroutine = STAILQ_FIRST(&scheduler->queue);
+  if (coroutine) {
+    STAILQ_REMOVE_HEAD(&scheduler->queue, next);
+    atomic_fetch_sub_explicit(&scheduler->queueSize, 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  return coroutine;
+}
+
+static void xcp_scheduler_push_global (XcpScheduler *scheduler, XcpCoroutine *coroutine) {
+  pthread_mutex_lock(&scheduler->mutex);
+  STAILQ_INSERT_TAIL(&scheduler->queue, coroutine, next);
+  atomic_fetch_add_explicit(&scheduler->queueSize, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+static XcpCoroutine *xcp_scheduler_pop_inbox (XcpSchedulerWorker *worker) {
+  if (!atomic_load_explicit(&worker->inboxSize, memory_order_relaxed))
+    return NULL;
+
+  pthread_mutex_lock(&worker->mutex);
+  XcpCoroutine *coroutine = STAILQ_FIRST(&worker->inbox);
+  if (coroutine) {
+    STAILQ_REMOVE_HEAD(&worker->inbox, next);
+    atomic_fetch_sub_explicit(&worker->inboxSize, 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+
+  return coroutine;
+}
+
+static void xcp_scheduler_push_inbox (XcpSchedulerWorker *worker, XcpCoroutine *coroutine) {
+  pthread_mutex_lock(&worker->mutex);
+  STAILQ_INSERT_TAIL(&worker->inbox, coroutine, next);
+  atomic_fetch_add_explicit(&worker->inboxSize, 1, memory_order_relaxed);
+  if (atomic_load_explicit(&worker->sleeping, memory_order_relaxed)) {
+    worker->notified = true;
+    pthread_cond_signal(&worker->cond);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+// Wake up one sleeping worker after new stealable work was published.
+static void xcp_scheduler_notify (XcpScheduler *scheduler) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&scheduler->sleepingCount, memory_order_relaxed))
+    return;
+
+  for (uint i = 0; i < scheduler->workerCount; ++i) {
+    XcpSchedulerWorker *worker = &scheduler->workers[i];
+    if (!atomic_load_explicit(&worker->sleeping, memory_order_relaxed))
+      continue;
+
+    pthread_mutex_lock(&worker->mutex);
+    const bool found = atomic_load_explicit(&worker->sleeping, memory_order_relaxed) && !worker->notified;
+    if (found) {
+      worker->notified = true;
+      pthread_cond_signal(&worker->cond);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (found)
+      return;
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static XcpCoroutine *xcp_scheduler_steal (XcpSchedulerWorker *worker) {
+  XcpScheduler *scheduler = worker->scheduler;
+  const uint count = scheduler->workerCount;
+
+  // Xorshift to choose the first victim.
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 17;
+  worker->seed ^= worker->seed << 5;
+
+  const uint start = worker->seed % count;
+  for (uint i = 0; i < count; ++i) {
+    XcpSchedulerWorker *victim = &scheduler->workers[(start + i) % count];
+    if (victim == worker)
+      continue;
+
+    for (int retryCount = 0; retryCount < STEAL_RETRY_COUNT; ++retryCount) {
+      bool retry;
+      XcpCoroutine *coroutine = xcp_deque_steal(&victim->deque, &retry);
+      if (coroutine)
+        return coroutine;
+      if (!retry)
+        break;
+    }
+  }
+
+  return NULL;
+}
+
+static bool xcp_scheduler_has_work (XcpSchedulerWorker *worker) {
+  XcpScheduler *scheduler = worker->scheduler;
+  if (
+    atomic_load(&worker->inboxSize) ||
+    atomic_load(&scheduler->queueSize) ||
+    atomic_load(&scheduler->stop)
+  )
+    return true;
+
+  for (uint i = 0; i < scheduler->workerCount; ++i)
+    if (!xcp_deque_is_empty(&scheduler->workers[i].deque))
+      return true;
+  return false;
+}
+
+static XcpCoroutine *xcp_scheduler_find_work (XcpSchedulerWorker *worker) {
+  XcpScheduler *scheduler = worker->scheduler;
+  XcpCoroutine *coroutine;
+
+  if (++worker->tick % GLOBAL_QUEUE_INTERVAL == 0 && (coroutine = xcp_scheduler_pop_global(scheduler)))
+    return coroutine;
+
+  if (
+    (coroutine = xcp_scheduler_pop_inbox(worker)) ||
+    (coroutine = xcp_deque_take(&worker->deque)) ||
+    (coroutine = xcp_scheduler_pop_global(scheduler))
+  )
+    return coroutine;
+
+  return xcp_scheduler_steal(worker);
+}
+
+static void xcp_scheduler_sleep (XcpSchedulerWorker *worker) {
+  XcpScheduler *scheduler = worker->scheduler;
+
+  pthread_mutex_lock(&worker->mutex);
+
+  // Announce the sleep before the last check: a publisher either sees the sleeping
+  // worker or its work is seen by the check.
+  atomic_store(&worker->sleeping, true);
+  atomic_fetch_add(&scheduler->sleepingCount, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (!xcp_scheduler_has_work(worker))
+    while (!worker->notified && !atomic_load(&scheduler->stop))
+      pthread_cond_wait(&worker->cond, &worker->mutex);
+
+  worker->notified = false;
+  atomic_fetch_sub(&scheduler->sleepingCount, 1);
+  atomic_store(&worker->sleeping, false);
+
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+static void *xcp_scheduler_worker_run (void *data) {
+  XcpSchedulerWorker *worker = data;
+  XcpScheduler *scheduler = worker->scheduler;
+  CurrentWorker = worker;
+
+  while (!atomic_load_explicit(&scheduler->stop, memory_order_relaxed)) {
+    XcpCoroutine *coroutine = xcp_scheduler_find_work(worker);
+    if (coroutine)
+      xcp_coroutine_resume(coroutine);
+    else
+      xcp_scheduler_sleep(worker);
+  }
+
+  CurrentWorker = NULL;
+  return NULL;
+}
+
+// -----------------------------------------------------------------------------
+
+void xcp_scheduler_attach (XcpScheduler *scheduler, XcpCoroutine *coroutine) {
+  coroutine->scheduler = scheduler;
+  atomic_fetch_add(&scheduler->coroutineCount, 1);
+}
+
+void xcp_scheduler_enqueue (XcpScheduler *scheduler, XcpCoroutine *coroutine) {
+  if (coroutine->pinnedWorker >= 0) {
+    xcp_scheduler_push_inbox(&scheduler->workers[coroutine->pinnedWorker], coroutine);
+    return;
+  }
+
+  XcpSchedulerWorker *worker = CurrentWorker;
+  if (!worker || worker->scheduler != scheduler || !xcp_deque_push(&worker->deque, coroutine))
+    xcp_scheduler_push_global(scheduler, coroutine);
+  xcp_scheduler_notify(scheduler);
+}
+
+void xcp_scheduler_detach (XcpScheduler *scheduler) {
+  if (atomic_fetch_sub(&scheduler->coroutineCount, 1) == 1) {
+    pthread_mutex_lock(&scheduler->mutex);
+    pthread_cond_broadcast(&scheduler->idleCond);
+    pthread_mutex_unlock(&scheduler->mutex);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+static void xcp_scheduler_stop (XcpScheduler *scheduler, uint workerCount) {
+  atomic_store(&scheduler->stop, true);
+
+  for (uint i = 0; i < workerCount; ++i) {
+    XcpSchedulerWorker *worker = &scheduler->workers[i];
+    pthread_mutex_lock(&worker->mutex);
+    worker->notified = true;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+  }
+
+  for (uint i = 0; i < workerCount; ++i) {
+    XcpSchedulerWorker *worker = &scheduler->workers[i];
+    pthread_join(worker->thread, NULL);
+  }
+}
+
+static void xcp_scheduler_free (XcpScheduler *scheduler, uint workerCount) {
+  for (uint i = 0; i < workerCount; ++i) {
+    XcpSchedulerWorker *worker = &scheduler->workers[i];
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    xcp_deque_uninit(&worker->deque);
+  }
+
+  pthread_cond_destroy(&scheduler->idleCond);
+  pthread_mutex_destroy(&scheduler->mutex);
+  free(scheduler->workers);
+  free(scheduler);
+}
+
+XcpScheduler *xcp_scheduler_create (uint workerCount) {
+  if (!workerCount) {
+    const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = cpuCount > 0 ? (uint)cpuCount : 1;
+  }
+
+  XcpScheduler *scheduler = calloc(1, sizeof *scheduler);
+  if (!scheduler)
+    return NULL;
+
+  if (!(scheduler->workers = aligned_alloc(CACHE_LINE_SIZE, workerCount * sizeof *scheduler->workers))) {
+    free(scheduler);
+    return NULL;
+  }
+  scheduler->workerCount = workerCount;
+
+  pthread_mutex_init(&scheduler->mutex, NULL);
+  pthread_cond_init(&scheduler->idleCond, NULL);
+  STAILQ_INIT(&scheduler->queue);
+  atomic_init(&scheduler->queueSize, 0);
+  atomic_init(&scheduler->coroutineCount, 0);
+  atomic_init(&scheduler->sleepingCount, 0);
+  atomic_init(&scheduler->stop, false);
+
+  // 1. Initialize all workers before starting them: they can steal from each other.
+  uint count = 0;
+  for (; count < workerCount; ++count) {
+    XcpSchedulerWorker *worker = &scheduler->workers[count];
+    if (xcp_deque_init(&worker->deque) != XCP_ERR_OK)
+      break;
+
+    worker->scheduler = scheduler;
+    worker->index = count;
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    STAILQ_INIT(&worker->inbox);
+    atomic_init(&worker->inboxSize, 0);
+    atomic_init(&worker->sleeping, false);
+    worker->notified = false;
+    worker->tick = 0;
+    worker->seed = count * 2654435761U + 1;
+  }
+
+  if (count < workerCount) {
+    xcp_scheduler_free(scheduler, count);
+    return NULL;
+  }
+
+  // 2. Start them.
+  for (count = 0; count < workerCount; ++count) {
+    XcpSchedulerWorker *worker = &scheduler->workers[count];
+    const int ret = pthread_create(&worker->thread, NULL, xcp_scheduler_worker_run, worker);
+    if (ret) {
+      xcp_scheduler_stop(scheduler, count);
+      xcp_scheduler_free(scheduler, workerCount);
+      errno = ret;
+      return NULL;
+    }
+  }
+
+  return scheduler;
+}
+
+void xcp_scheduler_destroy (XcpScheduler *scheduler) {
+  xcp_scheduler_stop(scheduler, scheduler->workerCount);
+  xcp_scheduler_free(scheduler, scheduler->workerCount);
+}
+
+uint xcp_scheduler_get_worker_count (const XcpScheduler *scheduler) {
+  return scheduler->workerCount;
+}
+
+static XcpError xcp_scheduler_spawn_pinned (XcpScheduler *scheduler, int worker, XcpCoroutineCb cb, void *userData) {
+  XcpCoroutine *coroutine = xcp_coroutine_create(cb, userData);
+  if (!coroutine)
+    return XCP_ERR_ERRNO;
+
+  coroutine->pinnedWorker = worker;
+  xcp_scheduler_attach(scheduler, coroutine);
+  xcp_coroutine_stats_set_ready(coroutine);
+  xcp_scheduler_enqueue(scheduler, coroutine);
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_scheduler_spawn (XcpScheduler *scheduler, XcpCoroutineCb cb, void *userData) {
+  return xcp_scheduler_spawn_pinned(scheduler, -1, cb, userData);
+}
+
+XcpError xcp_scheduler_spawn_on (XcpScheduler *scheduler, uint worker, XcpCoroutineCb cb, void *userData) {
+  if (worker >= scheduler->workerCount) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+  return xcp_scheduler_spawn_pinned(scheduler, (int)worker, cb, userData);
+}
+
+void xcp_scheduler_wait (XcpScheduler *scheduler) {
+  pthread_mutex_lock(&scheduler->mutex);
+  while (atomic_load(&scheduler->coroutineCount))
+    pthread_cond_wait(&scheduler->idleCond, &scheduler->mutex);
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+int xcp_scheduler_get_current_worker () {
+  const XcpSchedulerWorker *worker = CurrentWorker;
+  return worker ? (int)worker->index : -1;
+}
+
+// -----------------------------------------------------------------------------
+
+static void xcp_scheduler_requeue (void *userData) {
+  XcpCoroutine *coroutine = userData;
+  XcpScheduler *scheduler = coroutine->scheduler;
+
+  // Yielded coroutines go at the end of the global queue to let the others run.
+  xcp_coroutine_stats_set_ready(coroutine);
+  if (coroutine->pinnedWorker >= 0)
+    xcp_scheduler_push_inbox(&scheduler->workers[coroutine->pinnedWorker], coroutine);
+  else {
+    xcp_scheduler_push_global(scheduler, coroutine);
+    xcp_scheduler_notify(scheduler);
+  }
+}
+
+void xcp_scheduler_yield () {
+  XcpCoroutine *self = xcp_coroutine_get_self();
+  if (self->scheduler)
+    xcp_coroutine_park(xcp_scheduler_requeue, self);
+}
+
+XcpError xcp_scheduler_pin (int worker) {
+  XcpCoroutine *self = xcp_coroutine_get_self();
+  XcpScheduler *scheduler = self->scheduler;
+  if (!scheduler || worker < -1 || worker >= (int)scheduler->workerCount) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  self->pinnedWorker = worker;
+  if (worker >= 0 && CurrentWorker != &scheduler->workers[worker])
+    xcp_coroutine_park(xcp_scheduler_requeue, self);
+  return XCP_ERR_OK;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_COROUTINE_SPINLOCK_H_
+#define _XCP_NG_COROUTINE_SPINLOCK_H_
+
+#include <sched.h>
+
+// =============================================================================
+
+// Minimal spinlock used to protect the wait lists of the coroutine primitives.
+// The critical sections are short and never suspend a coroutine.
+
+#define XCP_SPIN_COUNT 64
+
+static inline void xcp_spin_lock (int *spinlock) {
+  for (;;) {
+    for (int i = 0; i < XCP_SPIN_COUNT; ++i) {
+      if (
+        !__atomic_load_n(spinlock, __ATOMIC_RELAXED) &&
+        !__atomic_exchange_n(spinlock, 1, __ATOMIC_ACQUIRE)
+      )
+        return;
+      #if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+      #endif // if defined(__x86_64__) || defined(__i386__)
+    }
+    // The owner was probably preempted.
+    sched_yield();
+  }
+}
+
+static inline void xcp_spin_unlock (int *spinlock) {
+  __atomic_store_n(spinlock, 0, __ATOMIC_RELEASE);
+}
+
+#endif // _XCP_NG_COROUTINE_SPINLOCK_H_ included
@@ -0,0 +1,372 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "coroutine/async-io.h"
+#include "xcp-ng/generic/math.h"
+#include "xcp-ng/generic/reactor.h"
+#include "xcp-ng/generic/stream-reader.h"
+
+// =============================================================================
+
+// Alignment of the buffers, compatible with O_DIRECT.
+#define BUFFER_ALIGNMENT 4096UL
+
+// Chunks read asynchronously without O_DIRECT: the current one and the next one.
+#define BUFFERED_IN_FLIGHT_COUNT 2U
+
+typedef struct {
+  XcpAsyncIoOp op; // Must be the first member.
+  struct iovec iov;
+
+  char *buf;
+  off_t offset;
+  size_t size;
+  size_t filled;
+
+  bool done;
+  int error;
+} XcpStreamChunk;
+
+struct XcpStreamReader {
+  int fd;
+  bool direct;
+
+  // Engine of the reader: the reads are in flight between the calls, they must be completed
+  // without the loop of a reactor. NULL if the engine cannot be created: the chunks are read
+  // synchronously.
+  XcpAsyncIo *asyncIo;
+  uint inFlightCount;
+
+  size_t chunkSize;
+  uint window;
+  uint minWindow;
+  uint maxWindow;
+  uint streak; // Chunks ready when requested.
+
+  // Ring of the chunks read ahead, `chunks[head]` is held by the caller if `held` is true.
+  XcpStreamChunk *chunks;
+  uint chunkCount;
+  uint head;
+  uint count;
+  bool held;
+
+  off_t nextOffset;
+  off_t end; // -1 => EOF.
+  off_t hintEnd; // End of the readahead hints.
+  bool eof;
+  int error;
+
+  XcpStreamReaderStats stats;
+};
+
+// -----------------------------------------------------------------------------
+
+static inline XcpStreamChunk *xcp_stream_reader_get_chunk (const XcpStreamReader *reader, uint index) {
+  return &reader->chunks[(reader->head + index) % reader->chunkCount];
+}
+
+static void xcp_stream_chunk_prepare (XcpStreamChunk *chunk) {
+  chunk->iov.iov_base = chunk->buf + chunk->filled;
+  chunk->iov.iov_len = chunk->size - chunk->filled;
+  chunk->op.iovs = &chunk->iov;
+  chunk->op.iovCount = 1;
+  chunk->op.offset = chunk->offset + (off_t)chunk->filled;
+}
+
+// Handle the result of a read. Return true if the remaining part of a short read must be read.
+static bool xcp_stream_chunk_complete (XcpStreamChunk *chunk) {
+  const ssize_t result = chunk->op.result;
+  if (result > 0) {
+    chunk->filled += (size_t)result;
+    if (chunk->filled < chunk->size) {
+      xcp_stream_chunk_prepare(chunk);
+      return true;
+    }
+  } else if (result < 0)
+    chunk->error = (int)-result;
+
+  chunk->done = true;
+  return false;
+}
+
+// Ask the kernel to fill the page cache `window` chunks ahead of the read position.
+static void xcp_stream_reader_hint (XcpStreamReader *reader, off_t offset) {
+  off_t target = offset + (off_t)(reader->window * reader->chunkSize);
+  if (reader->end >= 0)
+    target = XCP_MIN(target, reader->end);
+
+  if (target > reader->hintEnd) {
+    const off_t begin = XCP_MAX(reader->hintEnd, offset);
+    readahead(reader->fd, begin, (size_t)(target - begin));
+    reader->hintEnd = target;
+  }
+}
+
+// Start the reads of the next chunks.
+static void xcp_stream_reader_fill (XcpStreamReader *reader) {
+  // The chunk of the caller is already released.
+  const uint maxCount = reader->direct ? reader->window : BUFFERED_IN_FLIGHT_COUNT;
+
+  while (!reader->eof && reader->count < maxCount) {
+    size_t size = reader->chunkSize;
+    if (reader->end >= 0)
+      size = (size_t)XCP_MIN((off_t)size, reader->end - reader->nextOffset);
+    if (!size)
+      break;
+
+    XcpStreamChunk *chunk = xcp_stream_reader_get_chunk(reader, reader->count++);
+    chunk->offset = reader->nextOffset;
+    chunk->size = size;
+    chunk->filled = 0;
+    chunk->done = false;
+    chunk->error = 0;
+    chunk->op.type = XcpAsyncIoOpPreadv;
+    chunk->op.fd = reader->fd;
+    xcp_stream_chunk_prepare(chunk);
+    reader->nextOffset += (off_t)size;
+
+    if (reader->asyncIo) {
+      xcp_async_io_queue(reader->asyncIo, &chunk->op);
+      ++reader->inFlightCount;
+    }
+  }
+
+  if (!reader->direct)
+    xcp_stream_reader_hint(reader, reader->nextOffset);
+}
+
+// Submit the queued reads and handle the completions. If `wait` is true, wait for at least
+// one completion before: the caller is suspended if possible, otherwise poll(2) is used.
+// After a submit error, the reads which cannot be started are completed with the error and
+// the short reads are not continued: the in-flight count always decreases.
+static XcpError xcp_stream_reader_process (XcpStreamReader *reader, bool wait, bool suspend) {
+  int error = 0;
+  const XcpError submitted = xcp_async_io_submit(reader->asyncIo);
+  if (submitted == XCP_ERR_ERRNO)
+    error = errno;
+
+  XcpAsyncIoOp *op = xcp_async_io_reap(reader->asyncIo);
+  if (!op && wait && !error) {
+    // Reads not accepted by the kernel: the fd may never be notified.
+    const int fd = xcp_async_io_get_fd(reader->asyncIo);
+    const int timeout = submitted == XCP_ERR_AGAIN ? XCP_ASYNC_IO_RETRY_DELAY : -1;
+    if (suspend) {
+      const XcpError ret = xcp_reactor_wait_fd(fd, POLLIN, timeout);
+      if (ret != XCP_ERR_OK && (ret != XCP_ERR_TIMEOUT || timeout < 0))
+        return ret;
+    } else {
+      struct pollfd pfd = { .fd = fd, .events = POLLIN };
+      while (poll(&pfd, 1, timeout) < 0 && errno == EINTR);
+    }
+    op = xcp_async_io_reap(reader->asyncIo);
+  }
+
+  while (op) {
+    XcpAsyncIoOp *next = op->next;
+    XcpStreamChunk *chunk = (XcpStreamChunk *)op;
+    --reader->inFlightCount;
+    if (xcp_stream_chunk_complete(chunk)) {
+      if (error) {
+        chunk->error = error;
+        chunk->done = true;
+      } else {
+        xcp_async_io_queue(reader->asyncIo, op);
+        ++reader->inFlightCount;
+      }
+    }
+    op = next;
+  }
+
+  if (error) {
+    errno = error;
+    return XCP_ERR_ERRNO;
+  }
+  return XCP_ERR_OK;
+}
+
+static XcpError xcp_stream_reader_wait (XcpStreamReader *reader, XcpStreamChunk *chunk) {
+  if (!reader->asyncIo) {
+    do {
+      xcp_async_io_exec(&chunk->op);
+    } while (xcp_stream_chunk_complete(chunk));
+    return XCP_ERR_OK;
+  }
+
+  XcpError ret = xcp_stream_reader_process(reader, false, false);
+  while (ret == XCP_ERR_OK && !chunk->done)
+    ret = xcp_stream_reader_process(reader, true, true);
+  return ret;
+}
+
+// Double the window after a stall, halve it when the reads are always ahead.
+static void xcp_stream_reader_adapt (XcpStreamReader *reader, bool stall) {
+  if (stall) {
+    ++reader->stats.stallCount;
+    reader->streak = 0;
+    reader->window = XCP_MIN(reader->window * 2, reader->maxWindow);
+  } else if (++reader->streak >= reader->window * 4) {
+    reader->streak = 0;
+    reader->window = XCP_MAX(reader->window / 2, reader->minWindow);
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+XcpStreamReader *xcp_stream_reader_create (
+  int fd,
+  off_t offset,
+  off_t length,
+  const XcpStreamReaderAttr *attr
+) {
+  const XcpStreamReaderAttr defaultAttr = { 0 };
+  if (!attr)
+    attr = &defaultAttr;
+
+  const uint minWindow = attr->minWindow ? attr->minWindow : XCP_STREAM_READER_MIN_WINDOW;
+  const uint maxWindow = attr->maxWindow ? attr->maxWindow : XCP_STREAM_READER_MAX_WINDOW;
+  if (offset < 0 || (length < 0 && length != XCP_STREAM_READER_TO_EOF) || minWindow > maxWindow) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags < 0)
+    return NULL;
+
+  XcpStreamReader *reader = calloc(1, sizeof *reader);
+  if (!reader)
+    return NULL;
+
+  reader->fd = fd;
+  reader->direct = flags & O_DIRECT;
+  reader->chunkSize = XCP_ROUND_UP_2(
+    attr->chunkSize ? attr->chunkSize : XCP_STREAM_READER_CHUNK_SIZE, BUFFER_ALIGNMENT
+  );
+  reader->window = minWindow;
+  reader->minWindow = minWindow;
+  reader->maxWindow = maxWindow;
+  reader->nextOffset = offset;
+  reader->end = length == XCP_STREAM_READER_TO_EOF ? -1 : offset + length;
+  reader->hintEnd = offset;
+
+  // One more chunk for the caller.
+  reader->chunkCount = (reader->direct ? maxWindow : BUFFERED_IN_FLIGHT_COUNT) + 1;
+  if (!(reader->chunks = calloc(reader->chunkCount, sizeof *reader->chunks)))
+    goto fail;
+
+  for (uint i = 0; i < reader->chunkCount; ++i) {
+    void *buf;
+    const int ret = posix_memalign(&buf, BUFFER_ALIGNMENT, reader->chunkSize);
+    if (ret) {
+      errno = ret;
+      goto fail;
+    }
+    reader->chunks[i].buf = buf;
+  }
+
+  if (!reader->direct)
+    posix_fadvise(fd, offset, length == XCP_STREAM_READER_TO_EOF ? 0 : length, POSIX_FADV_SEQUENTIAL);
+
+  // Optional: the chunks are read synchronously without engine.
+  reader->asyncIo = xcp_async_io_create();
+  return reader;
+
+fail:
+  xcp_stream_reader_destroy(reader);
+  return NULL;
+}
+
+void xcp_stream_reader_destroy (XcpStreamReader *reader) {
+  if (reader->asyncIo) {
+    // The buffers are used by the in-flight reads. A submit error completes the reads which
+    // are not started: only the started ones are waited.
+    while (reader->inFlightCount)
+      xcp_stream_reader_process(reader, true, false);
+    xcp_async_io_destroy(reader->asyncIo);
+  }
+
+  if (reader->chunks) {
+    for (uint i = 0; i < reader->chunkCount; ++i)
+      free(reader->chunks[i].buf);
+    free(reader->chunks);
+  }
+  free(reader);
+}
+
+XcpError xcp_stream_reader_next (XcpStreamReader *reader, const void **data) {
+  if (reader->error) {
+    errno = reader->error;
+    return XCP_ERR_ERRNO;
+  }
+
+  // Release the chunk of the caller.
+  if (reader->held) {
+    reader->head = (reader->head + 1) % reader->chunkCount;
+    --reader->count;
+    reader->held = false;
+  }
+
+  xcp_stream_reader_fill(reader);
+  if (!reader->count || reader->eof)
+    return 0;
+
+  XcpStreamChunk *chunk = xcp_stream_reader_get_chunk(reader, 0);
+  const bool stall = !chunk->done && (
+    !reader->asyncIo ||
+    xcp_stream_reader_process(reader, false, false) != XCP_ERR_OK ||
+    !chunk->done
+  );
+  if (stall) {
+    const XcpError ret = xcp_stream_reader_wait(reader, chunk);
+    if (ret != XCP_ERR_OK)
+      return ret;
+  }
+  // The first chunk cannot be read ahead.
+  if (reader->asyncIo && reader->stats.chunkCount)
+    xcp_stream_reader_adapt(reader, stall);
+
+  if (chunk->error) {
+    errno = reader->error = chunk->error;
+    return XCP_ERR_ERRNO;
+  }
+
+  // A short chunk is the last one.
+  if (chunk->filled < chunk->size)
+    reader->eof = true;
+  if (!chunk->filled)
+    return 0;
+
+  reader->held = true;
+  ++reader->stats.chunkCount;
+  reader->stats.byteCount += chunk->filled;
+
+  *data = chunk->buf;
+  return (XcpError)chunk->filled;
+}
+
+void xcp_stream_reader_get_stats (const XcpStreamReader *reader, XcpStreamReaderStats *stats) {
+  *stats = reader->stats;
+  stats->window = reader->window;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+
+#include "coroutine/timer-wheel.h"
+#include "xcp-ng/generic/math.h"
+
+// =============================================================================
+
+#define SLOT_MASK ((uint64_t)XCP_TIMER_WHEEL_SLOT_COUNT - 1)
+
+// Level of the timers in the expired list.
+#define EXPIRED_LEVEL 0xFF
+
+static inline uint64_t xcp_rotate_right (uint64_t value, uint shift) {
+  return shift ? (value >> shift) | (value << (64 - shift)) : value;
+}
+
+static inline uint xcp_timer_wheel_get_shift (uint level) {
+  return level * XCP_TIMER_WHEEL_BITS;
+}
+
+// -----------------------------------------------------------------------------
+
+void xcp_timer_wheel_init (XcpTimerWheel *wheel, longlong now) {
+  wheel->current = (uint64_t)XCP_MAX(now, 0LL);
+  wheel->count = 0;
+
+  for (uint level = 0; level < XCP_TIMER_WHEEL_LEVEL_COUNT; ++level) {
+    wheel->bitmaps[level] = 0;
+    for (uint slot = 0; slot < XCP_TIMER_WHEEL_SLOT_COUNT; ++slot)
+      LIST_INIT(&wheel->slots[level][slot]);
+  }
+  LIST_INIT(&wheel->expired);
+}
+
+static void xcp_timer_wheel_insert (XcpTimerWheel *wheel, XcpTimer *timer) {
+  // Expired deadlines are executed at the next processed tick.
+  uint64_t expires = (uint64_t)XCP_MAX(timer->deadline, (longlong)wheel->current);
+  const uint64_t delta = expires - wheel->current;
+
+  uint level = 0;
+  while (
+    level < XCP_TIMER_WHEEL_LEVEL_COUNT - 1 &&
+    delta >= (uint64_t)1 << xcp_timer_wheel_get_shift(level + 1)
+  )
+    ++level;
+
+  // Too far: put it in the last slot, it will be cascaded again.
+  const uint64_t max = ((uint64_t)1 << xcp_timer_wheel_get_shift(XCP_TIMER_WHEEL_LEVEL_COUNT)) - 1;
+  if (delta > max)
+    expires = wheel->current + max;
+
+  const uint slot = (uint)((expires >> xcp_timer_wheel_get_shift(level)) & SLOT_MASK);
+  timer->level = (uchar)level;
+  timer->slot = (uchar)slot;
+  LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, entry);
+  wheel->bitmaps[level] |= (uint64_t)1 << slot;
+}
+
+static void xcp_timer_wheel_unlink (XcpTimerWheel *wheel, XcpTimer *timer) {
+  LIST_REMOVE(timer, entry);
+  if (timer->level != EXPIRED_LEVEL && LIST_EMPTY(&wheel->slots[timer->level][timer->slot]))
+    wheel->bitmaps[timer->level] &= ~((uint64_t)1 << timer->slot);
+}
+
+void xcp_timer_wheel_add (XcpTimerWheel *wheel, XcpTimer *timer) {
+  xcp_timer_wheel_insert(wheel, timer);
+  timer->active = true;
+  ++wheel->count;
+}
+
+void xcp_timer_wheel_remove (XcpTimerWheel *wheel, XcpTimer *timer) {
+  xcp_timer_wheel_unlink(wheel, timer);
+  timer->active = false;
+  --wheel->count;
+}
+
+// Return the next tick to process: the next expiration of the first level or the next
+// cascade of the other levels. UINT64_MAX if the wheel is empty.
+static uint64_t xcp_timer_wheel_find_next (const XcpTimerWheel *wheel) {
+  uint64_t next = UINT64_MAX;
+
+  // Level 0 contains the timers of the next 64 ticks.
+  if (wheel->bitmaps[0]) {
+    const uint index = (uint)(wheel->current & SLOT_MASK);
+    next = wheel->current + (uint)__builtin_ctzll(xcp_rotate_right(wheel->bitmaps[0], index));
+  }
+
+  for (uint level = 1; level < XCP_TIMER_WHEEL_LEVEL_COUNT; ++level) {
+    if (!wheel->bitmaps[level])
+      continue;
+
+    // The slot of the current period is cascaded when the first tick of the period is
+    // processed. After that, it contains the timers of the next rotation.
+    const uint shift = xcp_timer_wheel_get_shift(level);
+    const uint64_t period = wheel->current >> shift;
+    const bool cascaded = wheel->current & (((uint64_t)1 << shift) - 1);
+    const uint index = (uint)((period + cascaded) & SLOT_MASK);
+    const uint64_t distance = (uint)__builtin_ctzll(xcp_rotate_right(wheel->bitmaps[level], index)) + cascaded;
+    next = XCP_MIN(next, (period + distance) << shift);
+  }
+
+  return next;
+}
+
+longlong xcp_timer_wheel_get_next_tick (const XcpTimerWheel *wheel) {
+  if (!wheel->count)
+    return -1;
+  if (!LIST_EMPTY(&wheel->expired))
+    return (longlong)wheel->current;
+  return (longlong)xcp_timer_wheel_find_next(wheel);
+}
+
+static void xcp_timer_wheel_cascade (XcpTimerWheel *wheel) {
+  for (uint level = 1; level < XCP_TIMER_WHEEL_LEVEL_COUNT; ++level) {
+    const uint slot = (uint)((wheel->current >> xcp_timer_wheel_get_shift(level)) & SLOT_MASK);
+
+    XcpTimerList *list = &wheel->slots[level][slot];
+    XcpTimer *timer;
+    while ((timer = LIST_FIRST(list))) {
+      LIST_REMOVE(timer, entry);
+      xcp_timer_wheel_insert(wheel, timer);
+    }
+    wheel->bitmaps[level] &= ~((uint64_t)1 << slot);
+
+    // The next level is cascaded only when this one wraps.
+    if (slot)
+      break;
+  }
+}
+
+size_t xcp_timer_wheel_advance (XcpTimerWheel *wheel, longlong now) {
+  if (now < 0)
+    return 0;
+
+  // 1. Move the expired timers in a separate list: callbacks can add or remove timers.
+  const uint64_t end = (uint64_t)now + 1;
+  while (wheel->current < end && wheel->count) {
+    const uint index = (uint)(wheel->current & SLOT_MASK);
+    if (!index)
+      xcp_timer_wheel_cascade(wheel);
+
+    if ((wheel->bitmaps[0] >> index) & 1) {
+      XcpTimerList *list = &wheel->slots[0][index];
+      XcpTimer *timer;
+      while ((timer = LIST_FIRST(list))) {
+        LIST_REMOVE(timer, entry);
+        timer->level = EXPIRED_LEVEL;
+        LIST_INSERT_HEAD(&wheel->expired, timer, entry);
+      }
+      wheel->bitmaps[0] &= ~((uint64_t)1 << index);
+    }
+
+    // Skip the ticks without expiration nor cascade.
+    const uint64_t next = xcp_timer_wheel_find_next(wheel);
+    wheel->current = next > wheel->current ? XCP_MIN(next, end) : wheel->current + 1;
+  }
+
+  if (wheel->current < end)
+    wheel->current = end;
+
+  // 2. Execute the callbacks.
+  size_t executed = 0;
+  XcpTimer *timer;
+  while ((timer = LIST_FIRST(&wheel->expired))) {
+    xcp_timer_wheel_remove(wheel, timer);
+    (*timer->cb)(timer->userData);
+    ++executed;
+  }
+  return executed;
+}
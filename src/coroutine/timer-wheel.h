@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _XCP_NG_COROUTINE_TIMER_WHEEL_H_
+#define _XCP_NG_COROUTINE_TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#include "xcp-ng/generic/timer.h"
+
+// =============================================================================
+
+// Hierarchical timing wheel with cascading (Varghese & Lauck), 1 tick = 1 ms.
+// Level `l` has 64 slots of 64^l ticks: the 6 levels cover ~2 years, farther timers
+// are cascaded again.
+
+#define XCP_TIMER_WHEEL_BITS 6
+#define XCP_TIMER_WHEEL_SLOT_COUNT (1 << XCP_TIMER_WHEEL_BITS)
+#define XCP_TIMER_WHEEL_LEVEL_COUNT 6
+
+typedef LIST_HEAD(XcpTimerList, XcpTimer) XcpTimerList;
+
+typedef struct {
+  // Next tick to process.
+  uint64_t current;
+
+  size_t count;
+
+  // Non-empty slots of each level.
+  uint64_t bitmaps[XCP_TIMER_WHEEL_LEVEL_COUNT];
+  XcpTimerList slots[XCP_TIMER_WHEEL_LEVEL_COUNT][XCP_TIMER_WHEEL_SLOT_COUNT];
+
+  // Expired timers whose callbacks are not executed yet.
+  XcpTimerList expired;
+} XcpTimerWheel;
+
+void xcp_timer_wheel_init (XcpTimerWheel *wheel, longlong now);
+
+void xcp_timer_wheel_add (XcpTimerWheel *wheel, XcpTimer *timer);
+
+void xcp_timer_wheel_remove (XcpTimerWheel *wheel, XcpTimer *timer);
+
+// Return the tick of the next expiration or cascade, -1 if there is no timer.
+XCP_NO_DISCARD longlong xcp_timer_wheel_get_next_tick (const XcpTimerWheel *wheel);
+
+// Execute the callbacks of the timers expired at `now`.
+// Return the count of executed callbacks.
+size_t xcp_timer_wheel_advance (XcpTimerWheel *wheel, longlong now);
+
+#endif // _XCP_NG_COROUTINE_TIMER_WHEEL_H_ included
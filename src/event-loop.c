@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2019  Vates SAS - ronan.abhamon@vates.fr
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "xcp-ng/generic/cancel.h"
+#include "xcp-ng/generic/event-loop.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+#include "xcp-ng/generic/reactor.h"
+#include "xcp-ng/generic/timer.h"
+
+// =============================================================================
+
+typedef enum {
+  XcpEventLoopFdNone = 0,
+  XcpEventLoopFdUser,
+  XcpEventLoopFdTimer,
+  XcpEventLoopFdNotifier,
+  XcpEventLoopFdSignal
+} XcpEventLoopFdType;
+
+typedef struct {
+  XcpEventLoopFdType type;
+  void *userData;
+} XcpEventLoopFd;
+
+struct XcpEventLoop {
+  int epollFd;
+
+  // Indexed by fd, the epoll events only contain the fd: the array can be reallocated.
+  XcpEventLoopFd *fds;
+  size_t fdsSize;
+
+  struct epoll_event *epollEvents;
+  uint epollEventsSize;
+};
+
+// -----------------------------------------------------------------------------
+
+static XcpEventLoopFd *xcp_event_loop_get_fd (XcpEventLoop *loop, int fd) {
+  if (fd < 0) {
+    errno = EBADF;
+    return NULL;
+  }
+
+  const size_t index = (size_t)fd;
+  if (index >= loop->fdsSize) {
+    size_t size = XCP_MAX(loop->fdsSize, (size_t)64);
+    while (size <= index)
+      size <<= 1;
+
+    XcpEventLoopFd *fds = realloc(loop->fds, size * sizeof *fds);
+    if (!fds)
+      return NULL;
+    memset(fds + loop->fdsSize, 0, (size - loop->fdsSize) * sizeof *fds);
+    loop->fds = fds;
+    loop->fdsSize = size;
+  }
+  return &loop->fds[index];
+}
+
+// Return the entry of a registered fd.
+static XcpEventLoopFd *xcp_event_loop_find_fd (XcpEventLoop *loop, int fd) {
+  if (fd < 0 || (size_t)fd >= loop->fdsSize || loop->fds[fd].type == XcpEventLoopFdNone) {
+    errno = ENOENT;
+    return NULL;
+  }
+  return &loop->fds[fd];
+}
+
+static uint32_t xcp_event_loop_to_epoll (int events) {
+  uint32_t epollEvents = 0;
+  if (events & XCP_EVENT_LOOP_READ)
+    epollEvents |= EPOLLIN | EPOLLRDHUP;
+  if (events & XCP_EVENT_LOOP_WRITE)
+    epollEvents |= EPOLLOUT;
+  if (events & XCP_EVENT_LOOP_EDGE)
+    epollEvents |= EPOLLET;
+  if (events & XCP_EVENT_LOOP_ONESHOT)
+    epollEvents |= EPOLLONESHOT;
+  return epollEvents;
+}
+
+static int xcp_event_loop_from_epoll (uint32_t epollEvents) {
+  int events = 0;
+  if (epollEvents & EPOLLIN)
+    events |= XCP_EVENT_LOOP_READ;
+  if (epollEvents & EPOLLOUT)
+    events |= XCP_EVENT_LOOP_WRITE;
+  if (epollEvents & EPOLLERR)
+    events |= XCP_EVENT_LOOP_ERROR;
+  if (epollEvents & (EPOLLHUP | EPOLLRDHUP))
+    events |= XCP_EVENT_LOOP_HANGUP;
+  return events;
+}
+
+static XcpError xcp_event_loop_register (
+  XcpEventLoop *loop,
+  int fd,
+  int events,
+  void *userData,
+  XcpEventLoopFdType type
+) {
+  XcpEventLoopFd *entry = xcp_event_loop_get_fd(loop, fd);
+  if (!entry)
+    return XCP_ERR_ERRNO;
+
+  if (entry->type != XcpEventLoopFdNone) {
+    errno = EEXIST;
+    return XCP_ERR_ERRNO;
+  }
+
+  struct epoll_event event = { .events = xcp_event_loop_to_epoll(events), .data.fd = fd };
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+    return XCP_ERR_ERRNO;
+
+  entry->type = type;
+  entry->userData = userData;
+  return XCP_ERR_OK;
+}
+
+// Register a source created by the loop, the fd is closed on error.
+static XcpError xcp_event_loop_register_source (
+  XcpEventLoop *loop,
+  int fd,
+  void *userData,
+  XcpEventLoopFdType type
+) {
+  if (xcp_event_loop_register(loop, fd, XCP_EVENT_LOOP_READ, userData, type) < 0) {
+    const int errnoValue = errno;
+    xcp_fd_close(fd);
+    errno = errnoValue;
+    return XCP_ERR_ERRNO;
+  }
+  return fd;
+}
+
+// Read the counter of a source. Return false if there is nothing to read.
+static bool xcp_event_loop_read_source (int fd, XcpEventLoopFdType type, ulonglong *value) {
+  if (type == XcpEventLoopFdSignal) {
+    struct signalfd_siginfo info;
+    if (xcp_fd_try_read(fd, &info, sizeof info) != (XcpError)sizeof info)
+      return false;
+    *value = info.ssi_signo;
+    return true;
+  }
+
+  uint64_t counter;
+  if (xcp_fd_try_read(fd, &counter, sizeof counter) != (XcpError)sizeof counter)
+    return false;
+  *value = counter;
+  return true;
+}
+
+// Convert the epoll events, the sources without value are dropped.
+static uint xcp_event_loop_fill (XcpEventLoop *loop, XcpEvent *events, uint count) {
+  uint filled = 0;
+  for (uint i = 0; i < count; ++i) {
+    const struct epoll_event *epollEvent = &loop->epollEvents[i];
+    const int fd = epollEvent->data.fd;
+    const XcpEventLoopFd *entry = &loop->fds[fd];
+
+    XcpEvent *event = &events[filled];
+    event->fd = fd;
+    event->events = xcp_event_loop_from_epoll(epollEvent->events);
+    event->userData = entry->userData;
+    event->value = 0;
+
+    if (
+      entry->type != XcpEventLoopFdUser &&
+      (event->events & XCP_EVENT_LOOP_READ) &&
+      !xcp_event_loop_read_source(fd, entry->type, &event->value)
+    )
+      continue;
+
+    ++filled;
+  }
+  return filled;
+}
+
+static XcpError xcp_event_loop_set_timerfd (int fd, int delay, int interval) {
+  struct itimerspec spec = {
+    .it_interval = { .tv_sec = interval / 1000, .tv_nsec = (interval % 1000) * 1000000L },
+    .it_value = { .tv_sec = delay / 1000, .tv_nsec = (delay % 1000) * 1000000L }
+  };
+  if (timerfd_settime(fd, 0, &spec, NULL) < 0)
+    return XCP_ERR_ERRNO;
+  return XCP_ERR_OK;
+}
+
+// -----------------------------------------------------------------------------
+
+XcpEventLoop *xcp_event_loop_create () {
+  XcpEventLoop *loop = calloc(1, sizeof *loop);
+  if (!loop)
+    return NULL;
+
+  if ((loop->epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    free(loop);
+    return NULL;
+  }
+
+  return loop;
+}
+
+void xcp_event_loop_destroy (XcpEventLoop *loop) {
+  for (size_t fd = 0; fd < loop->fdsSize; ++fd) {
+    const XcpEventLoopFdType type = loop->fds[fd].type;
+    if (type != XcpEventLoopFdNone && type != XcpEventLoopFdUser)
+      xcp_fd_close((int)fd);
+  }
+
+  xcp_fd_close(loop->epollFd);
+  free(loop->epollEvents);
+  free(loop->fds);
+  free(loop);
+}
+
+XcpError xcp_event_loop_add (XcpEventLoop *loop, int fd, int events, void *userData) {
+  return xcp_event_loop_register(loop, fd, events, userData, XcpEventLoopFdUser);
+}
+
+XcpError xcp_event_loop_modify (XcpEventLoop *loop, int fd, int events, void *userData) {
+  XcpEventLoopFd *entry = xcp_event_loop_find_fd(loop, fd);
+  if (!entry)
+    return XCP_ERR_ERRNO;
+
+  struct epoll_event event = { .events = xcp_event_loop_to_epoll(events), .data.fd = fd };
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+    return XCP_ERR_ERRNO;
+
+  entry->userData = userData;
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_event_loop_remove (XcpEventLoop *loop, int fd) {
+  XcpEventLoopFd *entry = xcp_event_loop_find_fd(loop, fd);
+  if (!entry)
+    return XCP_ERR_ERRNO;
+
+  const XcpEventLoopFdType type = entry->type;
+  entry->type = XcpEventLoopFdNone;
+  entry->userData = NULL;
+
+  // A closed fd is already removed from the epoll set.
+  if (epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != EBADF)
+    return XCP_ERR_ERRNO;
+
+  if (type != XcpEventLoopFdUser)
+    xcp_fd_close(fd);
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_event_loop_wait (XcpEventLoop *loop, XcpEvent *events, uint count, int timeout) {
+  if (!count) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  count = XCP_MIN(count, (uint)INT_MAX / (uint)sizeof *loop->epollEvents);
+  if (count > loop->epollEventsSize) {
+    struct epoll_event *epollEvents = realloc(loop->epollEvents, count * sizeof *epollEvents);
+    if (!epollEvents)
+      return XCP_ERR_ERRNO;
+    loop->epollEvents = epollEvents;
+    loop->epollEventsSize = count;
+  }
+
+  // Without coroutine nor token, the thread is directly blocked in epoll_wait. Otherwise the
+  // epoll fd is given to the reactor (or poll(2)) which handles the suspension and the token.
+  const bool useReactor = xcp_reactor_can_suspend() || xcp_cancel_get_current();
+  const longlong deadline = timeout > 0 ? xcp_timer_now() + timeout : -1;
+  for (;;) {
+    const int ret = epoll_wait(loop->epollFd, loop->epollEvents, (int)count, useReactor ? 0 : timeout);
+    if (ret > 0) {
+      const uint filled = xcp_event_loop_fill(loop, events, (uint)ret);
+      if (filled)
+        return (XcpError)filled;
+    } else if (ret < 0 && errno != EINTR)
+      return XCP_ERR_ERRNO;
+    else if (ret == 0 && !useReactor) {
+      errno = ETIMEDOUT;
+      return XCP_ERR_TIMEOUT;
+    }
+
+    if (deadline >= 0)
+      timeout = (int)XCP_MAX(deadline - xcp_timer_now(), 0LL);
+
+    if (useReactor) {
+      if (!timeout) {
+        errno = ETIMEDOUT;
+        return XCP_ERR_TIMEOUT;
+      }
+
+      const XcpError error = xcp_reactor_wait_fd(loop->epollFd, POLLIN, timeout);
+      if (error != XCP_ERR_OK)
+        return error;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_event_loop_add_timer (XcpEventLoop *loop, int delay, int interval, void *userData) {
+  const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    return XCP_ERR_ERRNO;
+
+  if (xcp_event_loop_set_timerfd(fd, delay, interval) < 0) {
+    const int errnoValue = errno;
+    xcp_fd_close(fd);
+    errno = errnoValue;
+    return XCP_ERR_ERRNO;
+  }
+
+  return xcp_event_loop_register_source(loop, fd, userData, XcpEventLoopFdTimer);
+}
+
+XcpError xcp_event_loop_set_timer (XcpEventLoop *loop, int fd, int delay, int interval) {
+  const XcpEventLoopFd *entry = xcp_event_loop_find_fd(loop, fd);
+  if (!entry)
+    return XCP_ERR_ERRNO;
+
+  if (entry->type != XcpEventLoopFdTimer) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  return xcp_event_loop_set_timerfd(fd, delay, interval);
+}
+
+XcpError xcp_event_loop_add_notifier (XcpEventLoop *loop, void *userData) {
+  const int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0)
+    return XCP_ERR_ERRNO;
+
+  return xcp_event_loop_register_source(loop, fd, userData, XcpEventLoopFdNotifier);
+}
+
+XcpError xcp_event_loop_notify (XcpEventLoop *loop, int fd, ulonglong value) {
+  // The entries are not read: the loop can be modified by its thread.
+  XCP_UNUSED(loop);
+
+  const uint64_t counter = value;
+  if (xcp_fd_try_write(fd, &counter, sizeof counter) < 0)
+    return XCP_ERR_ERRNO;
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_event_loop_add_signals (XcpEventLoop *loop, const sigset_t *mask, void *userData) {
+  const int fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    return XCP_ERR_ERRNO;
+
+  return xcp_event_loop_register_source(loop, fd, userData, XcpEventLoopFdSignal);
+}
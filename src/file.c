@@ -14,12 +14,19 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "xcp-ng/generic/file.h"
+#include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
 
 // =============================================================================
 
@@ -65,3 +72,187 @@ XcpError xcp_file_size (const char *filename) {
     return st.st_size;
   return 0; // TODO: Handle device block.
 }
+
+// -----------------------------------------------------------------------------
+
+static size_t xcp_file_page_size () {
+  static size_t pageSize;
+  if (XCP_UNLIKELY(!pageSize))
+    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+// Map, remap or unmap the file to `size` bytes.
+static XcpError xcp_file_map_set_size (XcpMappedFile *map, size_t size) {
+  if (size == map->size)
+    return XCP_ERR_OK;
+
+  void *data;
+  if (!size) {
+    munmap(map->data, map->size);
+    data = NULL;
+  } else if (map->size) {
+    if ((data = mremap(map->data, map->size, size, MREMAP_MAYMOVE)) == MAP_FAILED)
+      return XCP_ERR_ERRNO;
+  } else {
+    const int prot = (map->flags & XCP_FILE_MAP_WRITE) ? PROT_READ | PROT_WRITE : PROT_READ;
+    const int flags = (map->flags & XCP_FILE_MAP_POPULATE) ? MAP_SHARED | MAP_POPULATE : MAP_SHARED;
+    if ((data = mmap(NULL, size, prot, flags, map->fd, 0)) == MAP_FAILED)
+      return XCP_ERR_ERRNO;
+  }
+
+  // Best-effort: the new pages of a moved or extended mapping must be advised again.
+  if (data && (map->flags & XCP_FILE_MAP_HUGE_PAGES))
+    madvise(data, size, MADV_HUGEPAGE);
+
+  map->data = data;
+  map->size = size;
+  return XCP_ERR_OK;
+}
+
+// Compute the page-aligned range of the mapping to use. The range is empty for an empty
+// file: in this case `begin` is NULL.
+static XcpError xcp_file_map_get_range (const XcpMappedFile *map, size_t offset, char **begin, size_t *length) {
+  if (offset > map->size) {
+    errno = EINVAL;
+    return XCP_ERR_ERRNO;
+  }
+
+  if (!*length || *length > map->size - offset)
+    *length = map->size - offset;
+
+  const size_t pageOffset = XCP_ROUND_DOWN_2(offset, xcp_file_page_size());
+  *length += offset - pageOffset;
+  *begin = (char *)map->data + pageOffset;
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_file_map (XcpMappedFile *map, const char *filename, int flags) {
+  int fd;
+  const int openFlags = ((flags & XCP_FILE_MAP_WRITE) ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+  do {
+    fd = open(filename, openFlags);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0)
+    return XCP_ERR_ERRNO;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    goto fail;
+
+  if (!S_ISREG(st.st_mode)) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  map->data = NULL;
+  map->size = 0;
+  map->fd = fd;
+  map->flags = flags;
+  if (xcp_file_map_set_size(map, (size_t)st.st_size) < 0)
+    goto fail;
+
+  return XCP_ERR_OK;
+
+fail:
+  xcp_fd_close(fd);
+  return XCP_ERR_ERRNO;
+}
+
+void xcp_file_unmap (XcpMappedFile *map) {
+  if (map->size)
+    munmap(map->data, map->size);
+  xcp_fd_close(map->fd);
+
+  map->data = NULL;
+  map->size = 0;
+  map->fd = -1;
+}
+
+XcpError xcp_file_map_advise (const XcpMappedFile *map, size_t offset, size_t length, XcpFileMapAdvice advice) {
+  int value = MADV_NORMAL;
+  switch (advice) {
+    case XcpFileMapAdviceNormal:
+      value = MADV_NORMAL;
+      break;
+    case XcpFileMapAdviceSequential:
+      value = MADV_SEQUENTIAL;
+      break;
+    case XcpFileMapAdviceRandom:
+      value = MADV_RANDOM;
+      break;
+    case XcpFileMapAdviceWillNeed:
+      value = MADV_WILLNEED;
+      break;
+    case XcpFileMapAdviceDontNeed:
+      value = MADV_DONTNEED;
+      break;
+    case XcpFileMapAdviceHugePage:
+      value = MADV_HUGEPAGE;
+      break;
+  }
+
+  char *begin;
+  if (xcp_file_map_get_range(map, offset, &begin, &length) != XCP_ERR_OK)
+    return XCP_ERR_ERRNO;
+
+  if (length && madvise(begin, length, value) < 0)
+    return XCP_ERR_ERRNO;
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_file_map_prefault (const XcpMappedFile *map, size_t offset, size_t length) {
+  char *begin;
+  if (xcp_file_map_get_range(map, offset, &begin, &length) != XCP_ERR_OK)
+    return XCP_ERR_ERRNO;
+  if (!length)
+    return XCP_ERR_OK;
+
+  #ifdef MADV_POPULATE_READ
+    const int advice = (map->flags & XCP_FILE_MAP_WRITE) ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+    if (!madvise(begin, length, advice))
+      return XCP_ERR_OK;
+    if (errno != EINVAL)
+      return XCP_ERR_ERRNO;
+  #endif // ifdef MADV_POPULATE_READ
+
+  // Old kernel: read one byte of each page.
+  const size_t pageSize = xcp_file_page_size();
+  const volatile char *p = begin;
+  for (size_t pos = 0; pos < length; pos += pageSize)
+    (void)p[pos];
+  return XCP_ERR_OK;
+}
+
+XcpError xcp_file_map_refresh (XcpMappedFile *map) {
+  struct stat st;
+  if (fstat(map->fd, &st) < 0)
+    return XCP_ERR_ERRNO;
+  return xcp_file_map_set_size(map, (size_t)st.st_size);
+}
+
+XcpError xcp_file_map_resize (XcpMappedFile *map, size_t size) {
+  if (!(map->flags & XCP_FILE_MAP_WRITE)) {
+    errno = EBADF;
+    return XCP_ERR_ERRNO;
+  }
+
+  // Shrink the mapping before the file to never expose pages beyond EOF.
+  if (size < map->size && xcp_file_map_set_size(map, size) < 0)
+    return XCP_ERR_ERRNO;
+
+  int ret;
+  do {
+    ret = ftruncate(map->fd, (off_t)size);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return XCP_ERR_ERRNO;
+
+  return xcp_file_map_set_size(map, size);
+}
+
+XcpError xcp_file_map_sync (const XcpMappedFile *map) {
+  if (map->size && msync(map->data, map->size, MS_SYNC) < 0)
+    return XCP_ERR_ERRNO;
+  return XCP_ERR_OK;
+}
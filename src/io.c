@@ -14,16 +14,76 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include "config.h"
+#include "xcp-ng/generic/cancel.h"
 #include "xcp-ng/generic/io.h"
+#include "xcp-ng/generic/math.h"
+#include "xcp-ng/generic/reactor.h"
+#include "xcp-ng/generic/timer.h"
 
 // =============================================================================
 
+// IOV_MAX is only defined by <limits.h> with _XOPEN_SOURCE, this is the Linux value.
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif // ifndef IOV_MAX
+
+// Count of pollfd structures allocated on the stack by xcp_poll to add the token eventfd.
+#define POLL_STACK_FDS_COUNT 16
+
+// Max size given to one kernel copy call, the cancellation token is checked between calls.
+#define TRANSFER_CHUNK_SIZE (1UL << 30)
+
+// Size of the intermediate pipe of the splice copies (best-effort) and of the buffered copies.
+#define TRANSFER_PIPE_SIZE (1024UL * 1024UL)
+#define TRANSFER_BUFFER_SIZE (128UL * 1024UL)
+
+static inline bool xcp_fd_would_block () {
+  XCP_C_WARN_PUSH
+  XCP_C_WARN_DISABLE_LOGICAL_OP
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+  XCP_C_WARN_POP
+}
+
+// Flag of preadv2/pwritev2, defined by glibc >= 2.26 or <linux/fs.h>.
+#ifndef RWF_NOWAIT
+  #define RWF_NOWAIT 0x00000008
+#endif // ifndef RWF_NOWAIT
+
+typedef enum {
+  XcpIovOpRead,
+  XcpIovOpWrite,
+  XcpIovOpPread,
+  XcpIovOpPwrite
+} XcpIovOp;
+
+// Check if a failed read/write must be retried: return XCP_ERR_OK in this case, otherwise
+// the error to return (XCP_ERR_TIMEOUT if the deadline of the cancellation token is reached).
+// If the fd is not ready, wait until it is: the current coroutine is suspended by the
+// reactor if possible, otherwise the thread is blocked in poll(2). Never spin.
+static inline XcpError xcp_fd_retry (int fd, int events) {
+  if (errno == EINTR)
+    return XCP_ERR_OK;
+
+  return xcp_fd_would_block() ? xcp_reactor_wait_fd(fd, events, -1) : XCP_ERR_ERRNO;
+}
+
+// -----------------------------------------------------------------------------
+
 XcpError xcp_fd_close (int fd) {
   do {
     if (close(fd) == 0)
@@ -62,28 +122,26 @@ XcpError xcp_fd_set_close_on_exec (int fd, bool status) {
 // -----------------------------------------------------------------------------
 
 XcpError xcp_fd_wait_for_rdata (int fd, int timeout) {
-  struct pollfd fds = { fd, POLLIN, 0 };
-  do {
-    const int ret = poll(&fds, 1, timeout);
-    if (ret > 0)
-      return XCP_ERR_OK;
-    if (ret == 0)
-      return XCP_ERR_TIMEOUT;
-  } while (errno == EAGAIN || errno == EINTR);
-  return XCP_ERR_ERRNO;
+  return xcp_reactor_wait_fd(fd, POLLIN, timeout);
 }
 
 XcpError xcp_fd_read (int fd, void *buf, size_t count) {
+  XcpError error;
   do {
     const ssize_t ret = read(fd, buf, count);
     if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLIN)) == XCP_ERR_OK);
 
-  XCP_C_WARN_PUSH
-  XCP_C_WARN_DISABLE_LOGICAL_OP
-  } while (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-  XCP_C_WARN_POP
+  return error;
+}
 
-  return XCP_ERR_ERRNO;
+XcpError xcp_fd_try_read (int fd, void *buf, size_t count) {
+  do {
+    const ssize_t ret = read(fd, buf, count);
+    if (ret >= 0) return ret;
+  } while (errno == EINTR);
+
+  return xcp_fd_would_block() ? XCP_ERR_AGAIN : XCP_ERR_ERRNO;
 }
 
 XcpError xcp_fd_wait_read (int fd, void *buf, size_t count, int timeout) {
@@ -95,13 +153,16 @@ XcpError xcp_fd_wait_read (int fd, void *buf, size_t count, int timeout) {
 }
 
 XcpError xcp_fd_read_all (int fd, void *buf, size_t count, int timeout, size_t *offset) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
   size_t pos = 0;
   do {
-    const XcpError ret = xcp_fd_wait_read(fd, (char *)buf + pos, count - pos, timeout);
+    XcpError ret = xcp_cancel_check(cancel);
+    if (ret == XCP_ERR_OK)
+      ret = xcp_fd_wait_read(fd, (char *)buf + pos, count - pos, timeout);
     if (ret < 0) {
       if (offset)
         *offset = pos;
-      return XCP_ERR_ERRNO;
+      return ret;
     }
     if (ret == 0) break;
     pos += (size_t)ret;
@@ -114,26 +175,35 @@ XcpError xcp_fd_read_all (int fd, void *buf, size_t count, int timeout, size_t *
 // -----------------------------------------------------------------------------
 
 XcpError xcp_fd_write (int fd, const void *buf, size_t count) {
+  XcpError error;
   do {
     const ssize_t ret = write(fd, buf, count);
     if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLOUT)) == XCP_ERR_OK);
 
-  XCP_C_WARN_PUSH
-  XCP_C_WARN_DISABLE_LOGICAL_OP
-  } while (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-  XCP_C_WARN_POP
+  return error;
+}
 
-  return XCP_ERR_ERRNO;
+XcpError xcp_fd_try_write (int fd, const void *buf, size_t count) {
+  do {
+    const ssize_t ret = write(fd, buf, count);
+    if (ret >= 0) return ret;
+  } while (errno == EINTR);
+
+  return xcp_fd_would_block() ? XCP_ERR_AGAIN : XCP_ERR_ERRNO;
 }
 
 XcpError xcp_fd_write_all (int fd, const void *buf, size_t count, size_t *offset) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
   size_t pos = 0;
   do {
-    const XcpError ret = xcp_fd_write(fd, (char *)buf + pos, count - pos);
+    XcpError ret = xcp_cancel_check(cancel);
+    if (ret == XCP_ERR_OK)
+      ret = xcp_fd_write(fd, (char *)buf + pos, count - pos);
     if (ret < 0) {
       if (offset)
         *offset = pos;
-      return XCP_ERR_ERRNO;
+      return ret;
     }
     pos += (size_t)ret;
   } while (pos < count);
@@ -144,41 +214,610 @@ XcpError xcp_fd_write_all (int fd, const void *buf, size_t count, size_t *offset
 
 // -----------------------------------------------------------------------------
 
+XcpError xcp_fd_readv (int fd, const struct iovec *iovs, size_t iovCount) {
+  XcpError error;
+  do {
+    const ssize_t ret = readv(fd, iovs, (int)XCP_MIN(iovCount, (size_t)IOV_MAX));
+    if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLIN)) == XCP_ERR_OK);
+
+  return error;
+}
+
+XcpError xcp_fd_writev (int fd, const struct iovec *iovs, size_t iovCount) {
+  XcpError error;
+  do {
+    const ssize_t ret = writev(fd, iovs, (int)XCP_MIN(iovCount, (size_t)IOV_MAX));
+    if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLOUT)) == XCP_ERR_OK);
+
+  return error;
+}
+
+// -----------------------------------------------------------------------------
+
 XcpError xcp_fd_pread (int fd, void *buf, size_t count, off_t offset) {
+  if (xcp_reactor_can_suspend()) {
+    const struct iovec iov = { buf, count };
+    return xcp_reactor_preadv(fd, &iov, 1, offset);
+  }
+
+  XcpError error;
   do {
     const ssize_t ret = pread(fd, buf, count, offset);
     if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLIN)) == XCP_ERR_OK);
 
-  XCP_C_WARN_PUSH
-  XCP_C_WARN_DISABLE_LOGICAL_OP
-  } while (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-  XCP_C_WARN_POP
+  return error;
+}
 
-  return XCP_ERR_ERRNO;
+XcpError xcp_fd_pwrite (int fd, const void *buf, size_t count, off_t offset) {
+  if (xcp_reactor_can_suspend()) {
+    const struct iovec iov = { (void *)buf, count };
+    return xcp_reactor_pwritev(fd, &iov, 1, offset);
+  }
+
+  XcpError error;
+  do {
+    const ssize_t ret = pwrite(fd, buf, count, offset);
+    if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLOUT)) == XCP_ERR_OK);
+
+  return error;
 }
 
 XcpError xcp_fd_preadv (int fd, const struct iovec *iovs, size_t iovCount, off_t offset) {
+  iovCount = XCP_MIN(iovCount, (size_t)IOV_MAX);
+  if (xcp_reactor_can_suspend())
+    return xcp_reactor_preadv(fd, iovs, iovCount, offset);
+
+  XcpError error;
   do {
     const ssize_t ret = preadv(fd, iovs, (int)iovCount, offset);
     if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLIN)) == XCP_ERR_OK);
 
-  XCP_C_WARN_PUSH
-  XCP_C_WARN_DISABLE_LOGICAL_OP
-  } while (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-  XCP_C_WARN_POP
+  return error;
+}
 
-  return XCP_ERR_ERRNO;
+XcpError xcp_fd_pwritev (int fd, const struct iovec *iovs, size_t iovCount, off_t offset) {
+  iovCount = XCP_MIN(iovCount, (size_t)IOV_MAX);
+  if (xcp_reactor_can_suspend())
+    return xcp_reactor_pwritev(fd, iovs, iovCount, offset);
+
+  XcpError error;
+  do {
+    const ssize_t ret = pwritev(fd, iovs, (int)iovCount, offset);
+    if (ret >= 0) return ret;
+  } while ((error = xcp_fd_retry(fd, POLLOUT)) == XCP_ERR_OK);
+
+  return error;
+}
+
+// The reactor executes the operation asynchronously in a coroutine, synchronously otherwise.
+static inline XcpError xcp_fd_rwv2_result (XcpError ret, int flags) {
+  // Data not in the page cache.
+  if (ret == XCP_ERR_ERRNO && (flags & RWF_NOWAIT) && errno == EAGAIN)
+    return XCP_ERR_AGAIN;
+  return ret;
+}
+
+XcpError xcp_fd_preadv2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags) {
+  iovCount = XCP_MIN(iovCount, (size_t)IOV_MAX);
+  return xcp_fd_rwv2_result(xcp_reactor_preadv2(fd, iovs, iovCount, offset, flags), flags);
+}
+
+XcpError xcp_fd_pwritev2 (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, int flags) {
+  iovCount = XCP_MIN(iovCount, (size_t)IOV_MAX);
+  return xcp_fd_rwv2_result(xcp_reactor_pwritev2(fd, iovs, iovCount, offset, flags), flags);
 }
 
 // -----------------------------------------------------------------------------
 
-XcpError xcp_poll (struct pollfd *fds, uint nfds, int timeout) {
+// Transfer all bytes of an iovec array. The array is never modified: a partially
+// transferred iovec is completed with a single-iovec call before continuing with the
+// next ones, at most IOV_MAX iovecs are given to each call.
+static XcpError xcp_fd_iov_all (
+  XcpIovOp op,
+  int fd,
+  const struct iovec *iovs,
+  size_t iovCount,
+  off_t offset,
+  int timeout,
+  size_t *transferred
+) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
+  size_t pos = 0;
+  size_t index = 0;
+  size_t skip = 0; // Bytes already transferred in iovs[index].
+
+  for (;;) {
+    // Skip the completed and empty iovecs.
+    while (index < iovCount && skip == iovs[index].iov_len) {
+      ++index;
+      skip = 0;
+    }
+    if (index == iovCount)
+      break;
+
+    struct iovec head;
+    const struct iovec *chunk = iovs + index;
+    size_t chunkCount = iovCount - index;
+    if (skip) {
+      head.iov_base = (char *)iovs[index].iov_base + skip;
+      head.iov_len = iovs[index].iov_len - skip;
+      chunk = &head;
+      chunkCount = 1;
+    }
+
+    XcpError ret = xcp_cancel_check(cancel);
+    if (ret == XCP_ERR_OK) {
+      switch (op) {
+        case XcpIovOpRead:
+          if (timeout && (ret = xcp_fd_wait_for_rdata(fd, timeout)) != XCP_ERR_OK)
+            break;
+          ret = xcp_fd_readv(fd, chunk, chunkCount);
+          break;
+        case XcpIovOpWrite:
+          ret = xcp_fd_writev(fd, chunk, chunkCount);
+          break;
+        case XcpIovOpPread:
+          ret = xcp_fd_preadv(fd, chunk, chunkCount, offset + (off_t)pos);
+          break;
+        case XcpIovOpPwrite:
+          ret = xcp_fd_pwritev(fd, chunk, chunkCount, offset + (off_t)pos);
+          break;
+      }
+    }
+
+    if (ret < 0) {
+      if (transferred)
+        *transferred = pos;
+      return ret;
+    }
+    if (ret == 0) break; // EOF.
+
+    // Advance in the iovecs.
+    size_t count = (size_t)ret;
+    pos += count;
+    while (count) {
+      const size_t available = iovs[index].iov_len - skip;
+      if (count < available) {
+        skip += count;
+        break;
+      }
+      count -= available;
+      ++index;
+      skip = 0;
+    }
+  }
+
+  if (transferred)
+    *transferred = pos;
+  return (XcpError)pos;
+}
+
+XcpError xcp_fd_readv_all (int fd, const struct iovec *iovs, size_t iovCount, int timeout, size_t *offset) {
+  return xcp_fd_iov_all(XcpIovOpRead, fd, iovs, iovCount, 0, timeout, offset);
+}
+
+XcpError xcp_fd_writev_all (int fd, const struct iovec *iovs, size_t iovCount, size_t *offset) {
+  return xcp_fd_iov_all(XcpIovOpWrite, fd, iovs, iovCount, 0, 0, offset);
+}
+
+XcpError xcp_fd_pread_all (int fd, void *buf, size_t count, off_t offset, size_t *transferred) {
+  const struct iovec iov = { buf, count };
+  return xcp_fd_iov_all(XcpIovOpPread, fd, &iov, 1, offset, 0, transferred);
+}
+
+XcpError xcp_fd_pwrite_all (int fd, const void *buf, size_t count, off_t offset, size_t *transferred) {
+  const struct iovec iov = { (void *)buf, count };
+  return xcp_fd_iov_all(XcpIovOpPwrite, fd, &iov, 1, offset, 0, transferred);
+}
+
+XcpError xcp_fd_preadv_all (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, size_t *transferred) {
+  return xcp_fd_iov_all(XcpIovOpPread, fd, iovs, iovCount, offset, 0, transferred);
+}
+
+XcpError xcp_fd_pwritev_all (int fd, const struct iovec *iovs, size_t iovCount, off_t offset, size_t *transferred) {
+  return xcp_fd_iov_all(XcpIovOpPwrite, fd, iovs, iovCount, offset, 0, transferred);
+}
+
+// -----------------------------------------------------------------------------
+
+typedef enum {
+  XcpTransferCopyFileRange,
+  XcpTransferSendfile,
+  XcpTransferSplice,
+  XcpTransferBuffered
+} XcpTransferMethod;
+
+// Returned by a method which cannot be used, the next one is tried.
+#define TRANSFER_FALLBACK 1
+
+typedef struct {
+  int fdIn;
+  off_t *offIn;
+  int fdOut;
+  off_t *offOut;
+  size_t count;
+  size_t pos;
+  const XcpCancel *cancel;
+} XcpTransfer;
+
+static inline size_t xcp_fd_transfer_chunk (const XcpTransfer *transfer) {
+  return XCP_MIN(transfer->count - transfer->pos, TRANSFER_CHUNK_SIZE);
+}
+
+// Errors of the kernel copies when the fds or the file systems are not supported.
+static inline bool xcp_fd_transfer_is_unsupported () {
+  return errno == ENOSYS || errno == EINVAL || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF;
+}
+
+static inline XcpError xcp_fd_transfer_failed () {
+  return xcp_fd_transfer_is_unsupported() ? TRANSFER_FALLBACK : XCP_ERR_ERRNO;
+}
+
+static ssize_t xcp_copy_file_range (int fdIn, off_t *offIn, int fdOut, off_t *offOut, size_t count) {
+  #if defined(HAVE_COPY_FILE_RANGE)
+    return copy_file_range(fdIn, offIn, fdOut, offOut, count, 0);
+  #elif defined(SYS_copy_file_range)
+    return syscall(SYS_copy_file_range, fdIn, offIn, fdOut, offOut, count, 0);
+  #else
+    XCP_UNUSED(fdIn);
+    XCP_UNUSED(offIn);
+    XCP_UNUSED(fdOut);
+    XCP_UNUSED(offOut);
+    XCP_UNUSED(count);
+    errno = ENOSYS;
+    return -1;
+  #endif // if defined(HAVE_COPY_FILE_RANGE)
+}
+
+static XcpError xcp_fd_transfer_write (XcpTransfer *transfer, const void *buf, size_t count) {
+  size_t written;
+  const XcpError ret = transfer->offOut
+    ? xcp_fd_pwrite_all(transfer->fdOut, buf, count, *transfer->offOut, &written)
+    : xcp_fd_write_all(transfer->fdOut, buf, count, &written);
+
+  transfer->pos += written;
+  if (transfer->offOut)
+    *transfer->offOut += (off_t)written;
+  return ret < 0 ? ret : XCP_ERR_OK;
+}
+
+// Give back to the input `count` bytes which were read but not written: the caller can resume
+// from the input offset. The file position of a pipe or a socket cannot be restored.
+static void xcp_fd_transfer_unread (XcpTransfer *transfer, size_t count) {
+  if (!count)
+    return;
+
+  if (transfer->offIn)
+    *transfer->offIn -= (off_t)count;
+  else {
+    const int errnoValue = errno;
+    lseek(transfer->fdIn, -(off_t)count, SEEK_CUR);
+    errno = errnoValue;
+  }
+}
+
+static XcpError xcp_fd_transfer_copy_file_range (XcpTransfer *transfer) {
+  while (transfer->pos < transfer->count) {
+    XcpError error = xcp_cancel_check(transfer->cancel);
+    if (error != XCP_ERR_OK)
+      return error;
+
+    const ssize_t ret = xcp_copy_file_range(
+      transfer->fdIn, transfer->offIn, transfer->fdOut, transfer->offOut, xcp_fd_transfer_chunk(transfer)
+    );
+    if (ret > 0)
+      transfer->pos += (size_t)ret;
+    else if (ret == 0)
+      // Pseudo files (procfs, sysfs...) have a null size: let the other methods copy them.
+      return transfer->pos ? XCP_ERR_OK : TRANSFER_FALLBACK;
+    else if (errno != EINTR)
+      return xcp_fd_transfer_failed();
+  }
+  return XCP_ERR_OK;
+}
+
+static XcpError xcp_fd_transfer_sendfile (XcpTransfer *transfer) {
+  // The output is always written at the file position.
+  if (transfer->offOut)
+    return TRANSFER_FALLBACK;
+
+  while (transfer->pos < transfer->count) {
+    XcpError error = xcp_cancel_check(transfer->cancel);
+    if (error != XCP_ERR_OK)
+      return error;
+
+    const ssize_t ret = sendfile(
+      transfer->fdOut, transfer->fdIn, transfer->offIn, xcp_fd_transfer_chunk(transfer)
+    );
+    if (ret > 0)
+      transfer->pos += (size_t)ret;
+    else if (ret == 0)
+      break; // EOF.
+    else if ((error = xcp_fd_retry(transfer->fdOut, POLLOUT)) != XCP_ERR_OK)
+      return error == XCP_ERR_ERRNO ? xcp_fd_transfer_failed() : error;
+  }
+  return XCP_ERR_OK;
+}
+
+// Splice between a pipe and another fd. A non-blocking fd may be the input or the output:
+// wait for both before retrying.
+static XcpError xcp_fd_transfer_splice_direct (XcpTransfer *transfer) {
+  while (transfer->pos < transfer->count) {
+    XcpError error = xcp_cancel_check(transfer->cancel);
+    if (error != XCP_ERR_OK)
+      return error;
+
+    const ssize_t ret = splice(
+      transfer->fdIn, transfer->offIn, transfer->fdOut, transfer->offOut,
+      xcp_fd_transfer_chunk(transfer), SPLICE_F_MOVE | SPLICE_F_MORE
+    );
+    if (ret > 0)
+      transfer->pos += (size_t)ret;
+    else if (ret == 0)
+      break; // EOF.
+    else if (errno == EINTR)
+      continue;
+    else if (!xcp_fd_would_block())
+      return xcp_fd_transfer_failed();
+    else if (
+      (error = xcp_reactor_wait_fd(transfer->fdIn, POLLIN, -1)) != XCP_ERR_OK ||
+      (error = xcp_reactor_wait_fd(transfer->fdOut, POLLOUT, -1)) != XCP_ERR_OK
+    )
+      return error;
+  }
+  return XCP_ERR_OK;
+}
+
+// The output cannot be spliced: copy the bytes of the pipe with the buffered method.
+static XcpError xcp_fd_transfer_flush_pipe (XcpTransfer *transfer, int pipeFd, size_t count) {
+  char buf[PIPE_BUF];
+  while (count) {
+    XcpError ret = xcp_fd_read(pipeFd, buf, XCP_MIN(count, sizeof buf));
+    if (ret <= 0) {
+      xcp_fd_transfer_unread(transfer, count);
+      return ret ? ret : XCP_ERR_ERRNO;
+    }
+
+    const size_t pos = transfer->pos;
+    if ((ret = xcp_fd_transfer_write(transfer, buf, (size_t)ret)) != XCP_ERR_OK) {
+      xcp_fd_transfer_unread(transfer, count - (transfer->pos - pos));
+      return ret;
+    }
+    count -= transfer->pos - pos;
+  }
+  return TRANSFER_FALLBACK;
+}
+
+// Splice the input in a pipe, then the pipe in the output. The pipe is always drained before
+// the next fill: a would-block error is given by the input or by the output.
+static XcpError xcp_fd_transfer_splice_pipe (XcpTransfer *transfer, const int pipeFds[2]) {
+  const int pipeSize = fcntl(pipeFds[1], F_GETPIPE_SZ);
+  const size_t pipeCapacity = pipeSize > 0 ? (size_t)pipeSize : PIPE_BUF;
+
+  while (transfer->pos < transfer->count) {
+    XcpError error = xcp_cancel_check(transfer->cancel);
+    if (error != XCP_ERR_OK)
+      return error;
+
+    const ssize_t ret = splice(
+      transfer->fdIn, transfer->offIn, pipeFds[1], NULL,
+      XCP_MIN(transfer->count - transfer->pos, pipeCapacity), SPLICE_F_MOVE | SPLICE_F_MORE
+    );
+    if (ret == 0)
+      break; // EOF.
+    if (ret < 0) {
+      if ((error = xcp_fd_retry(transfer->fdIn, POLLIN)) == XCP_ERR_OK)
+        continue;
+      return error == XCP_ERR_ERRNO ? xcp_fd_transfer_failed() : error;
+    }
+
+    size_t pending = (size_t)ret;
+    while (pending) {
+      const ssize_t written = splice(
+        pipeFds[0], NULL, transfer->fdOut, transfer->offOut, pending, SPLICE_F_MOVE | SPLICE_F_MORE
+      );
+      if (written > 0) {
+        pending -= (size_t)written;
+        transfer->pos += (size_t)written;
+      } else if (written == 0) {
+        xcp_fd_transfer_unread(transfer, pending);
+        errno = EIO;
+        return XCP_ERR_ERRNO;
+      } else if ((error = xcp_fd_retry(transfer->fdOut, POLLOUT)) != XCP_ERR_OK) {
+        if (error != XCP_ERR_ERRNO || !xcp_fd_transfer_is_unsupported()) {
+          xcp_fd_transfer_unread(transfer, pending);
+          return error;
+        }
+        return xcp_fd_transfer_flush_pipe(transfer, pipeFds[0], pending);
+      }
+    }
+  }
+  return XCP_ERR_OK;
+}
+
+static XcpError xcp_fd_transfer_splice (XcpTransfer *transfer) {
+  struct stat in, out;
+  if (fstat(transfer->fdIn, &in) < 0 || fstat(transfer->fdOut, &out) < 0)
+    return XCP_ERR_ERRNO;
+
+  if (S_ISFIFO(in.st_mode) || S_ISFIFO(out.st_mode))
+    return xcp_fd_transfer_splice_direct(transfer);
+
+  int pipeFds[2];
+  if (pipe2(pipeFds, O_CLOEXEC) < 0)
+    return TRANSFER_FALLBACK;
+  fcntl(pipeFds[1], F_SETPIPE_SZ, (int)TRANSFER_PIPE_SIZE);
+
+  const XcpError ret = xcp_fd_transfer_splice_pipe(transfer, pipeFds);
+  const int errnoValue = errno;
+  xcp_fd_close(pipeFds[0]);
+  xcp_fd_close(pipeFds[1]);
+  errno = errnoValue;
+  return ret;
+}
+
+static XcpError xcp_fd_transfer_buffered (XcpTransfer *transfer) {
+  char *buf = malloc(TRANSFER_BUFFER_SIZE);
+  if (!buf)
+    return XCP_ERR_ERRNO;
+
+  XcpError ret = XCP_ERR_OK;
+  while (transfer->pos < transfer->count) {
+    if ((ret = xcp_cancel_check(transfer->cancel)) != XCP_ERR_OK)
+      break;
+
+    const size_t size = XCP_MIN(transfer->count - transfer->pos, TRANSFER_BUFFER_SIZE);
+    ret = transfer->offIn
+      ? xcp_fd_pread(transfer->fdIn, buf, size, *transfer->offIn)
+      : xcp_fd_read(transfer->fdIn, buf, size);
+    if (ret <= 0)
+      break;
+
+    const size_t readCount = (size_t)ret;
+    const size_t pos = transfer->pos;
+    if (transfer->offIn)
+      *transfer->offIn += ret;
+    if ((ret = xcp_fd_transfer_write(transfer, buf, readCount)) != XCP_ERR_OK) {
+      xcp_fd_transfer_unread(transfer, readCount - (transfer->pos - pos));
+      break;
+    }
+  }
+
+  free(buf);
+  return ret < 0 ? ret : XCP_ERR_OK;
+}
+
+static XcpError xcp_fd_transfer (
+  XcpTransferMethod method,
+  int fdIn,
+  off_t *offIn,
+  int fdOut,
+  off_t *offOut,
+  size_t count,
+  size_t *transferred
+) {
+  XcpTransfer transfer = {
+    .fdIn = fdIn,
+    .offIn = offIn,
+    .fdOut = fdOut,
+    .offOut = offOut,
+    .count = count,
+    .pos = 0,
+    .cancel = xcp_cancel_get_current()
+  };
+
+  XcpError ret = TRANSFER_FALLBACK;
+  for (; ret == TRANSFER_FALLBACK; ++method) {
+    switch (method) {
+      case XcpTransferCopyFileRange:
+        ret = xcp_fd_transfer_copy_file_range(&transfer);
+        break;
+      case XcpTransferSendfile:
+        ret = xcp_fd_transfer_sendfile(&transfer);
+        break;
+      case XcpTransferSplice:
+        ret = xcp_fd_transfer_splice(&transfer);
+        break;
+      case XcpTransferBuffered:
+        ret = xcp_fd_transfer_buffered(&transfer);
+        break;
+    }
+  }
+
+  if (transferred)
+    *transferred = transfer.pos;
+  return ret;
+}
+
+XcpError xcp_fd_copy_range (int fdIn, off_t *offIn, int fdOut, off_t *offOut, size_t count, size_t *transferred) {
+  return xcp_fd_transfer(XcpTransferCopyFileRange, fdIn, offIn, fdOut, offOut, count, transferred);
+}
+
+XcpError xcp_fd_sendfile (int fdOut, int fdIn, off_t *offset, size_t count, size_t *transferred) {
+  return xcp_fd_transfer(XcpTransferSendfile, fdIn, offset, fdOut, NULL, count, transferred);
+}
+
+XcpError xcp_fd_splice_all (int fdIn, off_t *offIn, int fdOut, off_t *offOut, size_t count, size_t *transferred) {
+  return xcp_fd_transfer(XcpTransferSplice, fdIn, offIn, fdOut, offOut, count, transferred);
+}
+
+// -----------------------------------------------------------------------------
+
+XcpError xcp_fd_fsync (int fd) {
+  if (xcp_reactor_can_suspend())
+    return xcp_reactor_fsync(fd, false);
+
   do {
+    if (fsync(fd) == 0)
+      return XCP_ERR_OK;
+  } while (errno == EINTR);
+  return XCP_ERR_ERRNO;
+}
+
+XcpError xcp_fd_fdatasync (int fd) {
+  if (xcp_reactor_can_suspend())
+    return xcp_reactor_fsync(fd, true);
+
+  do {
+    if (fdatasync(fd) == 0)
+      return XCP_ERR_OK;
+  } while (errno == EINTR);
+  return XCP_ERR_ERRNO;
+}
+
+// -----------------------------------------------------------------------------
+
+// The timeout is recomputed from an absolute deadline after each interruption.
+static XcpError xcp_poll_until (struct pollfd *fds, uint nfds, int timeout) {
+  const longlong deadline = timeout > 0 ? xcp_timer_now() + timeout : -1;
+  for (;;) {
     const int ret = poll(fds, nfds, timeout);
     if (ret > 0)
       return ret;
-    if (ret == 0)
+    if (ret == 0) {
+      errno = ETIMEDOUT;
       return XCP_ERR_TIMEOUT;
-  } while (errno == EAGAIN || errno == EINTR);
-  return XCP_ERR_ERRNO;
+    }
+    if (errno != EAGAIN && errno != EINTR)
+      return XCP_ERR_ERRNO;
+    if (deadline >= 0)
+      timeout = (int)XCP_MAX(deadline - xcp_timer_now(), 0LL);
+  }
+}
+
+XcpError xcp_poll (struct pollfd *fds, uint nfds, int timeout) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
+  if (!cancel)
+    return xcp_poll_until(fds, nfds, timeout);
+
+  XcpError ret = xcp_cancel_check(cancel);
+  if (ret != XCP_ERR_OK)
+    return ret;
+
+  // Poll a copy of the fds with the eventfd of the token.
+  struct pollfd stackFds[POLL_STACK_FDS_COUNT];
+  struct pollfd *allFds = stackFds;
+  if (nfds >= POLL_STACK_FDS_COUNT && !(allFds = malloc((nfds + 1) * sizeof *allFds)))
+    return XCP_ERR_ERRNO;
+
+  memcpy(allFds, fds, nfds * sizeof *fds);
+  allFds[nfds] = (struct pollfd){ cancel->eventFd, POLLIN, 0 };
+
+  ret = xcp_poll_until(allFds, nfds + 1, xcp_cancel_get_timeout(cancel, timeout));
+  if (ret > 0 && allFds[nfds].revents && !--ret) {
+    errno = ECANCELED;
+    ret = XCP_ERR_ERRNO;
+  } else if (ret > 0) {
+    for (uint i = 0; i < nfds; ++i)
+      fds[i].revents = allFds[i].revents;
+  }
+
+  if (allFds != stackFds)
+    free(allFds);
+  return ret;
 }
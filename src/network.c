@@ -15,20 +15,43 @@
  */
 
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 
+#include "xcp-ng/generic/cancel.h"
 #include "xcp-ng/generic/io.h"
 #include "xcp-ng/generic/network.h"
+#include "xcp-ng/generic/reactor.h"
 
 // =============================================================================
 
 XcpError xcp_sock_connect (int sock, const struct sockaddr *addr, socklen_t addrlen) {
+  const XcpCancel *cancel = xcp_cancel_get_current();
+  XcpError ret = xcp_cancel_check(cancel);
+  if (ret != XCP_ERR_OK)
+    return ret;
+
   do {
-    const int ret = connect(sock, addr, addrlen);
-    if (ret >= 0)
-      return ret;
+    if (connect(sock, addr, addrlen) >= 0)
+      return XCP_ERR_OK;
   } while (errno == EINTR);
-  return XCP_ERR_ERRNO;
+
+  // Non-blocking socket: wait for the connection if the caller can be suspended or interrupted.
+  if (errno != EINPROGRESS || (!cancel && !xcp_reactor_can_suspend()))
+    return XCP_ERR_ERRNO;
+
+  if ((ret = xcp_reactor_wait_fd(sock, POLLOUT, -1)) != XCP_ERR_OK)
+    return ret;
+
+  int error;
+  socklen_t size = sizeof error;
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &size) < 0)
+    return XCP_ERR_ERRNO;
+  if (error) {
+    errno = error;
+    return XCP_ERR_ERRNO;
+  }
+  return XCP_ERR_OK;
 }
 
 XcpError xcp_sock_send_shared_fd (int sock, const void *buf, size_t count, int sharedFd) {
@@ -60,7 +83,7 @@ XcpError xcp_sock_send_shared_fd (int sock, const void *buf, size_t count, int s
   // Use memcpy because cmsg data pointer might not be sufficiently well aligned...
   memcpy(CMSG_DATA(cmsg), &sharedFd, sizeof sharedFd);
 
-  do {
+  for (;;) {
     // Try to send buf and shared socket.
     const ssize_t ret = sendmsg(sock, &msg, 0);
     if (ret >= 0) {
@@ -72,10 +95,18 @@ XcpError xcp_sock_send_shared_fd (int sock, const void *buf, size_t count, int s
       return xcp_fd_write_all(sock, (char *)buf + ret, count - (size_t)ret, &offset);
     }
 
-  XCP_C_WARN_PUSH
-  XCP_C_WARN_DISABLE_LOGICAL_OP
-  } while (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
-  XCP_C_WARN_POP
+    if (errno == EINTR)
+      continue;
+
+    // Wait for the socket buffer instead of spinning.
+    XCP_C_WARN_PUSH
+    XCP_C_WARN_DISABLE_LOGICAL_OP
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return XCP_ERR_ERRNO;
+    XCP_C_WARN_POP
 
-  return XCP_ERR_ERRNO;
+    const XcpError error = xcp_reactor_wait_fd(sock, POLLOUT, -1);
+    if (error != XCP_ERR_OK)
+      return error;
+  }
 }